@@ -27,6 +27,7 @@
 #include "libmpcodecs/vd.h"
 #include "libmpcodecs/vf_scale.h"
 #include "libmpdemux/demux_audio.h"
+#include "libmpdemux/demux_index.h"
 #include "libmpdemux/demux_mpg.h"
 #include "libmpdemux/demux_ts.h"
 #include "libmpdemux/demux_viv.h"
@@ -35,6 +36,7 @@
 #include "sub/sub.h"
 #include "sub/unrar_exec.h"
 #include "osdep/priority.h"
+#include "stream/cache2.h"
 #include "stream/cdd.h"
 #include "stream/network.h"
 #include "stream/pvr.h"
@@ -43,6 +45,7 @@
 #include "stream/tcp.h"
 #include "stream/tv.h"
 #include "stream/udp.h"
+#include "stream/udp_recv.h"
 #include "codec-cfg.h"
 #include "config.h"
 #include "m_config.h"
@@ -182,6 +185,8 @@ const m_option_t mfopts_conf[]={
     {"h", &mf_h, CONF_TYPE_INT, 0, 0, 0, NULL},
     {"fps", &mf_fps, CONF_TYPE_DOUBLE, 0, 0, 0, NULL},
     {"type", &mf_type, CONF_TYPE_STRING, 0, 0, 0, NULL},
+    {"threads", &mf_threads, CONF_TYPE_INT, CONF_RANGE, 0, 64, NULL},
+    {"prefetch", &mf_prefetch, CONF_TYPE_INT, CONF_RANGE, 1, 1024, NULL},
     {NULL, NULL, 0, 0, 0, 0, NULL}
 };
 
@@ -321,9 +326,15 @@ const m_option_t common_opts[] = {
     {"nocache", &stream_cache_size, CONF_TYPE_FLAG, 0, 1, 0, NULL},
     {"cache-min", &stream_cache_min_percent, CONF_TYPE_FLOAT, CONF_RANGE, 0, 99, NULL},
     {"cache-seek-min", &stream_cache_seek_min_percent, CONF_TYPE_FLOAT, CONF_RANGE, 0, 99, NULL},
+    {"cache-disk", &stream_cache_disk_size, CONF_TYPE_INT, CONF_MIN, 0, 0, NULL},
+    {"cache-disk-dir", &stream_cache_disk_dir, CONF_TYPE_STRING, 0, 0, 0, NULL},
+    {"cache-stats", &stream_cache_stats, CONF_TYPE_INT, CONF_RANGE, 0, 3600, NULL},
 #else
     {"cache", "MPlayer was compiled without cache2 support.\n", CONF_TYPE_PRINT, CONF_NOCFG, 0, 0, NULL},
 #endif /* CONFIG_STREAM_CACHE */
+    {"file-mmap", &stream_file_mmap, CONF_TYPE_FLAG, 0, 0, 1, NULL},
+    {"nofile-mmap", &stream_file_mmap, CONF_TYPE_FLAG, 0, 1, 0, NULL},
+    {"file-readahead", &stream_file_readahead, CONF_TYPE_INT, CONF_RANGE, 0, 64, NULL},
     {"vcd", "-vcd N has been removed, use vcd://N instead.\n", CONF_TYPE_PRINT, CONF_NOCFG ,0,0, NULL},
     {"cuefile", "-cuefile has been removed, use cue://filename:N where N is the track number.\n", CONF_TYPE_PRINT, 0, 0, 0, NULL},
     {"cdrom-device", &cdrom_device, CONF_TYPE_STRING, 0, 0, 0, NULL},
@@ -356,6 +367,9 @@ const m_option_t common_opts[] = {
     {"passwd", &network_password, CONF_TYPE_STRING, 0, 0, 0, NULL},
     {"bandwidth", &network_bandwidth, CONF_TYPE_INT, CONF_MIN, 0, 0, NULL},
     {"http-header-fields", &network_http_header_fields, CONF_TYPE_STRING_LIST, 0, 0, 0, NULL},
+    {"http-keep-alive", &network_http_keep_alive, CONF_TYPE_FLAG, 0, 0, 1, NULL},
+    {"nohttp-keep-alive", &network_http_keep_alive, CONF_TYPE_FLAG, 0, 1, 0, NULL},
+    {"http-parallel", &network_http_parallel, CONF_TYPE_INT, CONF_RANGE, 0, 16, NULL},
     {"user-agent", &network_useragent, CONF_TYPE_STRING, 0, 0, 0, NULL},
     {"referrer", &network_referrer, CONF_TYPE_STRING, 0, 0, 0, NULL},
     {"cookies", &network_cookies_enabled, CONF_TYPE_FLAG, 0, 0, 1, NULL},
@@ -363,6 +377,7 @@ const m_option_t common_opts[] = {
     {"cookies-file", &cookies_file, CONF_TYPE_STRING, 0, 0, 0, NULL},
     {"prefer-ipv4", &network_prefer_ipv4, CONF_TYPE_FLAG, 0, 0, 1, NULL},
     {"ipv4-only-proxy", &network_ipv4_only_proxy, CONF_TYPE_FLAG, 0, 0, 1, NULL},
+    {"rtp-jitter", &rtp_jitter, CONF_TYPE_INT, CONF_RANGE, 0, 1000, NULL},
     {"reuse-socket", &reuse_socket, CONF_TYPE_FLAG, CONF_GLOBAL, 0, 1, NULL},
     {"noreuse-socket", &reuse_socket, CONF_TYPE_FLAG, CONF_GLOBAL, 1, 0, NULL},
 #ifdef HAVE_AF_INET6
@@ -427,6 +442,7 @@ const m_option_t common_opts[] = {
     {"forceidx", &index_mode, CONF_TYPE_FLAG, 0, -1, 2, NULL},
     {"saveidx", &index_file_save, CONF_TYPE_STRING, 0, 0, 0, NULL},
     {"loadidx", &index_file_load, CONF_TYPE_STRING, 0, 0, 0, NULL},
+    {"idx-cache-dir", &index_cache_dir, CONF_TYPE_STRING, 0, 0, 0, NULL},
 
     // select audio/video/subtitle stream
     {"aid", &audio_id, CONF_TYPE_INT, CONF_RANGE, -2, 8190, NULL},
@@ -438,6 +454,8 @@ const m_option_t common_opts[] = {
 
     { "hr-mp3-seek", &hr_mp3_seek, CONF_TYPE_FLAG, 0, 0, 1, NULL },
     { "nohr-mp3-seek", &hr_mp3_seek, CONF_TYPE_FLAG, 0, 1, 0, NULL},
+    { "mp3-index", &mp3_build_index, CONF_TYPE_FLAG, 0, 0, 1, NULL },
+    { "nomp3-index", &mp3_build_index, CONF_TYPE_FLAG, 0, 1, 0, NULL},
 
     { "rawaudio", &demux_rawaudio_opts, CONF_TYPE_SUBCONFIG, 0, 0, 0, NULL},
     { "rawvideo", &demux_rawvideo_opts, CONF_TYPE_SUBCONFIG, 0, 0, 0, NULL},
@@ -455,6 +473,12 @@ const m_option_t common_opts[] = {
     { "sub-demuxer", &sub_demuxer_name, CONF_TYPE_STRING, 0, 0, 0, NULL },
     { "extbased", &extension_parsing, CONF_TYPE_FLAG, 0, 0, 1, NULL },
     { "noextbased", &extension_parsing, CONF_TYPE_FLAG, 0, 1, 0, NULL },
+    { "demuxer-max-audio-secs", &demux_max_audio_secs, CONF_TYPE_FLOAT, CONF_RANGE, 0, 3600, NULL },
+    { "demuxer-max-video-secs", &demux_max_video_secs, CONF_TYPE_FLOAT, CONF_RANGE, 0, 3600, NULL },
+    { "demuxer-max-kbytes", &demux_max_kbytes, CONF_TYPE_INT, CONF_RANGE, 0, 2097151, NULL },
+    { "demuxer-probe-size", &demux_probe_kbytes, CONF_TYPE_INT, CONF_RANGE, 0, 65536, NULL },
+    { "demuxer-save-index", &demuxer_save_index, CONF_TYPE_FLAG, 0, 0, 1, NULL },
+    { "nodemuxer-save-index", &demuxer_save_index, CONF_TYPE_FLAG, 0, 1, 0, NULL },
 
     {"mf", mfopts_conf, CONF_TYPE_SUBCONFIG, 0,0,0, NULL},
 #ifdef CONFIG_RADIO
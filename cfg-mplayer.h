@@ -288,6 +288,11 @@ const m_option_t mplayer_opts[]={
     {"dumpsami", &stream_dump_type, CONF_TYPE_FLAG, 0, 0, 9, NULL},
 
     {"capture", &capture_dump, CONF_TYPE_FLAG, 0, 0, 1, NULL},
+    {"capture-buffer", &stream_capture_buffer, CONF_TYPE_INT, CONF_RANGE, 64, 1048576, NULL},
+
+    {"demuxer-thread", &demuxer_thread, CONF_TYPE_FLAG, 0, 0, 1, NULL},
+    {"nodemuxer-thread", &demuxer_thread, CONF_TYPE_FLAG, 0, 1, 0, NULL},
+    {"demuxer-thread-buffer", &demuxer_thread_buffer, CONF_TYPE_INT, CONF_RANGE, 64, 16384, NULL},
 
 #ifdef CONFIG_LIRC
     {"lircconf", &lirc_configfile, CONF_TYPE_STRING, CONF_GLOBAL, 0, 0, NULL},
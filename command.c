@@ -53,6 +53,7 @@
 #include "sub/vobsub.h"
 #include "sub/spudec.h"
 #include "path.h"
+#include "stream/cache2.h"
 #include "stream/tv.h"
 #include "stream/stream_radio.h"
 #include "stream/pvr.h"
@@ -380,6 +381,66 @@ static int mp_property_stream_time_pos(m_option_t *prop, int action,
     return m_property_time_ro(prop, action, arg, mpctx->demuxer->stream_pts);
 }
 
+#ifdef CONFIG_STREAM_CACHE
+enum {
+    CACHE_FILL,
+    CACHE_FILLED_BYTES,
+    CACHE_FILL_BYTES,
+    CACHE_READ_BYTES,
+    CACHE_UNDERRUNS,
+    CACHE_STALL_TIME,
+    CACHE_SEEK_HITS,
+    CACHE_SEEK_MISSES,
+    CACHE_FILL_RATE,
+    CACHE_REFILL_LATENCY,
+};
+
+/// Cache statistics (RO)
+static int mp_property_cache(m_option_t *prop, int action, void *arg,
+                             MPContext *mpctx)
+{
+    cache_stats_t st;
+    int64_t bytes;
+
+    if (!mpctx->stream || cache_get_stats(mpctx->stream, &st) < 0)
+        return M_PROPERTY_UNAVAILABLE;
+    switch ((intptr_t) prop->priv) {
+    case CACHE_FILL:
+        return m_property_int_ro(prop, action, arg, st.fill_percent);
+    case CACHE_FILLED_BYTES:
+        bytes = st.filled;
+        break;
+    case CACHE_FILL_BYTES:
+        bytes = st.fill_bytes;
+        break;
+    case CACHE_READ_BYTES:
+        bytes = st.read_bytes;
+        break;
+    case CACHE_UNDERRUNS:
+        return m_property_int_ro(prop, action, arg, st.underruns);
+    case CACHE_STALL_TIME:
+        return m_property_double_ro(prop, action, arg, st.stall_time);
+    case CACHE_SEEK_HITS:
+        return m_property_int_ro(prop, action, arg, st.seek_hits);
+    case CACHE_SEEK_MISSES:
+        return m_property_int_ro(prop, action, arg, st.seek_misses);
+    case CACHE_FILL_RATE:
+        return m_property_bitrate(prop, action, arg, st.fill_rate);
+    case CACHE_REFILL_LATENCY:
+        return m_property_double_ro(prop, action, arg, st.refill_latency);
+    default:
+        return M_PROPERTY_NOT_IMPLEMENTED;
+    }
+    switch (action) {
+    case M_PROPERTY_GET:
+        if (!arg)
+            return M_PROPERTY_ERROR;
+        *(off_t *) arg = bytes;
+        return M_PROPERTY_OK;
+    }
+    return M_PROPERTY_NOT_IMPLEMENTED;
+}
+#endif
 
 /// Media length in seconds (RO)
 static int mp_property_length(m_option_t *prop, int action, void *arg,
@@ -1122,7 +1183,7 @@ static int mp_property_capture(m_option_t *prop, int action,
                                void *arg, MPContext *mpctx)
 {
     int ret;
-    int capturing = mpctx->stream && mpctx->stream->capture_file;
+    int capturing = mpctx->stream && mpctx->stream->capture;
 
     if (!mpctx->stream)
         return M_PROPERTY_UNAVAILABLE;
@@ -1133,18 +1194,15 @@ static int mp_property_capture(m_option_t *prop, int action,
     }
 
     ret = m_property_flag(prop, action, arg, &capturing);
-    if (ret == M_PROPERTY_OK && capturing != !!mpctx->stream->capture_file) {
+    if (ret == M_PROPERTY_OK && capturing != !!mpctx->stream->capture) {
         if (capturing) {
-            mpctx->stream->capture_file = fopen(stream_dump_name, "ab");
-            if (!mpctx->stream->capture_file) {
+            if (stream_capture_open(mpctx->stream, stream_dump_name) < 0) {
                 mp_msg(MSGT_GLOBAL, MSGL_ERR,
                        "Error opening capture file: %s\n", strerror(errno));
                 ret = M_PROPERTY_ERROR;
             }
-        } else {
-            fclose(mpctx->stream->capture_file);
-            mpctx->stream->capture_file = NULL;
-        }
+        } else
+            stream_capture_close(mpctx->stream);
     }
 
     switch (ret) {
@@ -1153,7 +1211,7 @@ static int mp_property_capture(m_option_t *prop, int action,
         break;
     case M_PROPERTY_OK:
         set_osd_msg(OSD_MSG_SPEED, 1, osd_duration, MSGTR_OSDCapturing,
-                    mpctx->stream->capture_file ? MSGTR_Enabled : MSGTR_Disabled);
+                    mpctx->stream->capture ? MSGTR_Enabled : MSGTR_Disabled);
         break;
     default:
         break;
@@ -2100,6 +2158,28 @@ static const m_option_t mp_properties[] = {
      M_OPT_MIN, 0, 0, NULL },
     { "stream_time_pos", mp_property_stream_time_pos, CONF_TYPE_TIME,
      M_OPT_MIN, 0, 0, NULL },
+#ifdef CONFIG_STREAM_CACHE
+    { "cache_fill", mp_property_cache, CONF_TYPE_INT,
+     M_OPT_RANGE, 0, 100, (void *) CACHE_FILL },
+    { "cache_filled_bytes", mp_property_cache, CONF_TYPE_POSITION,
+     0, 0, 0, (void *) CACHE_FILLED_BYTES },
+    { "cache_fill_bytes", mp_property_cache, CONF_TYPE_POSITION,
+     0, 0, 0, (void *) CACHE_FILL_BYTES },
+    { "cache_read_bytes", mp_property_cache, CONF_TYPE_POSITION,
+     0, 0, 0, (void *) CACHE_READ_BYTES },
+    { "cache_underruns", mp_property_cache, CONF_TYPE_INT,
+     0, 0, 0, (void *) CACHE_UNDERRUNS },
+    { "cache_stall_time", mp_property_cache, CONF_TYPE_DOUBLE,
+     0, 0, 0, (void *) CACHE_STALL_TIME },
+    { "cache_seek_hits", mp_property_cache, CONF_TYPE_INT,
+     0, 0, 0, (void *) CACHE_SEEK_HITS },
+    { "cache_seek_misses", mp_property_cache, CONF_TYPE_INT,
+     0, 0, 0, (void *) CACHE_SEEK_MISSES },
+    { "cache_fill_rate", mp_property_cache, CONF_TYPE_INT,
+     0, 0, 0, (void *) CACHE_FILL_RATE },
+    { "cache_refill_latency", mp_property_cache, CONF_TYPE_DOUBLE,
+     0, 0, 0, (void *) CACHE_REFILL_LATENCY },
+#endif
     { "length", mp_property_length, CONF_TYPE_TIME,
      M_OPT_MIN, 0, 0, NULL },
     { "percent_pos", mp_property_percent_pos, CONF_TYPE_INT,
@@ -18,10 +18,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "mp_msg.h"
 #include "help_mp.h"
 
@@ -53,6 +61,354 @@ static int avi_idx_cmp(const void *elem1, const void *elem2)
   return (a > b) - (b > a);
 }
 
+#define IDX_CACHE_HASH_BYTES 65536  // start of the file that goes into the key
+
+/**
+ * Read an index saved by avi_write_index(), errors are shown at level.
+ */
+static int avi_read_index(const char *name, int level,
+                          AVIINDEXENTRY **index, int *size)
+{
+  FILE *fp;
+  char magic[6];
+  int n;
+
+  if ((fp = fopen(name, "rb")) == NULL) {
+    mp_msg(MSGT_HEADER,level, MSGTR_MPDEMUX_AVIHDR_CantReadIdxFile, name, strerror(errno));
+    return 0;
+  }
+  if (fread(magic, 6, 1, fp) != 1 || strncmp(magic, "MPIDX1", 6) ||
+      fread(&n, sizeof(n), 1, fp) != 1 ||
+      n <= 0 || n > INT_MAX / sizeof(AVIINDEXENTRY)) {
+    mp_msg(MSGT_HEADER,level, MSGTR_MPDEMUX_AVIHDR_NotValidMPidxFile, name);
+    fclose(fp);
+    return 0;
+  }
+  *index = malloc(n * sizeof(AVIINDEXENTRY));
+  if (!*index) {
+    mp_msg(MSGT_HEADER,level, MSGTR_MPDEMUX_AVIHDR_FailedMallocForIdxFile, name);
+    fclose(fp);
+    return 0;
+  }
+  if (fread(*index, sizeof(AVIINDEXENTRY), n, fp) != n) {
+    mp_msg(MSGT_HEADER,level, MSGTR_MPDEMUX_AVIHDR_PrematureEOF, name);
+    free(*index);
+    *index = NULL;
+    fclose(fp);
+    return 0;
+  }
+  fclose(fp);
+  *size = n;
+  return 1;
+}
+
+static int avi_write_index(const char *name, int level,
+                           AVIINDEXENTRY *index, int size)
+{
+  FILE *fp;
+  int ok;
+
+  if ((fp = fopen(name, "wb")) == NULL) {
+    mp_msg(MSGT_HEADER,level, MSGTR_MPDEMUX_AVIHDR_Failed2WriteIdxFile, name, strerror(errno));
+    return 0;
+  }
+  ok = fwrite("MPIDX1", 6, 1, fp) == 1 &&
+       fwrite(&size, sizeof(size), 1, fp) == 1 &&
+       fwrite(index, sizeof(AVIINDEXENTRY), size, fp) == size;
+  if (fclose(fp))
+    ok = 0;
+  if (!ok) {
+    mp_msg(MSGT_HEADER,level, MSGTR_MPDEMUX_AVIHDR_Failed2WriteIdxFile, name, strerror(errno));
+    remove(name);
+  }
+  return ok;
+}
+
+/**
+ * Name of the file in -idx-cache-dir for the file played, NULL if there is
+ * none. It is made from the size, the modification time and a hash of the
+ * start of the file, so a file that changed does not get a stale index.
+ */
+static char *avi_cache_name(demuxer_t *demuxer)
+{
+  stream_t *s = demuxer->stream;
+  const char *path = s->url;
+  uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+  unsigned char *buf;
+  struct stat st;
+  char *name;
+  int i, len;
+
+  if (!index_cache_dir || !*index_cache_dir || s->type != STREAMTYPE_FILE ||
+      !path || s->end_pos <= 0)
+    return NULL;
+  if (!strncmp(path, "file://", 7))
+    path += 7;
+  if (stat(path, &st))
+    return NULL;
+  if (!(buf = malloc(IDX_CACHE_HASH_BYTES)))
+    return NULL;
+  stream_reset(s);
+  stream_seek(s, s->start_pos);
+  len = stream_read(s, buf, IDX_CACHE_HASH_BYTES);
+  for (i = 0; i < len; i++)
+    hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+  free(buf);
+  name = malloc(strlen(index_cache_dir) + 64);
+  if (name)
+    sprintf(name, "%s/%"PRIx64"-%"PRIx64"-%016"PRIx64".idx", index_cache_dir,
+            (uint64_t)s->end_pos, (uint64_t)st.st_mtime, hash);
+  return name;
+}
+
+/**
+ * Store an index in the cache directory. It is written under a temporary
+ * name first, so other players never see a partial file.
+ */
+static void avi_cache_index(const char *name, AVIINDEXENTRY *index, int size)
+{
+  char *tmp = malloc(strlen(name) + 5);
+  if (!tmp)
+    return;
+  sprintf(tmp, "%s.tmp", name);
+  if (avi_write_index(tmp, MSGL_WARN, index, size)) {
+    if (rename(tmp, name)) {
+      mp_msg(MSGT_HEADER,MSGL_WARN, MSGTR_MPDEMUX_AVIHDR_Failed2WriteIdxFile, name, strerror(errno));
+      remove(tmp);
+    } else
+      mp_msg(MSGT_HEADER,MSGL_V, MSGTR_MPDEMUX_AVIHDR_IdxFileSaved, name);
+  }
+  free(tmp);
+}
+
+/**
+ * Build an index by reading through all chunks of the movi list.
+ * With status set the progress is shown on the status line. If abort is
+ * given, the scan stops as soon as it is set.
+ * Returns the number of entries stored in *index.
+ */
+static int avi_build_index(stream_t *s, off_t movi_start, off_t movi_end,
+                           int idxfix_videostream, int idxfix_divx,
+                           int status, volatile int *abort,
+                           AVIINDEXENTRY **index)
+{
+  AVIINDEXENTRY *entries = NULL;
+  int idx_size = 0;
+  int idx_pos = 0;
+  // build index for file:
+  stream_reset(s);
+  stream_seek(s,movi_start);
+
+  while(!abort || !*abort){
+    int id;
+    unsigned len;
+    off_t skip;
+    AVIINDEXENTRY* idx;
+    unsigned int c;
+    off_t filepos=stream_tell(s);
+    if(filepos>=movi_end && movi_start<movi_end) break;
+    id=stream_read_dword_le(s);
+    len=stream_read_dword_le(s);
+    if(id==mmioFOURCC('L','I','S','T') || id==mmioFOURCC('R', 'I', 'F', 'F')){
+      id=stream_read_dword_le(s); // list or RIFF type
+      continue;
+    }
+    if(stream_eof(s)) break;
+    if(!id || avi_stream_id(id)==100) goto skip_chunk; // bad ID (or padding?)
+
+    if(idx_pos>=idx_size){
+//      idx_size+=32;
+      idx_size+=1024; // +16kB
+      entries=realloc(entries,idx_size*sizeof(AVIINDEXENTRY));
+      if(!entries){idx_pos=0; break;} // error!
+    }
+    idx=entries + idx_pos++;
+    idx->ckid=id;
+    idx->dwFlags=AVIIF_KEYFRAME; // FIXME
+    idx->dwFlags|=(filepos>>16)&0xffff0000U;
+    idx->dwChunkOffset=(unsigned long)filepos;
+    idx->dwChunkLength=len;
+
+    c=stream_read_dword(s);
+
+    if(!len) idx->dwFlags&=~AVIIF_KEYFRAME;
+
+    // Fix keyframes for DivX files:
+    if(idxfix_divx)
+      if(avi_stream_id(id)==idxfix_videostream){
+        switch(idxfix_divx){
+    	    case 3: c=stream_read_dword(s)<<5; //skip 32+5 bits for m$mpeg4v1
+    	    case 1: if(c&0x40000000) idx->dwFlags&=~AVIIF_KEYFRAME;break; // divx 3
+	    case 2: if(c==0x1B6) idx->dwFlags&=~AVIIF_KEYFRAME;break; // divx 4
+	}
+      }
+
+    // update status line:
+    if (status) {
+      static off_t lastpos;
+      off_t pos;
+      off_t len=movi_end-movi_start;
+      if(len){
+          pos=100*(filepos-movi_start)/len; // %
+      } else {
+          pos=(filepos-movi_start)>>20; // MB
+      }
+      if(pos!=lastpos){
+          lastpos=pos;
+	  mp_msg(MSGT_HEADER,MSGL_STATUS,MSGTR_MPDEMUX_AVIHDR_GeneratingIdx,
+		 (unsigned long)pos, len?"%":"MB");
+      }
+    }
+    mp_dbg(MSGT_HEADER,MSGL_DBG2,"%08X %08X %.4s %08X %X\n",(unsigned int)filepos,id,(char *) &id,(int)c,(unsigned int) idx->dwFlags);
+skip_chunk:
+    skip=(len+1)&(~1UL); // total bytes in this chunk
+    stream_seek(s,8+filepos+skip);
+  }
+  *index=entries;
+  return idx_pos;
+}
+
+#if HAVE_PTHREADS
+
+struct avi_idx_gen {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  stream_t *stream;       // a stream of its own, the demuxer's one is playing
+  off_t movi_start, movi_end;
+  int videostream, divx;  // for the DivX keyframe fix
+  char *cache_name;
+  volatile int abort;
+  int done;
+  AVIINDEXENTRY *idx;
+  int idx_size;
+};
+
+static void *avi_idx_gen_thread(void *arg)
+{
+  struct avi_idx_gen *g = arg;
+  AVIINDEXENTRY *idx = NULL;
+  int n = avi_build_index(g->stream, g->movi_start, g->movi_end,
+                          g->videostream, g->divx, 0, &g->abort, &idx);
+  if (!g->abort && n > 0 && g->cache_name)
+    avi_cache_index(g->cache_name, idx, n);
+  pthread_mutex_lock(&g->mutex);
+  g->idx = idx;
+  g->idx_size = n;
+  g->done = 1;
+  pthread_mutex_unlock(&g->mutex);
+  return NULL;
+}
+
+/**
+ * Generate the index on a separate thread while playback starts without
+ * one. Returns 0 if that is not possible.
+ */
+static int avi_idx_gen_start(demuxer_t *demuxer, int videostream, int divx,
+                             char *cache_name)
+{
+  avi_priv_t *priv = demuxer->priv;
+  struct avi_idx_gen *g;
+  int file_format = DEMUXER_TYPE_UNKNOWN;
+  stream_t *s = open_stream(demuxer->stream->url, NULL, &file_format);
+
+  if (!s)
+    return 0;
+  g = calloc(1, sizeof(*g));
+  if (!g) {
+    free_stream(s);
+    return 0;
+  }
+  g->stream = s;
+  g->movi_start = demuxer->movi_start;
+  g->movi_end = demuxer->movi_end;
+  g->videostream = videostream;
+  g->divx = divx;
+  g->cache_name = cache_name;
+  pthread_mutex_init(&g->mutex, NULL);
+  if (pthread_create(&g->thread, NULL, avi_idx_gen_thread, g)) {
+    pthread_mutex_destroy(&g->mutex);
+    free_stream(s);
+    free(g);
+    return 0;
+  }
+  priv->idx_gen = g;
+  mp_msg(MSGT_HEADER,MSGL_INFO,"AVI: Generating index in the background, seeking is possible once it is done.\n");
+  return 1;
+}
+
+void avi_idx_gen_stop(demuxer_t *demuxer)
+{
+  avi_priv_t *priv = demuxer->priv;
+  struct avi_idx_gen *g = priv->idx_gen;
+  if (!g)
+    return;
+  g->abort = 1;
+  pthread_join(g->thread, NULL);
+  pthread_mutex_destroy(&g->mutex);
+  free_stream(g->stream);
+  free(g->idx);
+  free(g->cache_name);
+  free(g);
+  priv->idx_gen = NULL;
+}
+
+/**
+ * Once the index generated in the background is complete, switch reading
+ * over to it. The demuxer is at the start of a chunk, so reading goes on
+ * with the first index entry from there on.
+ */
+void avi_idx_gen_check(demuxer_t *demuxer)
+{
+  avi_priv_t *priv = demuxer->priv;
+  struct avi_idx_gen *g = priv->idx_gen;
+  int done;
+  if (!g)
+    return;
+  pthread_mutex_lock(&g->mutex);
+  done = g->done;
+  pthread_mutex_unlock(&g->mutex);
+  if (!done)
+    return;
+  // after a switch to non-interleaved mode the index came too late
+  if (g->idx_size > 0 && !priv->idx_size && demuxer->type == DEMUXER_TYPE_AVI) {
+    off_t pos = stream_tell(demuxer->stream);
+    int lo = 0, hi = g->idx_size, i, frames = 0;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (AVI_IDX_OFFSET(g->idx + mid) < pos)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (i = 0; i < g->idx_size; i++)
+      if (avi_stream_id(g->idx[i].ckid) == demuxer->video->id)
+        frames++;
+    free(priv->idx);
+    priv->idx = g->idx;
+    priv->idx_size = g->idx_size;
+    priv->idx_pos = lo;
+    if (frames)
+      priv->numberofframes = frames;
+    g->idx = NULL;
+    demuxer->seekable = 1;
+    mp_msg(MSGT_HEADER,MSGL_INFO,MSGTR_MPDEMUX_AVIHDR_IdxGeneratedForHowManyChunks,priv->idx_size);
+  }
+  avi_idx_gen_stop(demuxer);
+}
+
+#else /* HAVE_PTHREADS */
+
+static int avi_idx_gen_start(demuxer_t *demuxer, int videostream, int divx,
+                             char *cache_name)
+{
+  return 0;
+}
+
+void avi_idx_gen_stop(demuxer_t *demuxer) {}
+void avi_idx_gen_check(demuxer_t *demuxer) {}
+
+#endif /* HAVE_PTHREADS */
+
 void read_avi_header(demuxer_t *demuxer,int index_mode){
 sh_audio_t *sh_audio=NULL;
 sh_video_t *sh_video=NULL;
@@ -594,143 +950,55 @@ freeout:
 
 /* Read a saved index file */
 if (index_file_load) {
-  FILE *fp;
-  char magic[7];
-  unsigned int i;
-
-  if ((fp = fopen(index_file_load, "r")) == NULL) {
-    mp_msg(MSGT_HEADER,MSGL_ERR, MSGTR_MPDEMUX_AVIHDR_CantReadIdxFile, index_file_load, strerror(errno));
-    goto gen_index;
+  AVIINDEXENTRY *idx;
+  int n;
+  if (avi_read_index(index_file_load, MSGL_ERR, &idx, &n)) {
+    free(priv->idx);
+    priv->idx = idx;
+    priv->idx_size = n;
+    mp_msg(MSGT_HEADER,MSGL_INFO, MSGTR_MPDEMUX_AVIHDR_IdxFileLoaded, index_file_load);
   }
-  fread(&magic, 6, 1, fp);
-  if (strncmp(magic, "MPIDX1", 6)) {
-    mp_msg(MSGT_HEADER,MSGL_ERR, MSGTR_MPDEMUX_AVIHDR_NotValidMPidxFile, index_file_load);
-    goto gen_index;
-  }
-  fread(&priv->idx_size, sizeof(priv->idx_size), 1, fp);
-  priv->idx=malloc(priv->idx_size*sizeof(AVIINDEXENTRY));
-  if (!priv->idx) {
-    mp_msg(MSGT_HEADER,MSGL_ERR, MSGTR_MPDEMUX_AVIHDR_FailedMallocForIdxFile, index_file_load);
-    priv->idx_size = 0;
-    goto gen_index;
+}
+if(index_mode>=2 || (priv->idx_size==0 && index_mode==1) ||
+   (priv->idx_size==0 && index_mode==-1 && index_cache_dir)){
+  // -saveidx wants the index written before playback starts
+  char *cache_name = index_file_save ? NULL : avi_cache_name(demuxer);
+  AVIINDEXENTRY *idx;
+  int n;
+
+  if (cache_name && avi_read_index(cache_name, MSGL_V, &idx, &n)) {
+    free(priv->idx);
+    priv->idx = idx;
+    priv->idx_size = n;
+    mp_msg(MSGT_HEADER,MSGL_INFO, MSGTR_MPDEMUX_AVIHDR_IdxFileLoaded, cache_name);
+    free(cache_name);
+    return;
   }
-
-  for (i=0; i<priv->idx_size;i++) {
-    AVIINDEXENTRY *idx=priv->idx + i;
-    fread(idx, sizeof(AVIINDEXENTRY), 1, fp);
-    if (feof(fp)) {
-      mp_msg(MSGT_HEADER,MSGL_ERR, MSGTR_MPDEMUX_AVIHDR_PrematureEOF, index_file_load);
-      free(priv->idx);
-      priv->idx_size = 0;
-      goto gen_index;
-    }
+  // avi_idx_gen_check() only adopts the result while playing without an
+  // index, one from the file (-forceidx) is replaced right away below
+  if (cache_name && priv->idx_size == 0 &&
+      avi_idx_gen_start(demuxer, idxfix_videostream, idxfix_divx, cache_name))
+    return;
+  // without a cache directory an index is only built on request
+  if (index_mode == -1) {
+    free(cache_name);
+    return;
   }
-  fclose(fp);
-  mp_msg(MSGT_HEADER,MSGL_INFO, MSGTR_MPDEMUX_AVIHDR_IdxFileLoaded, index_file_load);
-}
-gen_index:
-if(index_mode>=2 || (priv->idx_size==0 && index_mode==1)){
-  int idx_pos = 0;
-  // build index for file:
-  stream_reset(demuxer->stream);
-  stream_seek(demuxer->stream,demuxer->movi_start);
-
-  priv->idx_size=0;
-  priv->idx=NULL;
-
-  while(1){
-    int id;
-    unsigned len;
-    off_t skip;
-    AVIINDEXENTRY* idx;
-    unsigned int c;
-    demuxer->filepos=stream_tell(demuxer->stream);
-    if(demuxer->filepos>=demuxer->movi_end && demuxer->movi_start<demuxer->movi_end) break;
-    id=stream_read_dword_le(demuxer->stream);
-    len=stream_read_dword_le(demuxer->stream);
-    if(id==mmioFOURCC('L','I','S','T') || id==mmioFOURCC('R', 'I', 'F', 'F')){
-      id=stream_read_dword_le(demuxer->stream); // list or RIFF type
-      continue;
-    }
-    if(stream_eof(demuxer->stream)) break;
-    if(!id || avi_stream_id(id)==100) goto skip_chunk; // bad ID (or padding?)
-
-    if(idx_pos>=priv->idx_size){
-//      priv->idx_size+=32;
-      priv->idx_size+=1024; // +16kB
-      priv->idx=realloc(priv->idx,priv->idx_size*sizeof(AVIINDEXENTRY));
-      if(!priv->idx){idx_pos=0; break;} // error!
-    }
-    idx=priv->idx + idx_pos++;
-    idx->ckid=id;
-    idx->dwFlags=AVIIF_KEYFRAME; // FIXME
-    idx->dwFlags|=(demuxer->filepos>>16)&0xffff0000U;
-    idx->dwChunkOffset=(unsigned long)demuxer->filepos;
-    idx->dwChunkLength=len;
-
-    c=stream_read_dword(demuxer->stream);
-
-    if(!len) idx->dwFlags&=~AVIIF_KEYFRAME;
-
-    // Fix keyframes for DivX files:
-    if(idxfix_divx)
-      if(avi_stream_id(id)==idxfix_videostream){
-        switch(idxfix_divx){
-    	    case 3: c=stream_read_dword(demuxer->stream)<<5; //skip 32+5 bits for m$mpeg4v1
-    	    case 1: if(c&0x40000000) idx->dwFlags&=~AVIIF_KEYFRAME;break; // divx 3
-	    case 2: if(c==0x1B6) idx->dwFlags&=~AVIIF_KEYFRAME;break; // divx 4
-	}
-      }
 
-    // update status line:
-    { static off_t lastpos;
-      off_t pos;
-      off_t len=demuxer->movi_end-demuxer->movi_start;
-      if(len){
-          pos=100*(demuxer->filepos-demuxer->movi_start)/len; // %
-      } else {
-          pos=(demuxer->filepos-demuxer->movi_start)>>20; // MB
-      }
-      if(pos!=lastpos){
-          lastpos=pos;
-	  mp_msg(MSGT_HEADER,MSGL_STATUS,MSGTR_MPDEMUX_AVIHDR_GeneratingIdx,
-		 (unsigned long)pos, len?"%":"MB");
-      }
-    }
-    mp_dbg(MSGT_HEADER,MSGL_DBG2,"%08X %08X %.4s %08X %X\n",(unsigned int)demuxer->filepos,id,(char *) &id,(int)c,(unsigned int) idx->dwFlags);
-#if 0
-    { unsigned char tmp[64];
-      int i;
-      stream_read(demuxer->stream,tmp,64);
-      printf("%.4s",&id);
-      for(i=0;i<64;i++) printf(" %02X",tmp[i]);
-      printf("\n");
-    }
-#endif
-skip_chunk:
-    skip=(len+1)&(~1UL); // total bytes in this chunk
-    stream_seek(demuxer->stream,8+demuxer->filepos+skip);
-  }
-  priv->idx_size=idx_pos;
+  free(priv->idx);
+  priv->idx_size=avi_build_index(demuxer->stream,demuxer->movi_start,
+                                 demuxer->movi_end,idxfix_videostream,
+                                 idxfix_divx,1,NULL,&priv->idx);
   mp_msg(MSGT_HEADER,MSGL_INFO,MSGTR_MPDEMUX_AVIHDR_IdxGeneratedForHowManyChunks,priv->idx_size);
   if( mp_msg_test(MSGT_HEADER,MSGL_DBG2) ) print_index(priv->idx,priv->idx_size,MSGL_DBG2);
+  if (cache_name && priv->idx_size > 0)
+    avi_cache_index(cache_name, priv->idx, priv->idx_size);
+  free(cache_name);
 
   /* Write generated index to a file */
   if (index_file_save) {
-    FILE *fp;
-    unsigned int i;
-
-    if ((fp=fopen(index_file_save, "w")) == NULL) {
-      mp_msg(MSGT_HEADER,MSGL_ERR, MSGTR_MPDEMUX_AVIHDR_Failed2WriteIdxFile, index_file_save, strerror(errno));
+    if (!avi_write_index(index_file_save, MSGL_ERR, priv->idx, priv->idx_size))
       return;
-    }
-    fwrite("MPIDX1", 6, 1, fp);
-    fwrite(&priv->idx_size, sizeof(priv->idx_size), 1, fp);
-    for (i=0; i<priv->idx_size; i++) {
-      AVIINDEXENTRY *idx = priv->idx + i;
-      fwrite(idx, sizeof(AVIINDEXENTRY), 1, fp);
-    }
-    fclose(fp);
     mp_msg(MSGT_HEADER,MSGL_INFO, MSGTR_MPDEMUX_AVIHDR_IdxFileSaved, index_file_save);
   }
 }
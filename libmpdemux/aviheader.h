@@ -366,10 +366,13 @@ typedef struct {
   int suidx_size;
   int isodml;
   int warned_unaligned;
+  struct avi_idx_gen *idx_gen; // index being generated in the background
 } avi_priv_t;
 
 #define AVI_IDX_OFFSET(x) ((((uint64_t)(x)->dwFlags&0xffff0000)<<16)+(x)->dwChunkOffset)
 
 void read_avi_header(demuxer_t *demuxer, int index_mode);
+void avi_idx_gen_check(demuxer_t *demuxer);
+void avi_idx_gen_stop(demuxer_t *demuxer);
 
 #endif /* MPLAYER_AVIHEADER_H */
@@ -65,13 +65,15 @@ static inline int check_varlen(uint8_t *ptr, uint8_t *endptr, int len) {
     return len&3 ? ptr + (1<<((len&3) - 1)) <= endptr : 1;
 }
 
-static void asf_descrambling(unsigned char **src,unsigned len, struct asf_priv* asf){
+static void asf_descrambling(unsigned char *src,unsigned len, struct asf_priv* asf){
   unsigned char *dst;
-  unsigned char *s2=*src;
+  unsigned char *s2=src;
   unsigned i=0,x,y;
   if (len > UINT_MAX - MP_INPUT_BUFFER_PADDING_SIZE)
 	return;
   dst = malloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
+  if (!dst)
+	return;
   while(len>=asf->scrambling_h*asf->scrambling_w*asf->scrambling_b+i){
 //    mp_msg(MSGT_DEMUX,MSGL_DBG4,"descrambling! (w=%d  b=%d)\n",w,asf_scrambling_b);
 	//i+=asf_scrambling_h*asf_scrambling_w;
@@ -83,8 +85,9 @@ static void asf_descrambling(unsigned char **src,unsigned len, struct asf_priv*
 	s2+=asf->scrambling_h*asf->scrambling_w*asf->scrambling_b;
   }
   //if(i<len) fast_memcpy(dst+i,src+i,len-i);
-  free(*src);
-  *src = dst;
+  // the packet buffer may be pooled, so copy back instead of replacing it
+  fast_memcpy(src,dst,i);
+  free(dst);
 }
 
 /*****************************************************************
@@ -100,12 +103,11 @@ static void init_priv (struct asf_priv* asf){
 
 static void demux_asf_append_to_packet(demux_packet_t* dp,unsigned char *data,int len,int offs)
 {
+  int old_len=dp->len;
   if(dp->len!=offs && offs!=-1) mp_msg(MSGT_DEMUX,MSGL_V,"warning! fragment.len=%d BUT next fragment offset=%d  \n",dp->len,offs);
-  dp->buffer=realloc(dp->buffer,dp->len+len+MP_INPUT_BUFFER_PADDING_SIZE);
-  fast_memcpy(dp->buffer+dp->len,data,len);
-  memset(dp->buffer+dp->len+len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
-  mp_dbg(MSGT_DEMUX,MSGL_DBG4,"data appended! %d+%d\n",dp->len,len);
-  dp->len+=len;
+  resize_demux_packet(dp,dp->len+len);
+  fast_memcpy(dp->buffer+old_len,data,len);
+  mp_dbg(MSGT_DEMUX,MSGL_DBG4,"data appended! %d+%d\n",old_len,len);
 }
 
 static int demux_asf_read_packet(demuxer_t *demux,unsigned char *data,int len,int id,int seq,uint64_t time,unsigned short dur,int offs,int keyframe){
@@ -155,7 +157,7 @@ static int demux_asf_read_packet(demuxer_t *demux,unsigned char *data,int len,in
         // closed segment, finalize packet:
 		if(ds==demux->audio)
 		  if(asf->scrambling_h>1 && asf->scrambling_w>1 && asf->scrambling_b>0)
-		    asf_descrambling(&ds->asf_packet->buffer,ds->asf_packet->len,asf);
+		    asf_descrambling(ds->asf_packet->buffer,ds->asf_packet->len,asf);
         ds_add_packet(ds,ds->asf_packet);
         ds->asf_packet=NULL;
       } else {
@@ -22,6 +22,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "stream/stream.h"
 #include "aviprint.h"
 #include "demuxer.h"
@@ -42,9 +46,41 @@
 
 #define HDR_SIZE 4
 
+//! MP3 frames per frame index entry
+#define MP3_INDEX_STEP 16
+
+/**
+ * Positions of MP3 frames, recorded while reading the file from its start
+ * on. All frames have the same duration, so the frame to seek to follows
+ * from the time, and entry n holds frame n * MP3_INDEX_STEP.
+ */
+typedef struct mp3_index {
+#if HAVE_PTHREADS
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  int thread_running;
+  volatile int abort;
+  stream_t *stream;     // the thread reads its own stream
+  off_t start, end;
+#endif
+  off_t *pos;
+  int size, alloc;
+  int64_t frames;       // number of frames once all are indexed, 0 before
+} mp3_index_t;
+
+#if HAVE_PTHREADS
+#define index_lock(idx)   pthread_mutex_lock(&(idx)->mutex)
+#define index_unlock(idx) pthread_mutex_unlock(&(idx)->mutex)
+#else
+#define index_lock(idx)
+#define index_unlock(idx)
+#endif
+
 typedef struct da_priv {
   int frmt;
   double next_pts;
+  int64_t frame;        // number of the next MP3 frame, -1 if unknown
+  mp3_index_t index;
 } da_priv_t;
 
 //! rather arbitrary value for maximum length of wav-format headers
@@ -67,6 +103,7 @@ typedef struct mp3_hdr {
 } mp3_hdr_t;
 
 int hr_mp3_seek = 0;
+int mp3_build_index = 0;
 
 /**
  * \brief free a list of MP3 header descriptions
@@ -352,6 +389,152 @@ static unsigned int id3v2_tag_size(uint8_t maj_ver, stream_t *s) {
   return header_footer_size + size;
 }
 
+/**
+ * @brief Read up to the next MP3 frame header, skipping junk in between.
+ *
+ * @param s stream to be read
+ * @param end end of the audio data, 0 if unknown
+ * @param hdr the header is stored here
+ *
+ * @return frame length, -1 at the end of the audio data; the stream is
+ *         positioned after the header
+ */
+static int mp3_next_header(stream_t *s, off_t end, uint8_t hdr[4]) {
+  while (1) {
+    int len;
+    stream_read(s, hdr, 4);
+    if (s->eof)
+      return -1;
+    len = mp_decode_mp3_header(hdr);
+    if (len >= HDR_SIZE)
+      return len;
+    if (end && stream_tell(s) >= end)
+      return -1; // might be ID3 tag, i.e. EOF
+    stream_skip(s, -3);
+  }
+}
+
+static void mp3_index_add(mp3_index_t *idx, int64_t frame, off_t pos) {
+  if (frame % MP3_INDEX_STEP)
+    return;
+  index_lock(idx);
+  // only ever extend the index, the frames before must all be known
+  if (frame / MP3_INDEX_STEP == idx->size) {
+    if (idx->size == idx->alloc) {
+      int n = idx->alloc ? 2 * idx->alloc : 1024;
+      off_t *p = realloc(idx->pos, n * sizeof(*p));
+      if (p) {
+        idx->pos = p;
+        idx->alloc = n;
+      }
+    }
+    if (idx->size < idx->alloc)
+      idx->pos[idx->size++] = pos;
+  }
+  index_unlock(idx);
+}
+
+static void mp3_index_done(mp3_index_t *idx, int64_t frames) {
+  index_lock(idx);
+  if (!idx->frames)
+    idx->frames = frames;
+  index_unlock(idx);
+}
+
+/**
+ * @brief Find the last indexed frame at or before frame.
+ *
+ * @return 0 if the index does not reach frame yet
+ */
+static int mp3_index_find(mp3_index_t *idx, int64_t frame,
+                          int64_t *found, off_t *pos) {
+  int64_t i = frame / MP3_INDEX_STEP;
+  int ret = 0;
+  index_lock(idx);
+  if (i < idx->size) {
+    *found = i * MP3_INDEX_STEP;
+    *pos = idx->pos[i];
+    ret = 1;
+  } else if (idx->size) {
+    // the end of the index, to go on from
+    *found = (int64_t)(idx->size - 1) * MP3_INDEX_STEP;
+    *pos = idx->pos[idx->size - 1];
+  }
+  index_unlock(idx);
+  return ret;
+}
+
+static int64_t mp3_index_frames(mp3_index_t *idx) {
+  int64_t frames;
+  index_lock(idx);
+  frames = idx->frames;
+  index_unlock(idx);
+  return frames;
+}
+
+#if HAVE_PTHREADS
+
+static void *mp3_index_thread(void *arg) {
+  mp3_index_t *idx = arg;
+  stream_t *s = idx->stream;
+  int64_t frame = 0;
+  uint8_t hdr[4];
+
+  stream_seek(s, idx->start);
+  while (!idx->abort) {
+    int len = mp3_next_header(s, idx->end, hdr);
+    if (len < 0 || !stream_skip(s, len - HDR_SIZE)) {
+      mp3_index_done(idx, frame);
+      mp_msg(MSGT_DEMUX, MSGL_V, "demux_audio: indexed %"PRId64" MP3 frames\n", frame);
+      break;
+    }
+    mp3_index_add(idx, frame++, stream_tell(s) - len);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Index the whole file on a separate thread, through a stream of
+ *        its own.
+ */
+static void mp3_index_start(demuxer_t *demuxer) {
+  da_priv_t *priv = demuxer->priv;
+  mp3_index_t *idx = &priv->index;
+  int file_format = DEMUXER_TYPE_UNKNOWN;
+
+  if (demuxer->stream->type != STREAMTYPE_FILE || !demuxer->stream->url)
+    return;
+  idx->stream = open_stream(demuxer->stream->url, NULL, &file_format);
+  if (!idx->stream)
+    return;
+  idx->start = demuxer->movi_start;
+  idx->end = demuxer->movi_end;
+  if (pthread_create(&idx->thread, NULL, mp3_index_thread, idx)) {
+    free_stream(idx->stream);
+    idx->stream = NULL;
+    return;
+  }
+  idx->thread_running = 1;
+}
+
+static void mp3_index_stop(mp3_index_t *idx) {
+  if (idx->thread_running) {
+    idx->abort = 1;
+    pthread_join(idx->thread, NULL);
+    idx->thread_running = 0;
+  }
+  if (idx->stream)
+    free_stream(idx->stream);
+  idx->stream = NULL;
+}
+
+#else /* HAVE_PTHREADS */
+
+static void mp3_index_start(demuxer_t *demuxer) {}
+static void mp3_index_stop(mp3_index_t *idx) {}
+
+#endif /* HAVE_PTHREADS */
+
 static int demux_audio_open(demuxer_t* demuxer) {
   stream_t *s;
   sh_audio_t* sh_audio;
@@ -617,9 +800,12 @@ static int demux_audio_open(demuxer_t* demuxer) {
 	    break;
   }
 
-  priv = malloc(sizeof(da_priv_t));
+  priv = calloc(1, sizeof(da_priv_t));
   priv->frmt = frmt;
   priv->next_pts = 0;
+#if HAVE_PTHREADS
+  pthread_mutex_init(&priv->index.mutex, NULL);
+#endif
   demuxer->priv = priv;
   demuxer->audio->id = 0;
   demuxer->audio->sh = sh_audio;
@@ -644,6 +830,11 @@ static int demux_audio_open(demuxer_t* demuxer) {
 
   mp_msg(MSGT_DEMUX,MSGL_V,"demux_audio: audio data 0x%X - 0x%X  \n",(int)demuxer->movi_start,(int)demuxer->movi_end);
 
+  // frames are counted from the start of the audio data
+  priv->frame = stream_tell(s) == demuxer->movi_start ? 0 : -1;
+  if (frmt == MP3 && mp3_build_index && (s->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK)
+    mp3_index_start(demuxer);
+
   return DEMUXER_TYPE_AUDIO;
 }
 
@@ -660,29 +851,28 @@ static int demux_audio_fill_buffer(demuxer_t *demux, demux_stream_t *ds) {
     return 0;
 
   switch(priv->frmt) {
-  case MP3 :
-    while(1) {
-      uint8_t hdr[4];
-      stream_read(s,hdr,4);
-      if (s->eof)
-        return 0;
-      l = mp_decode_mp3_header(hdr);
-      if(l < 0) {
-	if (demux->movi_end && stream_tell(s) >= demux->movi_end)
-	  return 0; // might be ID3 tag, i.e. EOF
-	stream_skip(s,-3);
-      } else {
-	dp = new_demux_packet(l);
-	memcpy(dp->buffer,hdr,4);
-	if (stream_read(s,dp->buffer + 4,l-4) != l-4)
-	{
-	  free_demux_packet(dp);
-	  return 0;
-	}
-	priv->next_pts += sh_audio->audio.dwScale/(double)sh_audio->samplerate;
-	break;
-      }
-    } break;
+  case MP3 : {
+    uint8_t hdr[4];
+    l = mp3_next_header(s, demux->movi_end, hdr);
+    if (l < 0) {
+      if (priv->frame >= 0)
+        mp3_index_done(&priv->index, priv->frame);
+      return 0;
+    }
+    dp = new_demux_packet(l);
+    memcpy(dp->buffer,hdr,4);
+    if (stream_read(s,dp->buffer + 4,l-4) != l-4)
+    {
+      free_demux_packet(dp);
+      if (priv->frame >= 0)
+        mp3_index_done(&priv->index, priv->frame);
+      return 0;
+    }
+    if (priv->frame >= 0)
+      mp3_index_add(&priv->index, priv->frame++, stream_tell(s) - l);
+    priv->next_pts += sh_audio->audio.dwScale/(double)sh_audio->samplerate;
+    break;
+  }
   case WAV : {
     unsigned align = sh_audio->wf->nBlockAlign;
     l = sh_audio->wf->nAvgBytesPerSec;
@@ -717,31 +907,58 @@ static int demux_audio_fill_buffer(demuxer_t *demux, demux_stream_t *ds) {
   return 1;
 }
 
-static void high_res_mp3_seek(demuxer_t *demuxer,float time) {
-  uint8_t hdr[4];
-  int len,nf;
+/**
+ * @brief Seek to an MP3 frame through the frame index.
+ *
+ * Jumps to the closest indexed frame and reads on frame by frame from
+ * there, indexing the frames it passes. Without hr_mp3_seek, only targets
+ * within the index are sought this way.
+ *
+ * @return 0 if the caller has to estimate the position instead
+ */
+static int mp3_seek(demuxer_t *demuxer, float rel_seek_secs, int flags) {
   da_priv_t* priv = demuxer->priv;
-  sh_audio_t* sh = (sh_audio_t*)demuxer->audio->sh;
+  sh_audio_t* sh = demuxer->audio->sh;
+  stream_t* s = demuxer->stream;
+  double frame_secs = sh->audio.dwScale / (double)sh->samplerate;
+  int64_t target, frame = 0, frames;
+  off_t pos = demuxer->movi_start;
+  double time;
+
+  if ((s->flags & MP_STREAM_SEEK) != MP_STREAM_SEEK)
+    return 0;
+  if (flags & SEEK_FACTOR) {
+    if (!(frames = mp3_index_frames(&priv->index)))
+      return 0;
+    time = rel_seek_secs * frames * frame_secs;
+  } else
+    time = (flags & SEEK_ABSOLUTE) ? rel_seek_secs : priv->next_pts + rel_seek_secs;
+  target = time > 0 ? time / frame_secs : 0;
 
-  nf = time*sh->samplerate/sh->audio.dwScale;
-  while(nf > 0) {
-    stream_read(demuxer->stream,hdr,4);
-    len = mp_decode_mp3_header(hdr);
-    if(len < 0) {
-      stream_skip(demuxer->stream,-3);
-      continue;
+  if (!mp3_index_find(&priv->index, target, &frame, &pos) && !hr_mp3_seek)
+    return 0;
+  // reading on from the current frame may be shorter
+  if (priv->frame < frame || priv->frame > target) {
+    stream_seek(s, pos);
+    priv->frame = frame;
+  }
+  while (priv->frame < target) {
+    uint8_t hdr[4];
+    int len = mp3_next_header(s, demuxer->movi_end, hdr);
+    if (len < 0 || !stream_skip(s, len - HDR_SIZE)) {
+      mp3_index_done(&priv->index, priv->frame);
+      break;
     }
-    stream_skip(demuxer->stream,len-4);
-    priv->next_pts += sh->audio.dwScale/(double)sh->samplerate;
-    nf--;
+    mp3_index_add(&priv->index, priv->frame++, stream_tell(s) - len);
   }
+  priv->next_pts = priv->frame * frame_secs;
+  return 1;
 }
 
 static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_delay,int flags){
   sh_audio_t* sh_audio;
   stream_t* s;
   int64_t base,pos;
-  float len;
   da_priv_t* priv;
 
   if(!(sh_audio = demuxer->audio->sh))
@@ -749,17 +966,8 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
   s = demuxer->stream;
   priv = demuxer->priv;
 
-  if(priv->frmt == MP3 && hr_mp3_seek && !(flags & SEEK_FACTOR)) {
-    len = (flags & SEEK_ABSOLUTE) ? rel_seek_secs - priv->next_pts : rel_seek_secs;
-    if(len < 0) {
-      stream_seek(s,demuxer->movi_start);
-      len = priv->next_pts + len;
-      priv->next_pts = 0;
-    }
-    if(len > 0)
-      high_res_mp3_seek(demuxer,len);
+  if(priv->frmt == MP3 && mp3_seek(demuxer, rel_seek_secs, flags))
     return;
-  }
 
   base = flags&SEEK_ABSOLUTE ? demuxer->movi_start : stream_tell(s);
   if(flags&SEEK_FACTOR)
@@ -773,6 +981,7 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
     pos = demuxer->movi_start;
 
   priv->next_pts = (pos-demuxer->movi_start)/(double)sh_audio->i_bps;
+  priv->frame = pos == demuxer->movi_start ? 0 : -1;
 
   switch(priv->frmt) {
   case WAV:
@@ -788,6 +997,13 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
 static void demux_close_audio(demuxer_t* demuxer) {
   da_priv_t* priv = demuxer->priv;
 
+  if (!priv)
+    return;
+  mp3_index_stop(&priv->index);
+#if HAVE_PTHREADS
+  pthread_mutex_destroy(&priv->index.mutex);
+#endif
+  free(priv->index.pos);
   free(priv);
 }
 
@@ -796,9 +1012,15 @@ static int demux_audio_control(demuxer_t *demuxer,int cmd, void *arg){
     int audio_length = sh_audio->i_bps && demuxer->movi_end > demuxer->movi_start ?
                        (demuxer->movi_end - demuxer->movi_start) / sh_audio->i_bps : 0;
     da_priv_t* priv = demuxer->priv;
+    int64_t frames = priv->frmt == MP3 ? mp3_index_frames(&priv->index) : 0;
 
     switch(cmd) {
 	case DEMUXER_CTRL_GET_TIME_LENGTH:
+	    if (frames) {
+	      // all frames are indexed, so this is exact
+	      *((double *)arg) = frames * sh_audio->audio.dwScale / (double)sh_audio->samplerate;
+	      return DEMUXER_CTRL_OK;
+	    }
 	    if (audio_length<=0) return DEMUXER_CTRL_DONTKNOW;
 	    *((double *)arg)=(double)audio_length;
 	    return DEMUXER_CTRL_GUESS;
@@ -20,5 +20,6 @@
 #define MPLAYER_DEMUX_AUDIO_H
 
 extern int hr_mp3_seek;
+extern int mp3_build_index;
 
 #endif /* MPLAYER_DEMUX_AUDIO_H */
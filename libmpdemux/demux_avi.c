@@ -238,6 +238,7 @@ unsigned int len;
 int ret=0;
 demux_stream_t *ds;
 
+avi_idx_gen_check(demux);
 do{
   int flags=1;
   if(priv->idx_size>0 && priv->idx_pos<priv->idx_size){
@@ -300,7 +301,7 @@ do{
 
   ds=demux_avi_select_stream(demux,id);
   if(ds)
-    if(ds->packs+1>=MAX_PACKS || ds->bytes+len>=MAX_PACK_BYTES){
+    if(ds_queue_full_next(ds,len)){
 	// this packet will cause a buffer overflow, switch to -ni mode!!!
 	switch_to_ni(demux);
 	// quit now, we can't even (no enough buffer memory) read this packet :(
@@ -439,6 +440,7 @@ do{
 // AVI demuxer parameters:
 int index_mode=-1;  // -1=untouched  0=don't use index  1=use (generate) index
 char *index_file_save = NULL, *index_file_load = NULL;
+char *index_cache_dir = NULL; // generated indexes are kept here
 int force_ni=0;     // force non-interleaved AVI parsing
 
 static int try_ds_fill(demuxer_t *demux, demux_stream_t *ds) {
@@ -791,6 +793,7 @@ static void demux_close_avi(demuxer_t *demuxer)
   if(!priv)
     return;
 
+  avi_idx_gen_stop(demuxer);
   if(priv->idx_size > 0)
     free(priv->idx);
   free(priv);
@@ -0,0 +1,321 @@
+/*
+ * keyframe index recorded during playback
+ *
+ * Demuxers without an index of their own (MPEG-PS, MPEG-TS) add the
+ * position and PTS of every keyframe they read. The entries are kept
+ * sorted by position, and each one records whether the demuxer read on
+ * without a seek from the entry before it. Between two such entries there
+ * is no other keyframe, so a seek to a time in that range can go straight
+ * to the right keyframe instead of guessing a position and resyncing.
+ *
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "libavutil/common.h"
+#include "mp_msg.h"
+#include "stream/stream.h"
+#include "aviheader.h"
+#include "demuxer.h"
+#include "demux_index.h"
+#include "mpeg_hdr.h"
+
+int demuxer_save_index;
+
+#define INDEX_MAGIC       "MPKFIDX1"
+#define INDEX_SUFFIX      ".kfidx"
+#define INDEX_MAX_ENTRIES (1 << 20)
+
+typedef struct {
+  int64_t pos;
+  double pts;
+  int32_t follows;  // read on from the previous entry without seeking
+  int32_t reserved;
+} index_entry_t;
+
+struct demux_index {
+  index_entry_t *entries;
+  int count, alloc;
+  int last;         // entry added last, -1 after a seek
+  int dirty;        // changed since loaded
+  unsigned char tail[4]; // end of the previous payload, see is_keyframe
+  int tail_len;
+};
+
+demux_index_t *demux_index_new(void)
+{
+  demux_index_t *idx = calloc(1, sizeof(*idx));
+  if (idx)
+    idx->last = -1;
+  return idx;
+}
+
+void demux_index_free(demux_index_t *idx)
+{
+  if (!idx)
+    return;
+  free(idx->entries);
+  free(idx);
+}
+
+/**
+ * Whether the start code at p (5 bytes) is one at which the seek code of
+ * the MPEG demuxers starts decoding: sequence or GOP headers, MPEG-4
+ * I-VOPs, H.264 IDR slices and SPS, VC-1 sequence headers and entry points.
+ */
+static int keyframe_code(int format, const unsigned char *p)
+{
+  int code = p[3];
+  switch (format) {
+  case 0x10000004: // MPEG-4
+    return code == 0xB6 && !(p[4] & 0xC0);
+  case 0x10000005: // H.264
+    code &= 0x1f;
+    return code == 5 || code == 7;
+  case mmioFOURCC('W', 'V', 'C', '1'):
+    return code == 0x0E || code == 0x0F;
+  default: // MPEG-1/2
+    return code == 0xB3 || code == 0xB8;
+  }
+}
+
+/**
+ * Search the whole payload of a video packet for a keyframe, see
+ * keyframe_code(); the seek code finds it wherever it is in the packet.
+ * All video packets must be passed in order: a keyframe start code split
+ * between two packets cannot be indexed, so the entries around it must
+ * not claim that there is no keyframe between them.
+ */
+int demux_index_is_keyframe(demux_index_t *idx, int format,
+                            const unsigned char *buf, int len)
+{
+  const unsigned char *p, *end = buf + len;
+  unsigned char tmp[8];
+  int i, n, total;
+  if (!idx || len <= 0)
+    return 0;
+  n = FFMIN(len, 4);
+  total = idx->tail_len + n;
+  memcpy(tmp, idx->tail, idx->tail_len);
+  memcpy(tmp + idx->tail_len, buf, n);
+  for (i = 0; i < idx->tail_len && i + 4 < total; i++)
+    if (!tmp[i] && !tmp[i + 1] && tmp[i + 2] == 1 &&
+        keyframe_code(format, tmp + i)) {
+      idx->last = -1;
+      break;
+    }
+  // keep what start codes may begin in for the next payload
+  if (len >= 4) {
+    memcpy(idx->tail, end - 4, 4);
+    idx->tail_len = 4;
+  } else {
+    idx->tail_len = FFMIN(total, 4);
+    memmove(idx->tail, tmp + total - idx->tail_len, idx->tail_len);
+  }
+  for (p = buf; (p = mp_find_startcode(p, end)) < end - 4; p += 3)
+    if (keyframe_code(format, p))
+      return 1;
+  return 0;
+}
+
+/**
+ * Index of the first entry with a position not below pos.
+ */
+static int lower_bound(demux_index_t *idx, off_t pos)
+{
+  int lo = 0, hi = idx->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (idx->entries[mid].pos < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void demux_index_add(demux_index_t *idx, off_t pos, double pts)
+{
+  index_entry_t *e;
+  int i;
+  if (!idx)
+    return;
+  // mostly appended while playing on
+  if (idx->count && idx->entries[idx->count - 1].pos < pos)
+    i = idx->count;
+  else
+    i = lower_bound(idx, pos);
+  if (i == idx->count || idx->entries[i].pos != pos) {
+    if (idx->count >= INDEX_MAX_ENTRIES)
+      return;
+    if (idx->count == idx->alloc) {
+      int n = idx->alloc ? 2 * idx->alloc : 1024;
+      e = realloc(idx->entries, n * sizeof(*e));
+      if (!e)
+        return;
+      idx->entries = e;
+      idx->alloc = n;
+    }
+    e = &idx->entries[i];
+    memmove(e + 1, e, (idx->count - i) * sizeof(*e));
+    idx->count++;
+    if (idx->last >= i)
+      idx->last++;
+    e->pos = pos;
+    e->pts = pts;
+    e->follows = 0;
+    e->reserved = 0;
+    idx->dirty = 1;
+  }
+  e = &idx->entries[i];
+  if (!e->follows && idx->last >= 0 && idx->last == i - 1) {
+    e->follows = 1;
+    idx->dirty = 1;
+  }
+  idx->last = i;
+}
+
+void demux_index_break(demux_index_t *idx)
+{
+  if (idx)
+    idx->last = -1;
+}
+
+/**
+ * Succeeds if the last keyframe at or before pts is known for sure, that
+ * is if pts is between two entries that were read one after the other.
+ */
+int demux_index_find(demux_index_t *idx, double pts, off_t *pos)
+{
+  int i;
+  if (!idx)
+    return 0;
+  // timestamps may wrap or jump, do not assume they grow with the position
+  for (i = 1; i < idx->count; i++) {
+    index_entry_t *e = &idx->entries[i];
+    if (e->follows && e[-1].pts <= pts && pts < e->pts) {
+      *pos = e[-1].pos;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static char *index_filename(demuxer_t *demuxer)
+{
+  stream_t *s = demuxer->stream;
+  const char *url = s->url;
+  char *name;
+  if (s->type != STREAMTYPE_FILE || !url || s->end_pos <= 0)
+    return NULL;
+  if (!strncmp(url, "file://", 7))
+    url += 7;
+  name = malloc(strlen(url) + sizeof(INDEX_SUFFIX));
+  if (name) {
+    strcpy(name, url);
+    strcat(name, INDEX_SUFFIX);
+  }
+  return name;
+}
+
+/**
+ * Load the index saved for this file, if it was saved for a file of the
+ * same size and type.
+ */
+void demux_index_load(demux_index_t *idx, demuxer_t *demuxer)
+{
+  char magic[8];
+  int64_t size;
+  int32_t type, count;
+  char *name;
+  FILE *f;
+  if (!idx || !demuxer_save_index || !(name = index_filename(demuxer)))
+    return;
+  f = fopen(name, "rb");
+  if (!f)
+    goto out;
+  if (fread(magic, 8, 1, f) < 1 || memcmp(magic, INDEX_MAGIC, 8) ||
+      fread(&size, sizeof(size), 1, f) < 1 ||
+      fread(&type, sizeof(type), 1, f) < 1 ||
+      fread(&count, sizeof(count), 1, f) < 1 ||
+      size != demuxer->stream->end_pos || type != demuxer->type ||
+      count <= 0 || count > INDEX_MAX_ENTRIES) {
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Keyframe index %s does not match the file.\n", name);
+    goto out;
+  }
+  free(idx->entries);
+  idx->entries = malloc(count * sizeof(index_entry_t));
+  idx->count = idx->alloc = 0;
+  if (!idx->entries)
+    goto out;
+  if (fread(idx->entries, sizeof(index_entry_t), count, f) < count) {
+    mp_msg(MSGT_DEMUXER, MSGL_WARN, "Keyframe index %s is truncated.\n", name);
+    goto out;
+  }
+  idx->count = idx->alloc = count;
+  idx->last = -1;
+  idx->dirty = 0;
+  mp_msg(MSGT_DEMUXER, MSGL_V, "Loaded %d keyframes from %s.\n", count, name);
+out:
+  if (f)
+    fclose(f);
+  free(name);
+}
+
+void demux_index_save(demux_index_t *idx, demuxer_t *demuxer)
+{
+  int64_t size;
+  int32_t type, count;
+  char *name;
+  FILE *f;
+  int ok;
+  if (!idx || !idx->dirty || !demuxer_save_index ||
+      !(name = index_filename(demuxer)))
+    return;
+  f = fopen(name, "wb");
+  if (!f) {
+    mp_msg(MSGT_DEMUXER, MSGL_WARN, "Cannot save keyframe index to %s: %s\n",
+           name, strerror(errno));
+    free(name);
+    return;
+  }
+  size = demuxer->stream->end_pos;
+  type = demuxer->type;
+  count = idx->count;
+  ok = fwrite(INDEX_MAGIC, 8, 1, f) == 1 &&
+       fwrite(&size, sizeof(size), 1, f) == 1 &&
+       fwrite(&type, sizeof(type), 1, f) == 1 &&
+       fwrite(&count, sizeof(count), 1, f) == 1 &&
+       fwrite(idx->entries, sizeof(index_entry_t), count, f) == count;
+  if (fclose(f))
+    ok = 0;
+  if (!ok) {
+    mp_msg(MSGT_DEMUXER, MSGL_WARN, "Cannot save keyframe index to %s: %s\n",
+           name, strerror(errno));
+    remove(name);
+  } else {
+    idx->dirty = 0;
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Saved %d keyframes to %s.\n", count, name);
+  }
+  free(name);
+}
@@ -0,0 +1,47 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MPLAYER_DEMUX_INDEX_H
+#define MPLAYER_DEMUX_INDEX_H
+
+#include <sys/types.h>
+
+#include "demuxer.h"
+
+extern int demuxer_save_index;
+
+typedef struct demux_index demux_index_t;
+
+demux_index_t *demux_index_new(void);
+void demux_index_free(demux_index_t *idx);
+
+// whether the video packet buf contains a start code decoding can start at
+int demux_index_is_keyframe(demux_index_t *idx, int format,
+                            const unsigned char *buf, int len);
+
+void demux_index_add(demux_index_t *idx, off_t pos, double pts);
+// the next entry added does not directly follow the last one (seek)
+void demux_index_break(demux_index_t *idx);
+// position of the last keyframe at or before pts, if it is known exactly
+int demux_index_find(demux_index_t *idx, double pts, off_t *pos);
+
+// sidecar file next to the stream, for -demuxer-save-index
+void demux_index_load(demux_index_t *idx, demuxer_t *demuxer);
+void demux_index_save(demux_index_t *idx, demuxer_t *demuxer);
+
+#endif /* MPLAYER_DEMUX_INDEX_H */
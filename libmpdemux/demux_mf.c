@@ -26,8 +26,12 @@
 #include <unistd.h>
 
 #include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "mp_msg.h"
 #include "help_mp.h"
+#include "osdep/timer.h"
 
 #include "stream/stream.h"
 #include "demuxer.h"
@@ -46,35 +50,241 @@ static void demux_seek_mf(demuxer_t *demuxer,float rel_seek_secs,float audio_del
   demuxer->filepos=mf->curr_frame=newpos;
 }
 
+/**
+ * Read a whole image file into a packet, NULL on failure.
+ */
+static demux_packet_t *read_frame_file(const char *name){
+  struct stat      fs;
+  FILE           * f;
+  demux_packet_t * dp;
+
+  if ( stat( name,&fs ) || !( f=fopen( name,"rb" ) ) ) return NULL;
+  dp = new_demux_packet( fs.st_size );
+  if ( dp && !fread( dp->buffer,fs.st_size,1,f ) ) {
+    free_demux_packet(dp);
+    dp = NULL;
+  }
+  fclose( f );
+  return dp;
+}
+
+#if HAVE_PTHREADS
+
+/*
+ * Prefetching: with -mf threads=<n>, n worker threads read the files of
+ * the next -mf prefetch=<n> frames ahead of the demuxer. Frame i goes to
+ * slot i % depth, so the window of frames being read never grows beyond
+ * depth. A seek starts a new generation, workers drop what they read for
+ * an older one.
+ */
+
+enum { SLOT_EMPTY, SLOT_LOADING, SLOT_READY, SLOT_FAILED };
+
+typedef struct {
+  int frame;
+  int state;
+  demux_packet_t *dp;
+} mf_slot_t;
+
+struct mf_prefetch {
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;      // demuxer -> workers: room in the window
+  pthread_cond_t done;      // workers -> demuxer: a frame was read
+  pthread_t *threads;
+  int num_threads;
+  int quit;
+  mf_t *mf;
+  mf_slot_t *slots;
+  int depth;
+  int first;                // frame the demuxer reads next
+  int next;                 // frame the workers read next
+  int generation;
+  // statistics
+  unsigned int start_time;
+  unsigned int wait_time;   // us the demuxer waited for workers
+  int64_t bytes;
+  int frames;
+};
+
+static void *prefetch_thread(void *arg){
+  struct mf_prefetch *p = arg;
+
+  pthread_mutex_lock(&p->mutex);
+  while (!p->quit) {
+    int frame, generation;
+    mf_slot_t *slot;
+    demux_packet_t *dp;
+    if (p->next >= p->first + p->depth || p->next >= p->mf->nr_of_files) {
+      pthread_cond_wait(&p->wake, &p->mutex);
+      continue;
+    }
+    frame = p->next++;
+    generation = p->generation;
+    slot = &p->slots[frame % p->depth];
+    slot->frame = frame;
+    slot->state = SLOT_LOADING;
+    pthread_mutex_unlock(&p->mutex);
+    dp = read_frame_file(p->mf->names[frame]);
+    pthread_mutex_lock(&p->mutex);
+    if (generation != p->generation) {
+      // seeked away meanwhile, the slot may already be reused
+      if (dp)
+        free_demux_packet(dp);
+      continue;
+    }
+    slot->dp = dp;
+    slot->state = dp ? SLOT_READY : SLOT_FAILED;
+    pthread_cond_broadcast(&p->done);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+/**
+ * Drop everything read ahead and restart the window at frame.
+ * The mutex must be locked.
+ */
+static void prefetch_reset(struct mf_prefetch *p, int frame){
+  int i;
+  for (i = 0; i < p->depth; i++) {
+    if (p->slots[i].dp)
+      free_demux_packet(p->slots[i].dp);
+    p->slots[i].dp = NULL;
+    p->slots[i].state = SLOT_EMPTY;
+  }
+  p->first = p->next = frame;
+  p->generation++;
+  pthread_cond_broadcast(&p->wake);
+}
+
+static void prefetch_stop(mf_t *mf){
+  struct mf_prefetch *p = mf->prefetch;
+  unsigned int elapsed;
+  int i;
+  if (!p)
+    return;
+  pthread_mutex_lock(&p->mutex);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->mutex);
+  for (i = 0; i < p->num_threads; i++)
+    pthread_join(p->threads[i], NULL);
+  prefetch_reset(p, 0);
+  elapsed = GetTimer() - p->start_time;
+  if (p->frames && elapsed)
+    mp_msg(MSGT_DEMUX, MSGL_V,
+           "[demux_mf] %d frames prefetched by %d threads: %.1f fps, %.1f MB/s, waited %.2fs for files\n",
+           p->frames, p->num_threads, p->frames * 1e6 / elapsed,
+           p->bytes / (double)elapsed, p->wait_time * 1e-6);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->mutex);
+  free(p->threads);
+  free(p->slots);
+  free(p);
+  mf->prefetch = NULL;
+}
+
+static void prefetch_start(mf_t *mf){
+  struct mf_prefetch *p = calloc(1, sizeof(*p));
+  int i;
+  if (!p)
+    return;
+  p->mf = mf;
+  p->depth = mf_prefetch > mf_threads ? mf_prefetch : mf_threads;
+  p->slots = calloc(p->depth, sizeof(*p->slots));
+  p->threads = calloc(mf_threads, sizeof(*p->threads));
+  if (!p->slots || !p->threads) {
+    free(p->slots);
+    free(p->threads);
+    free(p);
+    return;
+  }
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->first = p->next = mf->curr_frame;
+  p->start_time = GetTimer();
+  mf->prefetch = p;
+  for (i = 0; i < mf_threads; i++) {
+    if (pthread_create(&p->threads[i], NULL, prefetch_thread, p))
+      break;
+    p->num_threads++;
+  }
+  if (!p->num_threads) {
+    prefetch_stop(mf);
+    return;
+  }
+  mp_msg(MSGT_DEMUX, MSGL_V, "[demux_mf] reading %d frames ahead with %d threads\n",
+         p->depth, p->num_threads);
+}
+
+/**
+ * Take the packet of the current frame from the workers.
+ */
+static demux_packet_t *prefetch_get(mf_t *mf){
+  struct mf_prefetch *p = mf->prefetch;
+  int frame = mf->curr_frame;
+  mf_slot_t *slot;
+  demux_packet_t *dp;
+  unsigned int t0 = 0;
+
+  pthread_mutex_lock(&p->mutex);
+  if (frame != p->first)
+    prefetch_reset(p, frame); // after a seek
+  slot = &p->slots[frame % p->depth];
+  while (slot->frame != frame || slot->state < SLOT_READY) {
+    if (!t0)
+      t0 = GetTimer();
+    pthread_cond_wait(&p->done, &p->mutex);
+  }
+  if (t0)
+    p->wait_time += GetTimer() - t0;
+  dp = slot->dp;
+  slot->dp = NULL;
+  slot->state = SLOT_EMPTY;
+  p->first++;
+  if (dp) {
+    p->frames++;
+    p->bytes += dp->len;
+  }
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->mutex);
+  return dp;
+}
+
+#else /* HAVE_PTHREADS */
+
+static void prefetch_start(mf_t *mf){
+  mp_msg(MSGT_DEMUX, MSGL_WARN, "[demux_mf] prefetch threads not available, compiled without pthreads.\n");
+}
+static void prefetch_stop(mf_t *mf) {}
+static demux_packet_t *prefetch_get(mf_t *mf) { return NULL; }
+
+#endif /* HAVE_PTHREADS */
+
 // return value:
 //     0 = EOF or no stream found
 //     1 = successfully read a packet
 static int demux_mf_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds){
-  mf_t         * mf = demuxer->priv;
-  struct stat    fs;
-  FILE         * f;
+  mf_t           * mf = demuxer->priv;
+  sh_video_t     * sh_video = demuxer->video->sh;
+  demux_packet_t * dp;
 
   if ( mf->curr_frame >= mf->nr_of_files ) return 0;
 
-  stat( mf->names[mf->curr_frame],&fs );
-//  printf( "[demux_mf] frame: %d (%s,%d)\n",mf->curr_frame,mf->names[mf->curr_frame],fs.st_size );
+//  printf( "[demux_mf] frame: %d (%s)\n",mf->curr_frame,mf->names[mf->curr_frame] );
 
-  if ( !( f=fopen( mf->names[mf->curr_frame],"rb" ) ) ) return 0;
-  {
-   sh_video_t     * sh_video = demuxer->video->sh;
-   demux_packet_t * dp = new_demux_packet( fs.st_size );
-   if ( !fread( dp->buffer,fs.st_size,1,f ) ) {
-        fclose(f);
-        free_demux_packet(dp);
-        return 0;
-   }
-   dp->pts=mf->curr_frame / sh_video->fps;
-   dp->pos=mf->curr_frame;
-   dp->flags=1;
-   // append packet to DS stream:
-   ds_add_packet( demuxer->video,dp );
-  }
-  fclose( f );
+  if ( mf->prefetch )
+    dp = prefetch_get( mf );
+  else
+    dp = read_frame_file( mf->names[mf->curr_frame] );
+  if ( !dp ) return 0;
+  dp->pts=mf->curr_frame / sh_video->fps;
+  dp->pos=mf->curr_frame;
+  dp->flags=1;
+  // append packet to DS stream:
+  ds_add_packet( demuxer->video,dp );
 
   demuxer->filepos=mf->curr_frame++;
   return 1;
@@ -184,12 +394,16 @@ static demuxer_t* demux_open_mf(demuxer_t* demuxer){
 
   demuxer->priv=(void*)mf;
 
+  if (mf_threads > 0)
+    prefetch_start(mf);
+
   return demuxer;
 }
 
 static void demux_close_mf(demuxer_t* demuxer) {
   mf_t *mf = demuxer->priv;
 
+  prefetch_stop(mf);
   free(mf);
 }
 
@@ -56,6 +56,7 @@
 #include "libavutil/lzo.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/avstring.h"
+#include "osdep/timer.h"
 
 static const unsigned char sipr_swaps[38][2] = {
     {0,63},{1,22},{2,44},{3,90},{5,81},{7,31},{8,86},{9,58},{10,36},{12,68},
@@ -144,6 +145,15 @@ typedef struct mkv_track {
     /* generic content encoding support */
     mkv_content_encoding_t *encodings;
     int num_encodings;
+    /* decoded frames, reused from frame to frame; two of them so the
+       encodings can be undone one after the other */
+    uint8_t *decode_buf[2];
+    size_t decode_size[2];
+#if CONFIG_ZLIB
+    z_stream *zstream;          /* reset for each frame */
+#endif
+    unsigned int decode_frames, decode_time;    /* time in us */
+    uint64_t decode_in, decode_out;
 
     /* For VobSubs and SSA/ASS */
     sh_sub_t *sh_sub;
@@ -154,11 +164,15 @@ typedef struct mkv_index {
     uint64_t timecode, filepos;
 } mkv_index_t;
 
+typedef struct mkv_cluster {
+    uint64_t pos;
+    int64_t timecode;           /* in ms, -1 if not known yet */
+} mkv_cluster_t;
+
 typedef struct mkv_demuxer {
     off_t segment_start;
 
     float duration, last_pts;
-    uint64_t last_filepos;
 
     mkv_track_t **tracks;
     int num_tracks;
@@ -177,8 +191,10 @@ typedef struct mkv_demuxer {
     off_t *parsed_seekhead;
     int parsed_seekhead_num;
 
-    uint64_t *cluster_positions;
-    int num_cluster_pos;
+    /* clusters seen while playing or probed while seeking, by position */
+    mkv_cluster_t *clusters;
+    int num_clusters;
+    uint64_t cluster_start;
 
     int64_t skip_to_timecode;
     int v_skip_to_keyframe, a_skip_to_keyframe;
@@ -194,6 +210,10 @@ typedef struct mkv_demuxer {
 #define RAPROPERTIES4_SIZE 56
 #define RAPROPERTIES5_SIZE 70
 
+#define SEEK_MAX_PROBES     32
+#define SEEK_PRECISION      (64 * 1024)         /* stop bisecting below this */
+#define SEEK_MAX_SCAN       (16 * 1024 * 1024)  /* searched for a cluster */
+
 /**
  * \brief ensures there is space for at least one additional element
  * \param arrayp array to grow
@@ -227,21 +247,129 @@ static mkv_track_t *demux_mkv_find_track_by_num(mkv_demuxer_t *d, int n,
     return NULL;
 }
 
-static void add_cluster_position(mkv_demuxer_t *mkv_d, uint64_t position)
+/**
+ * \brief adds a cluster to the cluster index unless it is already known
+ * \return position of the cluster in mkv_d->clusters, -1 if out of memory
+ */
+static int add_cluster_position(mkv_demuxer_t *mkv_d, uint64_t position)
 {
-    int i = mkv_d->num_cluster_pos;
+    int lo = 0, hi = mkv_d->num_clusters;
+
+    /* mostly appended while playing on */
+    if (hi && mkv_d->clusters[hi - 1].pos < position)
+        lo = hi;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (mkv_d->clusters[mid].pos < position)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < mkv_d->num_clusters && mkv_d->clusters[lo].pos == position)
+        return lo;
 
-    while (i--)
-        if (mkv_d->cluster_positions[i] == position)
-            return;
+    grow_array(&mkv_d->clusters, mkv_d->num_clusters, sizeof(mkv_cluster_t));
+    if (!mkv_d->clusters) {
+        mkv_d->num_clusters = 0;
+        return -1;
+    }
+    memmove(mkv_d->clusters + lo + 1, mkv_d->clusters + lo,
+            (mkv_d->num_clusters - lo) * sizeof(mkv_cluster_t));
+    mkv_d->clusters[lo].pos = position;
+    mkv_d->clusters[lo].timecode = -1;
+    mkv_d->num_clusters++;
+    return lo;
+}
 
-    grow_array(&mkv_d->cluster_positions, mkv_d->num_cluster_pos,
-               sizeof(uint64_t));
-    if (!mkv_d->cluster_positions) {
-        mkv_d->num_cluster_pos = 0;
-        return;
+static void add_cluster_timecode(mkv_demuxer_t *mkv_d, uint64_t position,
+                                 int64_t timecode)
+{
+    int i = add_cluster_position(mkv_d, position);
+
+    if (i >= 0)
+        mkv_d->clusters[i].timecode = timecode;
+}
+
+/**
+ * \brief finds the first cluster that starts in [pos, end) and reads its
+ * timecode, which muxers put first in the cluster
+ * \return position of the cluster in mkv_d->clusters, -1 if none was found
+ */
+static int probe_cluster(demuxer_t *demuxer, uint64_t pos, uint64_t end)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    stream_t *s = demuxer->stream;
+    uint64_t limit = FFMIN(end, pos + SEEK_MAX_SCAN) + 4;
+    uint32_t id = 0;
+
+    stream_seek(s, pos);
+    while (pos < limit && !s->eof) {
+        uint64_t start, length, num;
+
+        id = (id << 8) | stream_read_char(s);
+        pos++;
+        if (id != MATROSKA_ID_CLUSTER)
+            continue;
+        /* the ID may as well be part of some frame, check what follows */
+        start = pos - 4;
+        length = ebml_read_length(s, NULL);
+        if ((length == EBML_UINT_INVALID
+             || start + length <= (uint64_t) demuxer->movi_end)
+            && ebml_read_id(s, NULL) == MATROSKA_ID_CLUSTERTIMECODE
+            && (num = ebml_read_uint(s, NULL)) != EBML_UINT_INVALID) {
+            int i = add_cluster_position(mkv_d, start);
+            if (i >= 0)
+                mkv_d->clusters[i].timecode =
+                    num * mkv_d->tc_scale / 1000000.0;
+            return i;
+        }
+        stream_seek(s, pos);
+        id = 0;
     }
-    mkv_d->cluster_positions[mkv_d->num_cluster_pos++] = position;
+    return -1;
+}
+
+/**
+ * \brief finds the last cluster starting at or before timecode (in ms) by
+ * bisecting the file between the clusters known so far
+ * \return position of the cluster in the file, 0 if none was found
+ */
+static uint64_t seek_cluster(demuxer_t *demuxer, int64_t timecode)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    uint64_t a = mkv_d->segment_start, b = demuxer->movi_end, found = 0;
+    int i, probes = 0;
+
+    for (i = 0; i < mkv_d->num_clusters; i++) {
+        if (mkv_d->clusters[i].timecode < 0)
+            continue;
+        if (mkv_d->clusters[i].timecode > timecode) {
+            b = mkv_d->clusters[i].pos;
+            break;
+        }
+        found = mkv_d->clusters[i].pos;
+        a = found + 1;
+    }
+
+    while (b > a + SEEK_PRECISION && probes++ < SEEK_MAX_PROBES) {
+        uint64_t mid = a + (b - a) / 2;
+
+        i = probe_cluster(demuxer, mid, b);
+        if (i < 0 || mkv_d->clusters[i].pos >= b)
+            b = mid;
+        else if (mkv_d->clusters[i].timecode <= timecode) {
+            found = mkv_d->clusters[i].pos;
+            a = found + 1;
+        } else
+            b = mkv_d->clusters[i].pos;
+    }
+    mp_msg(MSGT_DEMUX, MSGL_DBG2, "[mkv] cluster search: %d probes, "
+           "%d clusters known\n", probes, mkv_d->num_clusters);
+
+    /* before the first cluster we know of, or the search gave up early */
+    if (!found && (i = probe_cluster(demuxer, a, b)) >= 0)
+        found = mkv_d->clusters[i].pos;
+    return found;
 }
 
 
@@ -284,113 +412,177 @@ static void free_cached_dps(demuxer_t *demuxer)
     }
 }
 
+/* Max of both because we might decompress the input multiple times. */
+#define DECODE_PADDING FFMAX(AV_LZO_OUTPUT_PADDING, AV_LZO_INPUT_PADDING)
+
+/**
+ * \brief grows one of the decode buffers of a track to hold size bytes
+ * \return the buffer, NULL if out of memory
+ */
+static uint8_t *decode_buffer(mkv_track_t *track, int n, size_t size)
+{
+    if (size > track->decode_size[n]) {
+        uint8_t *buf;
+        if (size > SIZE_MAX - DECODE_PADDING)
+            return NULL;
+        buf = realloc(track->decode_buf[n], size + DECODE_PADDING);
+        if (!buf)
+            return NULL;
+        track->decode_buf[n] = buf;
+        track->decode_size[n] = size;
+    }
+    return track->decode_buf[n];
+}
+
+#if CONFIG_ZLIB
+static int decode_zlib(mkv_track_t *track, int n, uint8_t *src, size_t *size)
+{
+    z_stream *zstream = track->zstream;
+    int result;
+
+    if (!zstream) {
+        zstream = calloc(1, sizeof(*zstream));
+        if (!zstream || inflateInit(zstream) != Z_OK) {
+            mp_msg(MSGT_DEMUX, MSGL_WARN,
+                   MSGTR_MPDEMUX_MKV_ZlibInitializationFailed);
+            free(zstream);
+            return 0;
+        }
+        track->zstream = zstream;
+    } else if (inflateReset(zstream) != Z_OK)
+        return 0;
+
+    zstream->next_in = (Bytef *) src;
+    zstream->avail_in = *size;
+    if (!decode_buffer(track, n, FFMAX(*size, 4000)))
+        return 0;
+    do {
+        if (zstream->total_out == track->decode_size[n]) {
+            if (track->decode_size[n] > SIZE_MAX / 2
+                || !decode_buffer(track, n, 2 * track->decode_size[n]))
+                return 0;
+        }
+        zstream->next_out = (Bytef *) (track->decode_buf[n] +
+                                       zstream->total_out);
+        zstream->avail_out = track->decode_size[n] - zstream->total_out;
+        result = inflate(zstream, Z_NO_FLUSH);
+        /* the output filled the buffer exactly */
+        if (result == Z_BUF_ERROR && !zstream->avail_in)
+            break;
+        if (result != Z_OK && result != Z_STREAM_END)
+            return 0;
+    } while (result != Z_STREAM_END && zstream->avail_out == 0);
+
+    *size = zstream->total_out;
+    return 1;
+}
+#endif
+
+static int decode_lzo(mkv_track_t *track, int n, uint8_t *src, size_t *size)
+{
+    size_t dstlen = *size > SIZE_MAX / 3 ? *size : *size * 3;
+    int out_avail, srclen, result;
+
+    dstlen = FFMAX(dstlen, track->decode_size[n]);
+    while (1) {
+        if (dstlen > INT_MAX || !decode_buffer(track, n, dstlen))
+            return 0;
+        out_avail = dstlen;
+        srclen = *size;
+        result = av_lzo1x_decode(track->decode_buf[n], &out_avail,
+                                 src, &srclen);
+        if (result == 0)
+            break;
+        if (!(result & AV_LZO_OUTPUT_FULL))
+            return 0;
+        mp_msg(MSGT_DEMUX, MSGL_DBG2,
+               "[mkv] lzo decompression buffer too small.\n");
+        if (dstlen > SIZE_MAX / 2)
+            return 0;
+        dstlen *= 2;
+    }
+    *size = dstlen - out_avail;
+    return 1;
+}
+
+/**
+ * \brief undoes the content encodings of a track
+ * \param dest set to the decoded data, src if nothing had to be done and
+ *   NULL if decoding failed. Decoded data belongs to the track and stays
+ *   valid until the next call for it.
+ * \return whether the data was modified
+ */
 static int demux_mkv_decode(mkv_track_t *track, uint8_t *src,
                             uint8_t **dest, size_t *size, uint32_t type)
 {
-    int i, result;
+    unsigned int start = 0;
+    int i, n = 0;
     int modified = 0;
+    size_t in_size = *size;
 
     *dest = src;
     if (track->num_encodings <= 0)
         return 0;
 
-    for (i = 0; i < track->num_encodings; i++) {
-        if (!(track->encodings[i].scope & type))
+    /* the encoding applied last during muxing has the highest order */
+    for (i = track->num_encodings - 1; i >= 0; i--) {
+        mkv_content_encoding_t *e = &track->encodings[i];
+        uint8_t *in = *dest;
+
+        if (!(e->scope & type))
             continue;
+        if (!modified)
+            start = GetTimer();
 
 #if CONFIG_ZLIB
-        if (track->encodings[i].comp_algo == 0) {
+        if (e->comp_algo == 0) {
             /* zlib encoded track */
-            z_stream zstream;
-
-            zstream.zalloc = (alloc_func) 0;
-            zstream.zfree = (free_func) 0;
-            zstream.opaque = (voidpf) 0;
-            if (inflateInit(&zstream) != Z_OK) {
+            modified = 1;
+            if (!decode_zlib(track, n, in, size)) {
                 mp_msg(MSGT_DEMUX, MSGL_WARN,
-                       MSGTR_MPDEMUX_MKV_ZlibInitializationFailed);
+                       MSGTR_MPDEMUX_MKV_ZlibDecompressionFailed);
+                *dest = NULL;
                 return modified;
             }
-            zstream.next_in = (Bytef *) src;
-            zstream.avail_in = *size;
-
-            modified = 1;
-            *dest = NULL;
-            zstream.avail_out = *size;
-            do {
-                if (*size > SIZE_MAX - 4000 - AV_LZO_INPUT_PADDING)
-                    goto zlib_fail;
-
-                *size += 4000;
-                *dest = realloc(*dest, *size + AV_LZO_INPUT_PADDING);
-                if (!*dest)
-                    goto zlib_fail;
-                zstream.next_out = (Bytef *) (*dest + zstream.total_out);
-                result = inflate(&zstream, Z_NO_FLUSH);
-                if (result != Z_OK && result != Z_STREAM_END) {
-zlib_fail:
-                    mp_msg(MSGT_DEMUX, MSGL_WARN,
-                           MSGTR_MPDEMUX_MKV_ZlibDecompressionFailed);
-                    free(*dest);
-                    *dest = NULL;
-                    inflateEnd(&zstream);
-                    return modified;
-                }
-                zstream.avail_out += 4000;
-            } while (zstream.avail_out == 4000 && zstream.avail_in != 0
-                     && result != Z_STREAM_END);
-
-            *size = zstream.total_out;
-            inflateEnd(&zstream);
+            *dest = track->decode_buf[n];
+            n ^= 1;
         }
 #endif
-        if (track->encodings[i].comp_algo == 2) {
+        if (e->comp_algo == 2) {
             /* lzo encoded track */
-            int out_avail;
-            int dstlen = *size > SIZE_MAX/3 ? *size : *size * 3;
-
-            *dest = NULL;
-            while (1) {
-                // Max of both because we might decompress the input multiple
-                // times. Makes no sense but is possible.
-                int padding = FFMAX(AV_LZO_OUTPUT_PADDING, AV_LZO_INPUT_PADDING);
-                int srclen = *size;
-                if (dstlen > SIZE_MAX - padding)
-                    goto lzo_fail;
-                *dest = realloc(*dest, dstlen + padding);
-                if (!*dest)
-                    goto lzo_fail;
-                out_avail = dstlen;
-                result = av_lzo1x_decode(*dest, &out_avail, src, &srclen);
-                if (result == 0)
-                    break;
-                if (!(result & AV_LZO_OUTPUT_FULL)) {
-lzo_fail:
-                    mp_msg(MSGT_DEMUX, MSGL_WARN,
-                           MSGTR_MPDEMUX_MKV_LzoDecompressionFailed);
-                    free(*dest);
-                    *dest = NULL;
-                    return modified;
-                }
-                mp_msg(MSGT_DEMUX, MSGL_DBG2,
-                       "[mkv] lzo decompression buffer too small.\n");
-                if (dstlen > (SIZE_MAX - padding)/2)
-                    goto lzo_fail;
-                dstlen *= 2;
+            modified = 1;
+            if (!decode_lzo(track, n, in, size)) {
+                mp_msg(MSGT_DEMUX, MSGL_WARN,
+                       MSGTR_MPDEMUX_MKV_LzoDecompressionFailed);
+                *dest = NULL;
+                return modified;
             }
-            *size = dstlen - out_avail;
+            *dest = track->decode_buf[n];
+            n ^= 1;
         }
-      else if (track->encodings[i].comp_algo == 3)
+      else if (e->comp_algo == 3)
         {
-          *dest = malloc (*size + track->encodings[i].comp_settings_len);
-          memcpy(*dest, track->encodings[i].comp_settings,
-                 track->encodings[i].comp_settings_len);
-          memcpy(*dest + track->encodings[i].comp_settings_len, src, *size);
-          *size += track->encodings[i].comp_settings_len;
+          /* header stripping */
           modified = 1;
+          if (*size > SIZE_MAX - e->comp_settings_len
+              || !decode_buffer(track, n, *size + e->comp_settings_len)) {
+              *dest = NULL;
+              return modified;
+          }
+          memcpy(track->decode_buf[n], e->comp_settings, e->comp_settings_len);
+          memcpy(track->decode_buf[n] + e->comp_settings_len, in, *size);
+          *size += e->comp_settings_len;
+          *dest = track->decode_buf[n];
+          n ^= 1;
         }
     }
 
+    if (modified) {
+        track->decode_time += GetTimer() - start;
+        track->decode_frames++;
+        track->decode_in += in_size;
+        track->decode_out += *size;
+    }
     return modified;
 }
 
@@ -744,6 +936,14 @@ static void demux_mkv_free_trackentry(mkv_track_t *track)
     free(track->audio_buf);
     free(track->audio_timestamp);
     demux_mkv_free_encodings(track->encodings, track->num_encodings);
+    free(track->decode_buf[0]);
+    free(track->decode_buf[1]);
+#if CONFIG_ZLIB
+    if (track->zstream) {
+        inflateEnd(track->zstream);
+        free(track->zstream);
+    }
+#endif
     free(track);
 }
 
@@ -1965,9 +2165,13 @@ static int demux_mkv_open_sub(demuxer_t *demuxer, mkv_track_t *track,
         size = track->private_size;
         m = demux_mkv_decode(track, track->private_data, &buffer, &size, 2);
         if (buffer && m) {
-            free(track->private_data);
-            track->private_data = buffer;
-            track->private_size = size;
+            uint8_t *data = malloc(size + AV_LZO_INPUT_PADDING);
+            if (data) {
+                memcpy(data, buffer, size);
+                free(track->private_data);
+                track->private_data = data;
+                track->private_size = size;
+            }
         }
         if (track->private_size > INT_MAX) {
             mp_msg(MSGT_DEMUX, MSGL_ERR, "[mkv] Integer overflow!\n");
@@ -2175,7 +2379,8 @@ static int demux_mkv_open(demuxer_t *demuxer)
         }
     }
 
-    if (s->end_pos == 0 || (mkv_d->indexes == NULL && index_mode < 0))
+    /* without cues, seeks search the file for clusters */
+    if (s->end_pos == 0)
         demuxer->seekable = 0;
     else {
         demuxer->movi_start = s->start_pos;
@@ -2194,12 +2399,20 @@ static void demux_close_mkv(demuxer_t *demuxer)
         int i;
         free_cached_dps(demuxer);
         if (mkv_d->tracks) {
-            for (i = 0; i < mkv_d->num_tracks; i++)
-                demux_mkv_free_trackentry(mkv_d->tracks[i]);
+            for (i = 0; i < mkv_d->num_tracks; i++) {
+                mkv_track_t *track = mkv_d->tracks[i];
+                if (track->decode_frames)
+                    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Track %d: decoded %u "
+                           "frames, %" PRIu64 " kB to %" PRIu64 " kB in "
+                           "%.3f s\n", track->tnum, track->decode_frames,
+                           track->decode_in >> 10, track->decode_out >> 10,
+                           track->decode_time / 1e6);
+                demux_mkv_free_trackentry(track);
+            }
             free(mkv_d->tracks);
         }
         free(mkv_d->indexes);
-        free(mkv_d->cluster_positions);
+        free(mkv_d->clusters);
         free(mkv_d->parsed_cues);
         free(mkv_d->parsed_seekhead);
         free(mkv_d);
@@ -2287,11 +2500,40 @@ static int demux_mkv_read_block_lacing(uint8_t *buffer, uint64_t *size,
     return 0;
 }
 
+/**
+ * \brief makes a packet for a part of a block
+ *
+ * Only the lace at the end of the block has the block's padding after it
+ * and shares the block's buffer, the others are copied.
+ */
+static demux_packet_t *new_lace_packet(demux_packet_t *block, uint8_t *buffer,
+                                       uint32_t size)
+{
+    demux_packet_t *dp;
+
+    if (buffer + size != block->buffer + block->len) {
+        dp = new_demux_packet(size);
+        if (dp)
+            memcpy(dp->buffer, buffer, size);
+        return dp;
+    }
+    dp = clone_demux_packet(block);
+    if (dp) {
+        dp->buffer = buffer;
+        dp->len = size;
+        /* the buffer belongs to the block, never release it on its own */
+        dp->borrowed = 1;
+    }
+    return dp;
+}
+
 static void handle_subtitles(demuxer_t *demuxer, mkv_track_t *track,
                              char *block, int64_t size,
                              uint64_t block_duration, uint64_t timecode)
 {
     demux_packet_t *dp;
+    uint8_t *buffer;
+    size_t len = size;
 
     if (block_duration == 0) {
         mp_msg(MSGT_DEMUX, MSGL_WARN,
@@ -2299,9 +2541,14 @@ static void handle_subtitles(demuxer_t *demuxer, mkv_track_t *track,
         return;
     }
 
+    demux_mkv_decode(track, block, &buffer, &len, 1);
+    if (!buffer)
+        return;
     sub_utf8 = 1;
-    dp = new_demux_packet(size);
-    memcpy(dp->buffer, block, size);
+    dp = new_demux_packet(len);
+    if (!dp)
+        return;
+    memcpy(dp->buffer, buffer, len);
     dp->pts = timecode / 1000.0f;
     dp->endpts = (timecode + block_duration) / 1000.0f;
     ds_add_packet(demuxer->sub, dp);
@@ -2484,7 +2731,7 @@ static void flush_cached_dps(demuxer_t *demuxer, mkv_track_t *track)
  *
  * Timecode reordering is needed if a video track contains B frames that
  * are timestamped in display order (e.g. MPEG-1, MPEG-2 or "native" MPEG-4).
- * This function takes in a Matroska block read from the file, allocates a
+ * This function takes in a Matroska block read from the file, makes a
  * demux packet for it, fills in its values, allocates space for storing
  * pointers to the cached demux packets and adds the packet to it. If
  * the packet contains an I or a P frame then ::flush_cached_dps is called
@@ -2492,7 +2739,8 @@ static void flush_cached_dps(demuxer_t *demuxer, mkv_track_t *track)
  *
  * \param demuxer The Matroska demuxer struct for this instance.
  * \param track The packet is meant for this track.
- * \param buffer The actual frame contents.
+ * \param block The packet holding the whole block, see ::new_lace_packet.
+ * \param buffer The actual frame contents inside the block.
  * \param size The frame size in bytes.
  * \param block_bref A relative timecode (backward reference). If it is \c 0
  *   then the frame is an I frame.
@@ -2501,14 +2749,15 @@ static void flush_cached_dps(demuxer_t *demuxer, mkv_track_t *track)
  *   of \a block_bref. Otherwise it's a B frame.
  */
 static void handle_video_bframes(demuxer_t *demuxer, mkv_track_t *track,
-                                 uint8_t *buffer, uint32_t size,
-                                 int block_bref, int block_fref)
+                                 demux_packet_t *block, uint8_t *buffer,
+                                 uint32_t size, int block_bref, int block_fref)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
     demux_packet_t *dp;
 
-    dp = new_demux_packet(size);
-    memcpy(dp->buffer, buffer, size);
+    dp = new_lace_packet(block, buffer, size);
+    if (!dp)
+        return;
     dp->pos = demuxer->filepos;
     dp->pts = mkv_d->last_pts;
     if ((track->num_cached_dps > 0) && (dp->pts < track->max_pts))
@@ -2529,14 +2778,15 @@ static void handle_video_bframes(demuxer_t *demuxer, mkv_track_t *track,
         track->max_pts = dp->pts;
 }
 
-static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
+static int handle_block(demuxer_t *demuxer, demux_packet_t *block_dp,
                         uint64_t block_duration, int64_t block_bref,
                         int64_t block_fref, uint8_t simpleblock)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
     mkv_track_t *track = NULL;
     demux_stream_t *ds = NULL;
-    uint64_t old_length;
+    uint8_t *block = block_dp->buffer;
+    uint64_t length = block_dp->len, old_length;
     int64_t tc;
     uint32_t *lace_size;
     uint8_t laces, flags;
@@ -2625,9 +2875,14 @@ static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
 
     if (use_this_block) {
         mkv_d->last_pts = current_pts;
-        mkv_d->last_filepos = demuxer->filepos;
 
         for (i = 0; i < laces; i++) {
+            if (lace_size[i] > length) {
+                mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] lace sizes exceed the "
+                       "block size\n");
+                break;
+            }
+            length -= lace_size[i];
             if (ds == demuxer->video && track->realmedia)
                 handle_realvideo(demuxer, track, block, lace_size[i],
                                  block_bref);
@@ -2635,19 +2890,21 @@ static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
                 handle_realaudio(demuxer, track, block, lace_size[i],
                                  block_bref);
             else if (ds == demuxer->video && track->reorder_timecodes)
-                handle_video_bframes(demuxer, track, block, lace_size[i],
-                                     block_bref, block_fref);
+                handle_video_bframes(demuxer, track, block_dp, block,
+                                     lace_size[i], block_bref, block_fref);
             else {
                 int modified;
                 size_t size = lace_size[i];
                 demux_packet_t *dp;
                 uint8_t *buffer;
                 modified = demux_mkv_decode(track, block, &buffer, &size, 1);
-                if (buffer) {
-                    dp = new_demux_packet(size);
+                if (!modified)
+                    dp = new_lace_packet(block_dp, block, size);
+                else if (buffer && (dp = new_demux_packet(size)))
                     memcpy(dp->buffer, buffer, size);
-                    if (modified)
-                        free(buffer);
+                else
+                    dp = NULL;
+                if (dp) {
                     dp->flags = (block_bref == 0
                                  && block_fref == 0) ? 0x10 : 0;
                     /* If default_duration is 0, assume no pts value is known
@@ -2676,6 +2933,42 @@ static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
     return 0;
 }
 
+/**
+ * Read a block of the given length into a demux packet. If the stream is
+ * memory mapped the packet points directly into the mapping.
+ * The laces of the block are queued as clones of this packet.
+ * There always are MP_INPUT_BUFFER_PADDING_SIZE readable bytes after the
+ * block, but with a mapped stream they are not zeroed.
+ */
+static demux_packet_t *read_block_data(stream_t *s, uint64_t length)
+{
+    demux_packet_t *block;
+
+    if (length > INT_MAX - MP_INPUT_BUFFER_PADDING_SIZE)
+        return NULL;
+    if (stream_peek(s, length + MP_INPUT_BUFFER_PADDING_SIZE)
+        && (block = new_demux_packet(0))) {
+        block->buffer = stream_borrow(s, length);
+        block->borrowed = 1;
+        block->len = length;
+        return block;
+    }
+    block = new_demux_packet(length);
+    if (!block)
+        return NULL;
+    if (stream_read(s, block->buffer, length) != (int) length) {
+        free_demux_packet(block);
+        return NULL;
+    }
+    return block;
+}
+
+static void free_block(demux_packet_t *block)
+{
+    if (block)
+        free_demux_packet(block);
+}
+
 static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
@@ -2687,14 +2980,14 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
         while (mkv_d->cluster_size > 0) {
             uint64_t block_duration = 0, block_length = 0;
             int64_t block_bref = 0, block_fref = 0;
-            uint8_t *block = NULL;
+            demux_packet_t *block = NULL;
 
             while (mkv_d->blockgroup_size > 0) {
                 switch (ebml_read_id(s, &il)) {
                 case MATROSKA_ID_BLOCKDURATION:
                     block_duration = ebml_read_uint(s, &l);
                     if (block_duration == EBML_UINT_INVALID) {
-                        free(block);
+                        free_block(block);
                         return 0;
                     }
                     block_duration *= mkv_d->tc_scale / 1000000.0;
@@ -2702,16 +2995,11 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
 
                 case MATROSKA_ID_BLOCK:
                     block_length = ebml_read_length(s, &tmp);
-                    free(block);
-                    if (block_length > SIZE_MAX - AV_LZO_INPUT_PADDING)
-                        return 0;
-                    block = malloc(block_length + AV_LZO_INPUT_PADDING);
+                    free_block(block);
                     demuxer->filepos = stream_tell(s);
-                    if (stream_read(s, block, block_length) !=
-                        (int) block_length) {
-                        free(block);
+                    block = read_block_data(s, block_length);
+                    if (!block)
                         return 0;
-                    }
                     l = tmp + block_length;
                     break;
 
@@ -2719,7 +3007,7 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                 {
                     int64_t num = ebml_read_int(s, &l);
                     if (num == EBML_INT_INVALID) {
-                        free(block);
+                        free_block(block);
                         return 0;
                     }
                     if (num <= 0)
@@ -2730,7 +3018,7 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                 }
 
                 case EBML_ID_INVALID:
-                    free(block);
+                    free_block(block);
                     return 0;
 
                 default:
@@ -2742,10 +3030,9 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
             }
 
             if (block) {
-                int res = handle_block(demuxer, block, block_length,
-                                       block_duration, block_bref, block_fref,
-                                       0);
-                free(block);
+                int res = handle_block(demuxer, block, block_duration,
+                                       block_bref, block_fref, 0);
+                free_block(block);
                 if (res < 0)
                     return 0;
                 if (res)
@@ -2764,6 +3051,8 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                         mkv_d->has_first_tc = 1;
                     }
                     mkv_d->cluster_tc = num * mkv_d->tc_scale;
+                    add_cluster_timecode(mkv_d, mkv_d->cluster_start,
+                                         num * mkv_d->tc_scale / 1000000.0);
                     break;
                 }
 
@@ -2776,20 +3065,14 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                 {
                     int res;
                     block_length = ebml_read_length(s, &tmp);
-                    if (block_length > SIZE_MAX)
-                        return 0;
-                    block = malloc(block_length);
                     demuxer->filepos = stream_tell(s);
-                    if (stream_read(s, block, block_length) !=
-                        (int) block_length) {
-                        free(block);
+                    block = read_block_data(s, block_length);
+                    if (!block)
                         return 0;
-                    }
                     l = tmp + block_length;
-                    res = handle_block(demuxer, block, block_length,
-                                       block_duration, block_bref,
-                                       block_fref, 1);
-                    free(block);
+                    res = handle_block(demuxer, block, block_duration,
+                                       block_bref, block_fref, 1);
+                    free_block(block);
                     mkv_d->cluster_size -= l + il;
                     if (res < 0)
                         return 0;
@@ -2812,7 +3095,8 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
 
         if (ebml_read_id(s, &il) != MATROSKA_ID_CLUSTER)
             return 0;
-        add_cluster_position(mkv_d, stream_tell(s) - il);
+        mkv_d->cluster_start = stream_tell(s) - il;
+        add_cluster_position(mkv_d, mkv_d->cluster_start);
         mkv_d->cluster_size = ebml_read_length(s, NULL);
     }
 
@@ -2836,51 +3120,9 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs,
             target_timecode = 0;
 
         if (mkv_d->indexes == NULL) {   /* no index was found */
-            uint64_t target_filepos, cluster_pos, max_pos;
-
-            target_filepos =
-                (uint64_t) (target_timecode * mkv_d->last_filepos /
-                            (mkv_d->last_pts * 1000.0));
-
-            max_pos = mkv_d->num_cluster_pos ?
-                mkv_d->cluster_positions[mkv_d->num_cluster_pos - 1] : 0;
-            if (target_filepos > max_pos) {
-                if ((off_t) max_pos > stream_tell(s))
-                    stream_seek(s, max_pos);
-                else
-                    stream_seek(s, stream_tell(s) + mkv_d->cluster_size);
-                /* parse all the clusters upto target_filepos */
-                while (!s->eof && stream_tell(s) < (off_t) target_filepos) {
-                    switch (ebml_read_id(s, &i)) {
-                    case MATROSKA_ID_CLUSTER:
-                        add_cluster_position(mkv_d,
-                                             (uint64_t) stream_tell(s) - i);
-                        break;
-
-                    case MATROSKA_ID_CUES:
-                        demux_mkv_read_cues(demuxer);
-                        break;
-                    }
-                    ebml_read_skip(s, NULL);
-                }
-                if (s->eof)
-                    stream_reset(s);
-            }
-
-            if (mkv_d->indexes == NULL) {
-                cluster_pos = mkv_d->cluster_positions[0];
-                /* Let's find the nearest cluster */
-                for (i = 0; i < mkv_d->num_cluster_pos; i++) {
-                    diff = mkv_d->cluster_positions[i] - target_filepos;
-                    if (rel_seek_secs < 0 && diff < 0 && -diff < min_diff) {
-                        cluster_pos = mkv_d->cluster_positions[i];
-                        min_diff = -diff;
-                    } else if (rel_seek_secs > 0
-                               && (diff < 0 ? -1 * diff : diff) < min_diff) {
-                        cluster_pos = mkv_d->cluster_positions[i];
-                        min_diff = diff < 0 ? -1 * diff : diff;
-                    }
-                }
+            uint64_t cluster_pos = seek_cluster(demuxer, target_timecode +
+                                                mkv_d->first_tc);
+            if (cluster_pos) {
                 mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
                 stream_seek(s, cluster_pos);
             }
@@ -2942,12 +3184,25 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs,
         mkv_index_t *index = NULL;
         int i;
 
-        if (mkv_d->indexes == NULL) {   /* no index was found *//* I'm lazy... */
-            mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] seek unsupported flags\n");
+        target_filepos = (uint64_t) (demuxer->movi_end * rel_seek_secs);
+        if (mkv_d->indexes == NULL) {   /* no index was found */
+            i = probe_cluster(demuxer, FFMAX(target_filepos,
+                                             mkv_d->segment_start),
+                              demuxer->movi_end);
+            if (i < 0) {
+                mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] no cluster after %"
+                       PRIu64 "\n", target_filepos);
+                return;
+            }
+            mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
+            stream_seek(s, mkv_d->clusters[i].pos);
+            if (demuxer->video->id >= 0)
+                mkv_d->v_skip_to_keyframe = 1;
+            mkv_d->a_skip_to_keyframe = 1;
+            demux_mkv_fill_buffer(demuxer, NULL);
             return;
         }
 
-        target_filepos = (uint64_t) (demuxer->movi_end * rel_seek_secs);
         for (i = 0; i < mkv_d->num_indexes; i++)
             if (mkv_d->indexes[i].tnum == demuxer->video->id)
                 if ((index == NULL)
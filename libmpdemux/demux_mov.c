@@ -41,8 +41,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 
 #include "config.h"
 
@@ -83,21 +86,8 @@
 #define char2int(x,y) 	AV_RB32(&(x)[(y)])
 
 typedef struct {
-    unsigned int pts; // duration
-    unsigned int size;
-    off_t pos;
-} mov_sample_t;
-
-typedef struct {
-    unsigned int sample; // number of the first sample in the chunk
-    unsigned int size;   // number of samples in the chunk
-    int desc;            // for multiple codecs mode - not used
-    off_t pos;
-} mov_chunk_t;
-
-typedef struct {
-    unsigned int first;
-    unsigned int spc;
+    unsigned int first;  // first chunk of the run
+    unsigned int spc;    // samples per chunk
     unsigned int sdid;
 } mov_chunkmap_t;
 
@@ -117,6 +107,22 @@ typedef struct {
     int pts_offset;
 } mov_editlist_t;
 
+/*
+ * The sample tables are kept run-length coded as they are in the file.
+ * Lookups walk them from where the last lookup on the track stopped, so
+ * reading on costs next to nothing and a seek only skips table entries.
+ */
+typedef struct {
+    int durmap;          // durmap entry of the last pts lookup
+    int64_t dur_sample;  // its first sample
+    int64_t dur_pts;     // and the pts of that
+    int chunkmap;        // chunkmap entry of the last chunk lookup
+    int64_t map_sample;  // first sample of its first chunk
+    int sample;          // last sample looked up by position, -1 if none
+    int64_t chunk_end;   // first sample after its chunk
+    off_t pos;           // and its position
+} mov_cursor_t;
+
 #define MOV_TRAK_UNKNOWN 0
 #define MOV_TRAK_VIDEO 1
 #define MOV_TRAK_AUDIO 2
@@ -149,90 +155,249 @@ typedef struct {
     unsigned char* stream_header;
     int stream_header_len; // if >0, this header should be sent before the 1st frame
     //
-    int samples_size;
-    mov_sample_t* samples;
+    int samples_size;      // number of samples
+    int sizes_size;
+    unsigned int* sizes;   // sample sizes, none if all are fixed_size bytes
+    unsigned int fixed_size;
     int chunks_size;
-    mov_chunk_t* chunks;
+    off_t* chunks;         // chunk offsets
     int chunkmap_size;
     mov_chunkmap_t* chunkmap;
     int durmap_size;
     mov_durmap_t* durmap;
     int keyframes_size;
-    unsigned int* keyframes;
+    unsigned int* keyframes; // sorted
     int editlist_size;
     mov_editlist_t* editlist;
     int editlist_pos;
+    mov_cursor_t cursor;
     //
     void* desc; // image/sound/etc description (pointer to ImageDescription etc)
 } mov_track_t;
 
-static void mov_build_index(mov_track_t* trak,int timescale){
-    int i,j,s;
-    int last=trak->chunks_size;
-    unsigned int pts=0;
+static unsigned int mov_sample_size(mov_track_t* trak, int sample){
+    if (!trak->sizes_size)
+        return trak->fixed_size;
+    return sample < trak->sizes_size ? trak->sizes[sample] : 0;
+}
 
-#if 0
-    if (trak->chunks_size <= 0)
-    {
-	mp_msg(MSGT_DEMUX, MSGL_WARN, "No chunk offset table, trying to build one!\n");
+static void durmap_next(mov_track_t* trak){
+    mov_cursor_t* c = &trak->cursor;
+    mov_durmap_t* d = &trak->durmap[c->durmap++];
+    c->dur_sample += d->num;
+    c->dur_pts += (int64_t)d->num * d->dur;
+}
+
+static void durmap_prev(mov_track_t* trak){
+    mov_cursor_t* c = &trak->cursor;
+    mov_durmap_t* d = &trak->durmap[--c->durmap];
+    c->dur_sample -= d->num;
+    c->dur_pts -= (int64_t)d->num * d->dur;
+}
 
-	trak->chunks_size = trak->samples_size; /* XXX: FIXME ! */
-	// audit: this code will be vulnerable if it is reenabled (currently #if 0)
-	trak->chunks = realloc(trak->chunks, sizeof(mov_chunk_t)*trak->chunks_size);
+/// pts of a sample in track timescale units
+static int64_t mov_sample_pts(mov_track_t* trak, int sample){
+    mov_cursor_t* c = &trak->cursor;
+    while (c->durmap < trak->durmap_size &&
+           sample >= c->dur_sample + trak->durmap[c->durmap].num)
+        durmap_next(trak);
+    while (c->durmap > 0 && sample < c->dur_sample)
+        durmap_prev(trak);
+    if (c->durmap == trak->durmap_size)
+        return c->dur_pts;
+    return c->dur_pts + (sample - c->dur_sample) * trak->durmap[c->durmap].dur;
+}
 
-	for (i=0; i < trak->chunks_size; i++)
-	    trak->chunks[i].pos = -1;
+/// first sample with a pts not below pts, samples_size if there is none
+static int mov_pts_sample(mov_track_t* trak, int64_t pts){
+    mov_cursor_t* c = &trak->cursor;
+    mov_durmap_t* d;
+    int64_t sample;
+    while (c->durmap > 0 && c->dur_pts >= pts)
+        durmap_prev(trak);
+    // skip the entries whose last sample is still too early
+    while (c->durmap < trak->durmap_size &&
+           (!trak->durmap[c->durmap].num ||
+            c->dur_pts + (int64_t)(trak->durmap[c->durmap].num - 1) *
+                         trak->durmap[c->durmap].dur < pts))
+        durmap_next(trak);
+    d = &trak->durmap[c->durmap];
+    if (c->durmap == trak->durmap_size || pts <= c->dur_pts)
+        sample = c->dur_sample;
+    else
+        sample = c->dur_sample + (pts - c->dur_pts + d->dur - 1) / d->dur;
+    return FFMIN(sample, trak->samples_size);
+}
+
+static int chunkmap_chunks(mov_track_t* trak, int i){
+    unsigned int end = i + 1 < trak->chunkmap_size ? trak->chunkmap[i + 1].first
+                                                   : trak->chunks_size;
+    return end - trak->chunkmap[i].first;
+}
+
+static void chunkmap_next(mov_track_t* trak){
+    mov_cursor_t* c = &trak->cursor;
+    c->map_sample += (int64_t)chunkmap_chunks(trak, c->chunkmap) *
+                     trak->chunkmap[c->chunkmap].spc;
+    c->chunkmap++;
+}
+
+static void chunkmap_prev(mov_track_t* trak){
+    mov_cursor_t* c = &trak->cursor;
+    c->chunkmap--;
+    c->map_sample -= (int64_t)chunkmap_chunks(trak, c->chunkmap) *
+                     trak->chunkmap[c->chunkmap].spc;
+}
+
+/// move the cursor to the chunkmap entry that holds sample
+static void chunkmap_find_sample(mov_track_t* trak, int64_t sample){
+    mov_cursor_t* c = &trak->cursor;
+    while (c->chunkmap + 1 < trak->chunkmap_size &&
+           sample >= c->map_sample + (int64_t)chunkmap_chunks(trak, c->chunkmap) *
+                                     trak->chunkmap[c->chunkmap].spc)
+        chunkmap_next(trak);
+    while (c->chunkmap > 0 && sample < c->map_sample)
+        chunkmap_prev(trak);
+}
+
+/// number of samples in a chunk, *first is set to the first of them
+static int mov_chunk_samples(mov_track_t* trak, int chunk, int64_t* first){
+    mov_cursor_t* c = &trak->cursor;
+    mov_chunkmap_t* m;
+    *first = 0;
+    if (!trak->chunkmap_size)
+        return 0;
+    while (c->chunkmap + 1 < trak->chunkmap_size &&
+           chunk >= trak->chunkmap[c->chunkmap + 1].first)
+        chunkmap_next(trak);
+    while (c->chunkmap > 0 && chunk < trak->chunkmap[c->chunkmap].first)
+        chunkmap_prev(trak);
+    m = &trak->chunkmap[c->chunkmap];
+    *first = c->map_sample + (int64_t)(chunk - m->first) * m->spc;
+    return m->spc;
+}
+
+/// first chunk that does not start before sample, chunks_size if none
+static int mov_sample_chunk(mov_track_t* trak, int64_t sample){
+    mov_chunkmap_t* m;
+    int64_t off, chunk;
+    if (!trak->chunkmap_size)
+        return sample > 0 ? trak->chunks_size : 0;
+    chunkmap_find_sample(trak, sample);
+    m = &trak->chunkmap[trak->cursor.chunkmap];
+    off = sample - trak->cursor.map_sample;
+    if (off <= 0)
+        return m->first;
+    if (!m->spc)
+        return m->first + chunkmap_chunks(trak, trak->cursor.chunkmap);
+    chunk = m->first + (off + m->spc - 1) / m->spc;
+    return FFMIN(chunk, trak->chunks_size);
+}
+
+/// file position of a sample
+static off_t mov_sample_pos(mov_track_t* trak, int sample){
+    mov_cursor_t* c = &trak->cursor;
+    mov_chunkmap_t* m;
+    int64_t first, i;
+    int chunk;
+    if (sample < 0 || sample >= trak->samples_size)
+        return 0;
+    if (c->sample >= 0 && sample > c->sample && sample < c->chunk_end) {
+        // further on in the same chunk
+        for (i = c->sample; i < sample; i++)
+            c->pos += mov_sample_size(trak, i);
+        c->sample = sample;
+        return c->pos;
     }
-#endif
+    // every sample is in a chunk, so the entry has samples
+    chunkmap_find_sample(trak, sample);
+    m = &trak->chunkmap[c->chunkmap];
+    chunk = m->first + (sample - c->map_sample) / m->spc;
+    first = c->map_sample + (int64_t)(chunk - m->first) * m->spc;
+    c->chunk_end = first + m->spc;
+    c->pos = trak->chunks[chunk];
+    for (i = first; i < sample; i++)
+        c->pos += mov_sample_size(trak, i);
+    c->sample = sample;
+    return c->pos;
+}
+
+/// index of the first keyframe not before sample, keyframes_size if none
+static int mov_keyframe_index(mov_track_t* trak, unsigned int sample){
+    int lo = 0, hi = trak->keyframes_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (trak->keyframes[mid] < sample)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int compare_uint(const void* a, const void* b){
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void mov_build_index(mov_track_t* trak,int timescale){
+    int i,n;
+    unsigned int end;
+    int64_t s,d;
 
-    mp_msg(MSGT_DEMUX, MSGL_V, "MOV track #%d: %d chunks, %d samples\n",trak->id,trak->chunks_size,trak->samples_size);
     mp_msg(MSGT_DEMUX, MSGL_V, "pts=%d  scale=%d  time=%5.3f\n",trak->length,trak->timescale,(float)trak->length/(float)trak->timescale);
 
-    // process chunkmap:
-    i=trak->chunkmap_size;
-    while(i>0){
-	--i;
-	j=trak->chunkmap[i].first;
-	for(;j>=0 && j<last;j++){
-	    trak->chunks[j].desc=trak->chunkmap[i].sdid;
-	    trak->chunks[j].size=trak->chunkmap[i].spc;
+    // process chunkmap: a run ends where any later one starts, keep the
+    // runs that are left with chunks, in order and starting at chunk 0
+    n=trak->chunkmap_size;
+    end=trak->chunks_size;
+    for(i=trak->chunkmap_size-1;i>=0;i--){
+	if(trak->chunkmap[i].first<end){
+	    trak->chunkmap[--n]=trak->chunkmap[i];
+	    end=trak->chunkmap[i].first;
+	}
+    }
+    trak->chunkmap_size-=n;
+    memmove(trak->chunkmap,trak->chunkmap+n,trak->chunkmap_size*sizeof(mov_chunkmap_t));
+    if(trak->chunkmap_size && trak->chunkmap[0].first>0){
+	mov_chunkmap_t* m=realloc(trak->chunkmap,(trak->chunkmap_size+1)*sizeof(mov_chunkmap_t));
+	if(m){
+	    memmove(m+1,m,trak->chunkmap_size*sizeof(mov_chunkmap_t));
+	    m[0].first=0;
+	    m[0].spc=0; // chunks before the first run hold no samples
+	    m[0].sdid=m[1].sdid;
+	    trak->chunkmap=m;
+	    trak->chunkmap_size++;
 	}
-	last=FFMIN(trak->chunkmap[i].first, trak->chunks_size);
     }
 
-#if 0
-    for (i=0; i < trak->chunks_size; i++)
-    {
-	/* fixup position */
-	if (trak->chunks[i].pos == -1)
-	    if (i > 0)
-		trak->chunks[i].pos = trak->chunks[i-1].pos + trak->chunks[i-1].size;
-	    else
-		trak->chunks[i].pos = 0; /* FIXME: set initial pos */
-#endif
+    memset(&trak->cursor,0,sizeof(trak->cursor));
+    trak->cursor.sample=-1;
 
-    // calc pts of chunks:
     s=0;
-    for(j=0;j<trak->chunks_size;j++){
-        trak->chunks[j].sample=s;
-        s+=trak->chunks[j].size;
-    }
-    i = 0;
-    for (j = 0; j < trak->durmap_size; j++)
-      i += trak->durmap[j].num;
-    if (i != s) {
+    for(i=0;i<trak->chunkmap_size;i++)
+	s+=(int64_t)chunkmap_chunks(trak,i)*trak->chunkmap[i].spc;
+    d=0;
+    for(i=0;i<trak->durmap_size;i++)
+	d+=trak->durmap[i].num;
+    if (d != s)
       mp_msg(MSGT_DEMUX, MSGL_WARN,
-             "MOV: durmap and chunkmap sample count differ (%i vs %i)\n", i, s);
-      if (i > s) s = i;
-    }
+             "MOV: durmap and chunkmap sample count differ (%"PRId64" vs %"PRId64")\n", d, s);
+    s=FFMIN(s,INT_MAX);
 
-    // workaround for fixed-size video frames (dv and uncompressed)
-    if(!trak->samples_size && trak->type!=MOV_TRAK_AUDIO){
-	trak->samples=calloc(s, sizeof(mov_sample_t));
-	trak->samples_size=trak->samples ? s : 0;
-	for(i=0;i<trak->samples_size;i++)
-	    trak->samples[i].size=trak->samplesize;
+    mp_msg(MSGT_DEMUX, MSGL_V, "MOV track #%d: %d chunks, %d samples\n",trak->id,trak->chunks_size,(int)s);
+
+    if(!trak->sizes_size && trak->type!=MOV_TRAK_AUDIO){
+	// workaround for fixed-size video frames (dv and uncompressed)
+	trak->fixed_size=trak->samplesize;
 	trak->samplesize=0;
+	trak->samples_size=s;
+    } else if(trak->sizes_size){
+	if (trak->sizes_size < s)
+	  mp_msg(MSGT_DEMUX, MSGL_WARN,
+		 "MOV: durmap or chunkmap bigger than sample count (%i vs %i)\n",
+		 (int)s, trak->sizes_size);
+	trak->samples_size=s;
     }
 
     if(!trak->samples_size){
@@ -243,41 +408,11 @@ static void mov_build_index(mov_track_t* trak,int timescale){
 	return;
     }
 
-    if (trak->samples_size < s) {
-      mp_msg(MSGT_DEMUX, MSGL_WARN,
-             "MOV: durmap or chunkmap bigger than sample count (%i vs %i)\n",
-             s, trak->samples_size);
-      free(trak->samples);
-      trak->samples = calloc(s, sizeof(mov_sample_t));
-      trak->samples_size = trak->samples ? s : 0;
-    }
-
-    // calc pts:
-    s=0;
-    for(j=0;j<trak->durmap_size;j++){
-	for(i=0;i<trak->durmap[j].num;i++){
-	    if (s >= trak->samples_size)
-		break;
-	    trak->samples[s].pts=pts;
-	    ++s;
-	    pts+=trak->durmap[j].dur;
-	}
-    }
-
-    // calc sample offsets
-    s=0;
-    for(j=0;j<trak->chunks_size;j++){
-	off_t pos=trak->chunks[j].pos;
-	for(i=0;i<trak->chunks[j].size;i++){
-	    if (s >= trak->samples_size)
-		break;
-	    trak->samples[s].pos=pos;
-	    mp_msg(MSGT_DEMUX, MSGL_DBG3, "Sample %5d: pts=%8d  off=0x%08X  size=%d\n",s,
-		trak->samples[s].pts,
-		(int)trak->samples[s].pos,
-		trak->samples[s].size);
-	    pos+=trak->samples[s].size;
-	    ++s;
+    // seeking looks keyframes up by bisection
+    for(i=1;i<trak->keyframes_size;i++){
+	if(trak->keyframes[i]<trak->keyframes[i-1]){
+	    qsort(trak->keyframes,trak->keyframes_size,sizeof(unsigned int),compare_uint);
+	    break;
 	}
     }
 
@@ -287,7 +422,7 @@ static void mov_build_index(mov_track_t* trak,int timescale){
 	int e_pts=0;
 	for(i=0;i<trak->editlist_size;i++){
 	    mov_editlist_t* el=&trak->editlist[i];
-	    int sample=0;
+	    int sample;
 	    int pts=el->pos;
 	    el->start_frame=frame;
 	    if(pts<0){
@@ -295,17 +430,13 @@ static void mov_build_index(mov_track_t* trak,int timescale){
 		el->frames=0; continue;
 	    }
 	    // find start sample
-	    for(;sample<trak->samples_size;sample++){
-		if(pts<=trak->samples[sample].pts) break;
-	    }
+	    sample=mov_pts_sample(trak,pts);
 	    el->start_sample=sample;
-	    el->pts_offset=((long long)e_pts*(long long)trak->timescale)/(long long)timescale-trak->samples[sample].pts;
+	    el->pts_offset=((long long)e_pts*(long long)trak->timescale)/(long long)timescale-mov_sample_pts(trak,sample);
 	    pts+=((long long)el->dur*(long long)trak->timescale)/(long long)timescale;
 	    e_pts+=el->dur;
 	    // find end sample
-	    for(;sample<trak->samples_size;sample++){
-		if(pts<trak->samples[sample].pts) break;
-	    }
+	    sample=FFMAX(sample,mov_pts_sample(trak,(int64_t)pts+1));
 	    el->frames=sample-el->start_sample;
 	    frame+=el->frames;
 	    mp_msg(MSGT_DEMUX,MSGL_V,"EL#%d: pts=%d  1st_sample=%d  frames=%d (%5.3fs)  pts_offs=%d\n",i,
@@ -558,7 +689,7 @@ static void demux_close_mov(demuxer_t *demuxer) {
       free(track->tkdata);
       free(track->stdata);
       free(track->stream_header);
-      free(track->samples);
+      free(track->sizes);
       free(track->chunks);
       free(track->chunkmap);
       free(track->durmap);
@@ -1370,18 +1501,18 @@ static void lschunks(demuxer_t* demuxer,int level,off_t endpos,mov_track_t* trak
 
 		for (i=0; i<trak->samples_size; i++)
 		{
-		    char buf[trak->samples[i].size];
-		    stream_seek(demuxer->stream, trak->samples[i].pos);
+		    char buf[mov_sample_size(trak, i)];
+		    stream_seek(demuxer->stream, mov_sample_pos(trak, i));
 		    snprintf((char *)&name[0], 20, "samp%d", i);
 		    fd = open((char *)&name[0], O_CREAT|O_WRONLY);
-		    stream_read(demuxer->stream, &buf[0], trak->samples[i].size);
-		    write(fd, &buf[0], trak->samples[i].size);
+		    stream_read(demuxer->stream, &buf[0], mov_sample_size(trak, i));
+		    write(fd, &buf[0], mov_sample_size(trak, i));
 		    close(fd);
 		 }
 		for (i=0; i<trak->chunks_size; i++)
 		{
 		    char buf[trak->length];
-		    stream_seek(demuxer->stream, trak->chunks[i].pos);
+		    stream_seek(demuxer->stream, trak->chunks[i]);
 		    snprintf((char *)&name[0], 20, "chunk%d", i);
 		    fd = open((char *)&name[0], O_CREAT|O_WRONLY);
 		    stream_read(demuxer->stream, &buf[0], trak->length);
@@ -1393,7 +1524,7 @@ static void lschunks(demuxer_t* demuxer,int level,off_t endpos,mov_track_t* trak
 		    char *buf;
 
 		    buf = malloc(trak->samplesize);
-		    stream_seek(demuxer->stream, trak->chunks[0].pos);
+		    stream_seek(demuxer->stream, trak->chunks[0]);
 		    snprintf((char *)&name[0], 20, "trak%d", trak->id);
 		    fd = open((char *)&name[0], O_CREAT|O_WRONLY);
 		    stream_read(demuxer->stream, buf, trak->samplesize);
@@ -1814,11 +1945,11 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
       trak->samplesize = ss;
       if (!ss) {
         // variable samplesize
-        free(trak->samples);
-        trak->samples = calloc(entries, sizeof(mov_sample_t));
-        trak->samples_size = trak->samples ? entries : 0;
-        for (i = 0; i < trak->samples_size; i++)
-          trak->samples[i].size = stream_read_dword(demuxer->stream);
+        free(trak->sizes);
+        trak->sizes = calloc(entries, sizeof(unsigned int));
+        trak->sizes_size = trak->sizes ? entries : 0;
+        for (i = 0; i < trak->sizes_size; i++)
+          trak->sizes[i] = stream_read_dword(demuxer->stream);
       }
       break;
     }
@@ -1832,12 +1963,12 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
       // extend array if needed:
       if (len > trak->chunks_size) {
         free(trak->chunks);
-        trak->chunks = calloc(len, sizeof(mov_chunk_t));
+        trak->chunks = calloc(len, sizeof(off_t));
         trak->chunks_size = trak->chunks ? len : 0;
       }
       // read elements:
       for(i = 0; i < trak->chunks_size; i++)
-        trak->chunks[i].pos = stream_read_dword(demuxer->stream);
+        trak->chunks[i] = stream_read_dword(demuxer->stream);
       break;
     }
     case MOV_FOURCC('c','o','6','4'): {
@@ -1850,7 +1981,7 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
       // extend array if needed:
       if (len > trak->chunks_size) {
         free(trak->chunks);
-        trak->chunks = calloc(len, sizeof(mov_chunk_t));
+        trak->chunks = calloc(len, sizeof(off_t));
         trak->chunks_size = trak->chunks ? len : 0;
       }
       // read elements:
@@ -1858,9 +1989,9 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
 #ifndef	_LARGEFILE_SOURCE
         if (stream_read_dword(demuxer->stream) != 0)
           mp_msg(MSGT_DEMUX, MSGL_WARN, "Chunk %d has got 64bit address, but you've MPlayer compiled without LARGEFILE support!\n", i);
-        trak->chunks[i].pos = stream_read_dword(demuxer->stream);
+        trak->chunks[i] = stream_read_dword(demuxer->stream);
 #else
-        trak->chunks[i].pos = stream_read_qword(demuxer->stream);
+        trak->chunks[i] = stream_read_qword(demuxer->stream);
 #endif
       }
       break;
@@ -2035,9 +2166,9 @@ static demuxer_t* mov_read_header(demuxer_t* demuxer){
 		mp_msg(MSGT_DEMUX, MSGL_INFO, "MOV: Track #%d: Extracting %d data chunks to files\n",t_no,trak->samples_size);
 		for (i=0; i<trak->samples_size; i++)
 		{
-		    int len=trak->samples[i].size;
+		    int len=mov_sample_size(trak, i);
 		    char buf[len];
-		    stream_seek(demuxer->stream, trak->samples[i].pos);
+		    stream_seek(demuxer->stream, mov_sample_pos(trak, i));
 		    snprintf(name, 20, "t%02d-s%03d.%s", t_no,i,
 			(trak->media_handler==MOV_FOURCC('f','l','s','h')) ?
 			    "swf":"dump");
@@ -2116,6 +2247,8 @@ static int demux_mov_fill_buffer(demuxer_t *demuxer,demux_stream_t* ds){
     float pts;
     int x;
     off_t pos;
+    int64_t first;
+    int spc;
 
     if (ds->eof) return 0;
     trak = stream_track(priv, ds);
@@ -2124,19 +2257,20 @@ static int demux_mov_fill_buffer(demuxer_t *demuxer,demux_stream_t* ds){
 if(trak->samplesize){
     // read chunk:
     if(trak->pos>=trak->chunks_size) return 0; // EOF
-    stream_seek(demuxer->stream,trak->chunks[trak->pos].pos);
-    pts=(float)(trak->chunks[trak->pos].sample*trak->duration)/(float)trak->timescale;
+    spc=mov_chunk_samples(trak,trak->pos,&first);
+    stream_seek(demuxer->stream,trak->chunks[trak->pos]);
+    pts=(float)(first*trak->duration)/(float)trak->timescale;
     if(trak->samplesize!=1)
     {
 	mp_msg(MSGT_DEMUX, MSGL_DBG2, "WARNING! Samplesize(%d) != 1\n",
 	    trak->samplesize);
 	if((trak->fourcc != MOV_FOURCC('t','w','o','s')) && (trak->fourcc != MOV_FOURCC('s','o','w','t')))
-	    x=trak->chunks[trak->pos].size*trak->samplesize;
+	    x=spc*trak->samplesize;
 	else
-	    x=trak->chunks[trak->pos].size;
+	    x=spc;
     }
     else
-	x=trak->chunks[trak->pos].size;
+	x=spc;
 //    printf("X = %d\n", x);
     /* the following stuff is audio related */
     if (trak->type == MOV_TRAK_AUDIO){
@@ -2155,9 +2289,9 @@ if(trak->samplesize){
 	    x*=trak->samplebytes;
 	}
       }
-      mp_msg(MSGT_DEMUX, MSGL_DBG2, "Audio sample %d bytes pts %5.3f\n",trak->chunks[trak->pos].size*trak->samplesize,pts);
+      mp_msg(MSGT_DEMUX, MSGL_DBG2, "Audio sample %d bytes pts %5.3f\n",spc*trak->samplesize,pts);
     } /* MOV_TRAK_AUDIO */
-    pos=trak->chunks[trak->pos].pos;
+    pos=trak->chunks[trak->pos];
 } else {
     int frame=trak->pos;
     // editlist support:
@@ -2174,16 +2308,16 @@ if(trak->samplesize){
 	frame-=trak->editlist[trak->editlist_pos].start_frame;
 	frame+=trak->editlist[trak->editlist_pos].start_sample;
 	// calc pts:
-	pts=(float)(trak->samples[frame].pts+
+	pts=(float)(mov_sample_pts(trak,frame)+
 	    trak->editlist[trak->editlist_pos].pts_offset)/(float)trak->timescale;
     } else {
 	if(frame>=trak->samples_size) return 0; // EOF
-	pts=(float)trak->samples[frame].pts/(float)trak->timescale;
+	pts=(float)mov_sample_pts(trak,frame)/(float)trak->timescale;
     }
     // read sample:
-    stream_seek(demuxer->stream,trak->samples[frame].pos);
-    x=trak->samples[frame].size;
-    pos=trak->samples[frame].pos;
+    pos=mov_sample_pos(trak,frame);
+    x=mov_sample_size(trak,frame);
+    stream_seek(demuxer->stream,pos);
 }
 if(trak->pos==0 && trak->stream_header_len>0){
     // we have to append the stream header...
@@ -2206,19 +2340,14 @@ if(trak->pos==0 && trak->stream_header_len>0){
     if (demuxer->sub->id >= 0 && demuxer->sub->id < priv->track_db)
       trak = priv->tracks[demuxer->sub->id];
     if (trak) {
-      int samplenr = 0;
-      while (samplenr < trak->samples_size) {
-        double subpts = (double)trak->samples[samplenr].pts / (double)trak->timescale;
-        if (subpts >= pts) break;
-        samplenr++;
-      }
-      samplenr--;
+      // the last subtitle that starts before pts
+      int samplenr = mov_pts_sample(trak, ceil((double)pts * trak->timescale)) - 1;
       if (samplenr < 0)
         vo_sub = NULL;
       else if (samplenr != priv->current_sub) {
-        off_t pos = trak->samples[samplenr].pos;
-        int len = trak->samples[samplenr].size;
-        double subpts = (double)trak->samples[samplenr].pts / (double)trak->timescale;
+        off_t pos = mov_sample_pos(trak, samplenr);
+        int len = mov_sample_size(trak, samplenr);
+        double subpts = (double)mov_sample_pts(trak, samplenr) / (double)trak->timescale;
         stream_seek(demuxer->stream, pos);
         ds_read_packet(demuxer->sub, demuxer->stream, len, subpts, pos, 0);
         priv->current_sub = samplenr;
@@ -2235,36 +2364,35 @@ static float mov_seek_track(mov_track_t* trak,float pts,int flags){
     if(flags&SEEK_FACTOR) pts*=trak->length; else pts*=(float)trak->timescale;
 
 if(trak->samplesize){
+    int64_t first;
     int sample=pts/trak->duration;
 //    printf("MOV track seek - chunk: %d  (pts: %5.3f  dur=%d)  \n",sample,pts,trak->duration);
-    if(!(flags&SEEK_ABSOLUTE)) sample+=trak->chunks[trak->pos].sample; // relative
-    trak->pos=0;
-    while(trak->pos<trak->chunks_size && trak->chunks[trak->pos].sample<sample) ++trak->pos;
+    if(!(flags&SEEK_ABSOLUTE) && trak->pos<trak->chunks_size){ // relative
+	mov_chunk_samples(trak,trak->pos,&first);
+	sample+=first;
+    }
+    trak->pos=mov_sample_chunk(trak,sample);
     if (trak->pos == trak->chunks_size) return -1;
-    pts=(float)(trak->chunks[trak->pos].sample*trak->duration)/(float)trak->timescale;
+    mov_chunk_samples(trak,trak->pos,&first);
+    pts=(float)(first*trak->duration)/(float)trak->timescale;
 } else {
     unsigned int ipts;
-    if(!(flags&SEEK_ABSOLUTE)) pts+=trak->samples[trak->pos].pts;
+    if(!(flags&SEEK_ABSOLUTE)) pts+=mov_sample_pts(trak,trak->pos);
     if(pts<0) pts=0;
     ipts=pts;
     //printf("MOV track seek - sample: %d  \n",ipts);
-    for(trak->pos=0;trak->pos<trak->samples_size;++trak->pos){
-	if(trak->samples[trak->pos].pts>=ipts) break; // found it!
-    }
+    trak->pos=mov_pts_sample(trak,ipts);
     if (trak->pos == trak->samples_size) return -1;
     if(trak->keyframes_size){
 	// find nearest keyframe
-	int i;
-	for(i=0;i<trak->keyframes_size;i++){
-	    if(trak->keyframes[i]>=trak->pos) break;
-	}
+	int i=mov_keyframe_index(trak,trak->pos);
 	if (i == trak->keyframes_size) return -1;
 	if(i>0 && (trak->keyframes[i]-trak->pos) > (trak->pos-trak->keyframes[i-1]))
 	  --i;
 	trak->pos=trak->keyframes[i];
 //	printf("nearest keyframe: %d  \n",trak->pos);
     }
-    pts=(float)trak->samples[trak->pos].pts/(float)trak->timescale;
+    pts=(float)mov_sample_pts(trak,trak->pos)/(float)trak->timescale;
 }
 
 //    printf("MOV track seek done:  %5.3f  \n",pts);
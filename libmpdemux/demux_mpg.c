@@ -36,6 +36,7 @@
 #include "stheader.h"
 #include "mp3_hdr.h"
 #include "demux_mpg.h"
+#include "demux_index.h"
 
 //#define MAX_PS_PACKETSIZE 2048
 #define MAX_PS_PACKETSIZE (224*1024)
@@ -59,6 +60,7 @@ typedef struct mpg_demuxer {
   unsigned int es_map[0x40];	//es map of stream types (associated to the pes id) from 0xb0 to 0xef
   int num_a_streams;
   int a_stream_ids[MAX_A_STREAMS];
+  demux_index_t *index;         // keyframes seen so far
 } mpg_demuxer_t;
 
 static int mpeg_pts_error=0;
@@ -150,6 +152,7 @@ static float read_first_mpeg_pts_at_position(demuxer_t* demuxer, off_t stream_po
 
   found_pts3 = found_pts2 = found_pts1 = mpg_d->last_pts;
   stream_seek(s, stream_pos);
+  demux_index_break(mpg_d->index);
 
   //We look for pts.
   //However, we do not stop at the first found one, as timestamps may reset
@@ -196,6 +199,8 @@ static demuxer_t* demux_mpg_open(demuxer_t* demuxer) {
     demuxer->priv = mpg_d;
     mpg_d->last_pts = -1.0;
     mpg_d->first_pts = -1.0;
+    mpg_d->index = demux_index_new();
+    demux_index_load(mpg_d->index, demuxer);
 
     //if seeking is allowed set has_valid_timestamps if appropriate
     if(demuxer->seekable
@@ -240,6 +245,7 @@ static demuxer_t* demux_mpg_open(demuxer_t* demuxer) {
       demuxer->audio->eof=0;
 
       stream_seek(s,pos);
+      demux_index_break(mpg_d->index);
       ds_fill_buffer(demuxer->video);
     } // if ( demuxer->seekable )
   } // if ( mpg_d )
@@ -248,6 +254,10 @@ static demuxer_t* demux_mpg_open(demuxer_t* demuxer) {
 
 static void demux_close_mpg(demuxer_t* demuxer) {
   mpg_demuxer_t* mpg_d = demuxer->priv;
+  if (mpg_d) {
+    demux_index_save(mpg_d->index, demuxer);
+    demux_index_free(mpg_d->index);
+  }
   free(mpg_d);
 }
 
@@ -606,6 +616,14 @@ static int demux_mpg_read_packet(demuxer_t *demux,int id){
     */
     if(ds == demux->video && stream_control(demux->stream, STREAM_CTRL_GET_CURRENT_TIME,(void *)&stream_pts)!=STREAM_UNSUPPORTED)
       dp->stream_pts = stream_pts;
+    if(ds == demux->video && priv && ds->sh &&
+       demux_index_is_keyframe(priv->index, ((sh_video_t *)ds->sh)->format, dp->buffer, len)) {
+      // a keyframe without pts cannot be indexed, and must not be skipped
+      if(set_pts)
+        demux_index_add(priv->index, demux->filepos, pts/90000.0);
+      else
+        demux_index_break(priv->index);
+    }
     ds_add_packet(ds,dp);
     if (demux->priv && set_pts) ((mpg_demuxer_t*)demux->priv)->last_pts = pts/90000.0f;
 //    if(ds==demux->sub) parse_dvdsub(ds->last->buffer,ds->last->len);
@@ -916,9 +934,12 @@ static void demux_seek_mpg(demuxer_t *demuxer, float rel_seek_secs,
 
     if(mpg_d)
       oldpts = mpg_d->last_pts;
-    newpts = (flags & SEEK_ABSOLUTE) ? 0.0 : oldpts;
   //================= seek in MPEG ==========================
-  //calculate the pts to seek to
+  //calculate the pts to seek to, absolute times count from the first pts
+    if(flags & SEEK_ABSOLUTE)
+      newpts = mpg_d && mpg_d->first_pts > 0 ? mpg_d->first_pts : 0.0;
+    else
+      newpts = oldpts;
     if(flags & SEEK_FACTOR) {
       if (mpg_d && mpg_d->first_to_final_pts_len > 0.0)
         newpts += mpg_d->first_to_final_pts_len * rel_seek_secs;
@@ -931,6 +952,10 @@ static void demux_seek_mpg(demuxer_t *demuxer, float rel_seek_secs,
     if(flags&SEEK_FACTOR){
 	// float seek 0..1
 	newpos+=(demuxer->movi_end-demuxer->movi_start)*rel_seek_secs;
+    } else if (mpg_d && demux_index_find(mpg_d->index, newpts, &newpos)) {
+        // played there before, the keyframe position is exact
+        mp_msg(MSGT_DEMUX, MSGL_V, "Seeking to keyframe at %"PRIu64" from the index\n", (uint64_t)newpos);
+        precision = 0;
     } else {
 	// time seek (secs)
         if (mpg_d && mpg_d->has_valid_timestamps) {
@@ -951,6 +976,8 @@ static void demux_seek_mpg(demuxer_t *demuxer, float rel_seek_secs,
 	}
 
         stream_seek(demuxer->stream,newpos);
+        if(mpg_d)
+          demux_index_break(mpg_d->index);
 
         // re-sync video:
         videobuf_code_len=0; // reset ES stream buffer
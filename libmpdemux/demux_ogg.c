@@ -538,10 +538,10 @@ static int demux_ogg_add_packet(demux_stream_t *ds, ogg_stream_t *os,
     memcpy(dp->buffer, data, pack->bytes - (data - pack->packet));
     dp->pts   = pts;
     dp->flags = flags;
-    ds_add_packet(ds, dp);
     mp_msg(MSGT_DEMUX, MSGL_DBG2,
            "New dp: %p  ds=%p  pts=%5.3f  len=%d  flag=%d  \n",
            dp, ds, pts, dp->len, flags);
+    ds_add_packet(ds, dp);
     return 1;
 }
 
@@ -0,0 +1,293 @@
+/*
+ * demux packet allocation
+ *
+ * Packets and their payload buffers are recycled through free lists
+ * instead of going back to malloc() for every packet. Payloads come in
+ * power of 2 size classes, so a buffer can be reused for any packet of
+ * its class and growing or shrinking a packet mostly needs no copy.
+ * Payloads too large for the biggest class are plain malloc()ed.
+ *
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "mp_msg.h"
+#include "demuxer.h"
+
+#define POOL_MIN_SHIFT    8         // smallest class: 256 bytes
+#define POOL_CLASSES      13        // largest class: 1 MB
+#define POOL_MAX_BYTES    (16 << 20) // payload memory kept for reuse
+#define POOL_MAX_PACKETS  4096      // packet structs kept for reuse
+
+#define CLASS_SIZE(c) (1 << ((c) + POOL_MIN_SHIFT))
+
+static struct {
+#if HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+  void *buffers[POOL_CLASSES];   // free buffers, linked through their start
+  demux_packet_t *packets;       // free packets, linked through next
+  int num_packets;
+  demux_packet_stats_t stats;
+} pool = {
+#if HAVE_PTHREADS
+  PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+#if HAVE_PTHREADS
+#define pool_lock()   pthread_mutex_lock(&pool.mutex)
+#define pool_unlock() pthread_mutex_unlock(&pool.mutex)
+#else
+#define pool_lock()
+#define pool_unlock()
+#endif
+
+/**
+ * Size class for a payload of len bytes plus padding, -1 if too large.
+ */
+static int size_class(int len)
+{
+  int c = 0;
+  len += MP_INPUT_BUFFER_PADDING_SIZE;
+  while (c < POOL_CLASSES && CLASS_SIZE(c) < len)
+    c++;
+  return c < POOL_CLASSES ? c : -1;
+}
+
+/**
+ * Allocate a payload buffer for len bytes plus padding, the padding is zeroed.
+ */
+static unsigned char *alloc_buffer(int len, int *class)
+{
+  unsigned char *buf = NULL;
+  int c = size_class(len);
+  if (c >= 0) {
+    pool_lock();
+    buf = pool.buffers[c];
+    if (buf) {
+      pool.buffers[c] = *(void **)buf;
+      pool.stats.cached_bytes -= CLASS_SIZE(c);
+      pool.stats.buffers_reused++;
+    }
+    pool.stats.buffers++;
+    pool.stats.live_bytes += CLASS_SIZE(c);
+    if (pool.stats.live_bytes > pool.stats.max_live_bytes)
+      pool.stats.max_live_bytes = pool.stats.live_bytes;
+    pool_unlock();
+    if (!buf && !(buf = malloc(CLASS_SIZE(c)))) {
+      pool_lock();
+      pool.stats.live_bytes -= CLASS_SIZE(c);
+      pool_unlock();
+    }
+  } else
+    buf = malloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
+  *class = c;
+  if (buf)
+    memset(buf + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+  return buf;
+}
+
+static void release_buffer(unsigned char *buf, int class)
+{
+  if (!buf)
+    return;
+  if (class < 0) {
+    free(buf);
+    return;
+  }
+  pool_lock();
+  pool.stats.live_bytes -= CLASS_SIZE(class);
+  if (pool.stats.cached_bytes + CLASS_SIZE(class) <= POOL_MAX_BYTES) {
+    *(void **)buf = pool.buffers[class];
+    pool.buffers[class] = buf;
+    pool.stats.cached_bytes += CLASS_SIZE(class);
+    buf = NULL;
+  }
+  pool_unlock();
+  free(buf);
+}
+
+static demux_packet_t *alloc_packet(void)
+{
+  demux_packet_t *dp;
+  pool_lock();
+  dp = pool.packets;
+  if (dp) {
+    pool.packets = dp->next;
+    pool.num_packets--;
+    pool.stats.packets_reused++;
+  }
+  pool.stats.packets++;
+  if (++pool.stats.live_packets > pool.stats.max_live_packets)
+    pool.stats.max_live_packets = pool.stats.live_packets;
+  pool_unlock();
+  if (!dp && !(dp = malloc(sizeof(demux_packet_t)))) {
+    pool_lock();
+    pool.stats.live_packets--;
+    pool_unlock();
+  }
+  return dp;
+}
+
+static void release_packet(demux_packet_t *dp)
+{
+  pool_lock();
+  pool.stats.live_packets--;
+  if (pool.num_packets < POOL_MAX_PACKETS) {
+    dp->next = pool.packets;
+    pool.packets = dp;
+    pool.num_packets++;
+    dp = NULL;
+  }
+  pool_unlock();
+  free(dp);
+}
+
+demux_packet_t *new_demux_packet(int len)
+{
+  demux_packet_t *dp = alloc_packet();
+  if (!dp)
+    return NULL;
+  dp->len = len;
+  dp->next = NULL;
+  dp->pts = MP_NOPTS_VALUE;
+  dp->endpts = MP_NOPTS_VALUE;
+  dp->stream_pts = MP_NOPTS_VALUE;
+  dp->pos = 0;
+  dp->flags = 0;
+  dp->refcount = 1;
+  dp->master = NULL;
+  dp->buffer = NULL;
+  dp->buffer_class = -1;
+  dp->borrowed = 0;
+  if (len > 0 && !(dp->buffer = alloc_buffer(len, &dp->buffer_class))) {
+    // do not even return a valid packet if allocation failed
+    release_packet(dp);
+    return NULL;
+  }
+  return dp;
+}
+
+/**
+ * Move the packet data to a new buffer of len bytes.
+ */
+static void replace_buffer(demux_packet_t *dp, int len)
+{
+  int class;
+  unsigned char *buf = alloc_buffer(len, &class);
+  if (buf && dp->buffer)
+    memcpy(buf, dp->buffer, len < dp->len ? len : dp->len);
+  // the borrowed memory belongs to someone else
+  if (!dp->borrowed)
+    release_buffer(dp->buffer, dp->buffer_class);
+  dp->buffer = buf;
+  dp->buffer_class = class;
+  dp->borrowed = 0;
+}
+
+void resize_demux_packet(demux_packet_t *dp, int len)
+{
+  if (len <= 0) {
+    if (!dp->borrowed)
+      release_buffer(dp->buffer, dp->buffer_class);
+    dp->buffer = NULL;
+    dp->buffer_class = -1;
+    dp->borrowed = 0;
+  } else if (dp->borrowed || !dp->buffer) {
+    replace_buffer(dp, len);
+  } else if (dp->buffer_class < 0) {
+    // plain malloc()ed, maybe not even by us
+    dp->buffer = realloc(dp->buffer, len + MP_INPUT_BUFFER_PADDING_SIZE);
+  } else {
+    int class = size_class(len);
+    // keep the buffer unless it is too small or far too large
+    if (class >= 0 && class <= dp->buffer_class &&
+        class >= dp->buffer_class - 1) {
+      pool_lock();
+      pool.stats.resized_in_place++;
+      pool_unlock();
+    } else
+      replace_buffer(dp, len);
+  }
+  if (!dp->buffer) {
+    dp->len = 0;
+    return;
+  }
+  dp->len = len;
+  memset(dp->buffer + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+}
+
+demux_packet_t *clone_demux_packet(demux_packet_t *pack)
+{
+  demux_packet_t *dp = alloc_packet();
+  if (!dp)
+    return NULL;
+  while (pack->master)
+    pack = pack->master; // find the master
+  memcpy(dp, pack, sizeof(demux_packet_t));
+  dp->next = NULL;
+  dp->refcount = 0;
+  dp->master = pack;
+  pack->refcount++;
+  return dp;
+}
+
+void free_demux_packet(demux_packet_t *dp)
+{
+  if (!dp->master) { // dp is a master packet
+    dp->refcount--;
+    if (!dp->refcount) {
+      if (!dp->borrowed)
+        release_buffer(dp->buffer, dp->buffer_class);
+      release_packet(dp);
+    }
+    return;
+  }
+  // dp is a clone:
+  free_demux_packet(dp->master);
+  release_packet(dp);
+}
+
+void demux_packet_get_stats(demux_packet_stats_t *st)
+{
+  pool_lock();
+  *st = pool.stats;
+  pool_unlock();
+}
+
+void demux_packet_print_stats(int level)
+{
+  demux_packet_stats_t st;
+  if (!mp_msg_test(MSGT_DEMUXER, level))
+    return;
+  demux_packet_get_stats(&st);
+  if (!st.packets)
+    return;
+  mp_msg(MSGT_DEMUXER, level,
+         "DEMUXER: %u packets (%u recycled), %u buffers (%u recycled), "
+         "%u resized in place, peak %d packets / %d kB, %d kB cached\n",
+         st.packets, st.packets_reused, st.buffers, st.buffers_reused,
+         st.resized_in_place, st.max_live_packets,
+         (int)(st.max_live_bytes >> 10), (int)(st.cached_bytes >> 10));
+}
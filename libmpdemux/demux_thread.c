@@ -0,0 +1,354 @@
+/*
+ * background demuxer thread
+ *
+ * With -demuxer-thread the demuxer's fill_buffer runs on a separate thread
+ * that keeps the packet queues of the audio and video demux_streams filled
+ * up to -demuxer-thread-buffer ahead of playback. ds_fill_buffer() only
+ * takes packets off the queues and waits when one runs empty.
+ * Everything else that touches the demuxer or its stream from the player
+ * side (seeking, flushing, most demux_control() calls) first pauses the
+ * thread, so the demuxers themselves still only ever run on one thread at
+ * a time.
+ *
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "mp_msg.h"
+#include "stream/stream.h"
+#include "demuxer.h"
+
+int demuxer_thread;
+/// read-ahead per stream in kB
+int demuxer_thread_buffer = 8192;
+
+#if HAVE_PTHREADS
+
+#define WAIT_TIMEOUT 100 // ms between interruption checks while waiting
+
+struct demux_thread {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;      // player -> thread: work to do
+  pthread_cond_t done;      // thread -> player: packets added, paused, ...
+  int quit;
+  int pause;                // nesting count of demux_thread_pause()
+  int busy;                 // thread is inside the demuxer
+  int idle;                 // thread waits for work
+  int eof;                  // read-ahead hit the end of the file
+  demux_stream_t *wanted;   // the player waits for a packet of this stream
+  int wanted_limit;         // ... and gives up as ds_fill_buffer() would
+  int wanted_done;          // no packet for wanted can be read
+  int serving;              // thread reads on behalf of wanted
+};
+
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, int ms,
+                         int *timeout)
+{
+  struct timeval now;
+  struct timespec ts;
+  gettimeofday(&now, NULL);
+  ts.tv_sec  = now.tv_sec + ms / 1000;
+  ts.tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * 1000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  *timeout = pthread_cond_timedwait(cond, mutex, &ts) == ETIMEDOUT;
+}
+
+static int ds_active(demux_stream_t *ds)
+{
+  return ds && ds->sh && ds->id != -2;
+}
+
+/**
+ * Pick the stream to read ahead for, NULL if the queues are full enough.
+ * The mutex must be locked.
+ */
+static demux_stream_t *readahead_stream(demuxer_t *demuxer)
+{
+  demux_stream_t *ds[2] = { demuxer->audio, demuxer->video };
+  demux_stream_t *best = NULL;
+  int limit = demuxer_thread_buffer * 1024;
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (!ds_active(ds[i]))
+      continue;
+    // stop as soon as any queue is full, a stream that never gets
+    // packets must not make us read the whole file
+    if (ds[i]->bytes >= limit || ds_queue_full(ds[i], 2))
+      return NULL;
+    if (!best || ds[i]->bytes < best->bytes)
+      best = ds[i];
+  }
+  return best;
+}
+
+static void *demux_thread_loop(void *arg)
+{
+  demuxer_t *demuxer = arg;
+  struct demux_thread *t = demuxer->thread;
+
+  pthread_mutex_lock(&t->mutex);
+  while (!t->quit) {
+    demux_stream_t *ds = NULL;
+    int wanted = 0;
+    int r;
+    if (!t->pause) {
+      if (t->wanted && !t->wanted->packs && !t->wanted_done) {
+        ds = t->wanted;
+        wanted = 1;
+        if (t->wanted_limit && ds->fill_count > 80) {
+          t->wanted_done = 1;
+          pthread_cond_broadcast(&t->done);
+          continue;
+        }
+      } else if (!t->eof)
+        ds = readahead_stream(demuxer);
+    }
+    if (!ds) {
+      t->idle = 1;
+      pthread_cond_wait(&t->wake, &t->mutex);
+      t->idle = 0;
+      continue;
+    }
+    t->busy = 1;
+    t->serving = wanted;
+    pthread_mutex_unlock(&t->mutex);
+    r = wanted ? ds_refill(ds) : demux_fill_buffer(demuxer, ds);
+    pthread_mutex_lock(&t->mutex);
+    t->busy = 0;
+    t->serving = 0;
+    if (!r) {
+      if (wanted)
+        t->wanted_done = 1;
+      else
+        t->eof = 1;
+    }
+    pthread_cond_broadcast(&t->done);
+  }
+  pthread_mutex_unlock(&t->mutex);
+  return NULL;
+}
+
+/**
+ * Start demuxing on a separate thread.
+ * Returns 0 if that is not possible for this demuxer.
+ */
+int demux_thread_start(demuxer_t *demuxer)
+{
+  struct demux_thread *t;
+  int r;
+  if (demuxer->thread)
+    return 1;
+  // the demuxers demuxer reads through other demuxers, dvdnav needs its
+  // events handled in sync with the playback
+  if (demuxer->desc->type == DEMUXER_TYPE_DEMUXERS ||
+      demuxer->stream->type == STREAMTYPE_DVDNAV ||
+      demuxer->audio->demuxer != demuxer ||
+      demuxer->video->demuxer != demuxer ||
+      demuxer->sub->demuxer   != demuxer) {
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Demuxer thread not supported for this file.\n");
+    return 0;
+  }
+  t = calloc(1, sizeof(*t));
+  if (!t)
+    return 0;
+  pthread_mutex_init(&t->mutex, NULL);
+  pthread_cond_init(&t->wake, NULL);
+  pthread_cond_init(&t->done, NULL);
+  demuxer->thread = t;
+  // t->thread must be set before the thread uses demux_thread_self()
+  pthread_mutex_lock(&t->mutex);
+  r = pthread_create(&t->thread, NULL, demux_thread_loop, demuxer);
+  pthread_mutex_unlock(&t->mutex);
+  if (r) {
+    demuxer->thread = NULL;
+    pthread_cond_destroy(&t->done);
+    pthread_cond_destroy(&t->wake);
+    pthread_mutex_destroy(&t->mutex);
+    free(t);
+    return 0;
+  }
+  mp_msg(MSGT_DEMUXER, MSGL_V, "Demuxing on a separate thread.\n");
+  return 1;
+}
+
+void demux_thread_stop(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer->thread;
+  if (!t)
+    return;
+  pthread_mutex_lock(&t->mutex);
+  t->quit = 1;
+  pthread_cond_signal(&t->wake);
+  pthread_mutex_unlock(&t->mutex);
+  // do not let a stalled read hold us up
+  stream_interrupt(demuxer->stream, 1);
+  pthread_join(t->thread, NULL);
+  stream_interrupt(demuxer->stream, 0);
+  demuxer->thread = NULL;
+  pthread_cond_destroy(&t->done);
+  pthread_cond_destroy(&t->wake);
+  pthread_mutex_destroy(&t->mutex);
+  free(t);
+}
+
+/**
+ * Whether this is called from the demuxer thread of demuxer.
+ */
+int demux_thread_self(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer ? demuxer->thread : NULL;
+  return t && pthread_equal(pthread_self(), t->thread);
+}
+
+/**
+ * Whether packets have to be waited for instead of read directly: there is
+ * a thread, it is not paused, and the caller is not the thread itself.
+ * Seek functions run with the thread paused and read packets themselves.
+ */
+int demux_thread_reads(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer ? demuxer->thread : NULL;
+  int r;
+  if (!t || demux_thread_self(demuxer))
+    return 0;
+  pthread_mutex_lock(&t->mutex);
+  r = !t->pause;
+  pthread_mutex_unlock(&t->mutex);
+  return r;
+}
+
+/**
+ * Wait until the thread is out of the demuxer and keep it out of it until
+ * demux_thread_resume(). Calls nest, and do nothing on the thread itself.
+ */
+void demux_thread_pause(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer ? demuxer->thread : NULL;
+  if (!t || demux_thread_self(demuxer))
+    return;
+  pthread_mutex_lock(&t->mutex);
+  if (!t->pause++) {
+    while (t->busy) {
+      int timeout;
+      cond_wait_ms(&t->done, &t->mutex, WAIT_TIMEOUT, &timeout);
+      // make a stalled stream read give up, like it would without thread
+      if (timeout && t->busy && stream_check_interrupt(0))
+        stream_interrupt(demuxer->stream, 1);
+    }
+    stream_interrupt(demuxer->stream, 0);
+  }
+  pthread_mutex_unlock(&t->mutex);
+}
+
+/**
+ * Let the thread continue, the file may be read to its end again.
+ */
+void demux_thread_resume(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer ? demuxer->thread : NULL;
+  if (!t || demux_thread_self(demuxer))
+    return;
+  pthread_mutex_lock(&t->mutex);
+  if (!--t->pause) {
+    t->eof = 0;
+    pthread_cond_signal(&t->wake);
+  }
+  pthread_mutex_unlock(&t->mutex);
+}
+
+void demux_thread_lock(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer ? demuxer->thread : NULL;
+  if (t)
+    pthread_mutex_lock(&t->mutex);
+}
+
+/**
+ * Unlock, and wake up the thread if it waits for room in the queues.
+ */
+void demux_thread_unlock(demuxer_t *demuxer)
+{
+  struct demux_thread *t = demuxer ? demuxer->thread : NULL;
+  if (!t)
+    return;
+  if (t->idle && !t->eof)
+    pthread_cond_signal(&t->wake);
+  pthread_mutex_unlock(&t->mutex);
+}
+
+/**
+ * Wait for the thread to queue a packet for ds.
+ * If limit is set, give up under the same conditions as ds_fill_buffer().
+ * Returns 0 if no packet can be read for ds.
+ */
+int demux_thread_wait(demux_stream_t *ds, int limit)
+{
+  struct demux_thread *t = ds->demuxer->thread;
+  int interrupted = 0;
+  int ret;
+  pthread_mutex_lock(&t->mutex);
+  t->wanted = ds;
+  t->wanted_limit = limit;
+  t->wanted_done = 0;
+  pthread_cond_signal(&t->wake);
+  // ds_refill() also updates ds->fill_count, let it finish in any case
+  while (t->serving || (!ds->packs && !t->wanted_done && !interrupted)) {
+    int timeout;
+    cond_wait_ms(&t->done, &t->mutex, WAIT_TIMEOUT, &timeout);
+    // nothing happened for a while, maybe the user wants to quit
+    if (timeout && !ds->packs && !interrupted && stream_check_interrupt(0)) {
+      interrupted = 1;
+      stream_interrupt(ds->demuxer->stream, 1);
+    }
+  }
+  if (interrupted)
+    stream_interrupt(ds->demuxer->stream, 0);
+  ret = ds->packs > 0;
+  t->wanted = NULL;
+  pthread_mutex_unlock(&t->mutex);
+  return ret;
+}
+
+#else /* HAVE_PTHREADS */
+
+int demux_thread_start(demuxer_t *demuxer)
+{
+  mp_msg(MSGT_DEMUXER, MSGL_WARN, "Demuxer thread not available, compiled without pthreads.\n");
+  return 0;
+}
+
+void demux_thread_stop(demuxer_t *demuxer) {}
+int demux_thread_self(demuxer_t *demuxer) { return 0; }
+int demux_thread_reads(demuxer_t *demuxer) { return 0; }
+void demux_thread_pause(demuxer_t *demuxer) {}
+void demux_thread_resume(demuxer_t *demuxer) {}
+void demux_thread_lock(demuxer_t *demuxer) {}
+void demux_thread_unlock(demuxer_t *demuxer) {}
+int demux_thread_wait(demux_stream_t *ds, int limit) { return 0; }
+
+#endif /* HAVE_PTHREADS */
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "config.h"
 #include "mp_msg.h"
@@ -39,6 +40,7 @@
 #include "ms_hdr.h"
 #include "mpeg_hdr.h"
 #include "demux_ts.h"
+#include "demux_index.h"
 
 #define TS_PH_PACKET_SIZE 192
 #define TS_FEC_PACKET_SIZE 204
@@ -229,6 +231,11 @@ typedef struct {
 	double last_pts;
 } TS_stream_info;
 
+typedef struct {
+	off_t pos;
+	double pts;	//unwrapped, in seconds
+} ts_seek_point_t;
+
 typedef struct {
 	MpegTSContext ts;
 	int last_pid;
@@ -244,6 +251,14 @@ typedef struct {
 	int last_sid;
 	char packet[TS_FEC_PACKET_SIZE];
 	TS_stream_info vstr, astr;
+	ts_seek_point_t *seek_points;	//sorted by pos, kept across seeks
+	int seek_points_cnt;
+	int seek_pid;			//pid whose PTS the seek points refer to
+	int64_t seek_base;		//PTS at movi_start, for wraparound handling
+	off_t seek_end;			//movi_end when the last point was probed
+	int seek_disabled;		//PTS discontinuities, seek by bitrate
+	demux_index_t *index;		//video keyframes seen so far
+	uint8_t drop_pid[NB_PID_MAX];	//packets of these pids are not even parsed
 } ts_priv_t;
 
 
@@ -298,6 +313,7 @@ static int IS_SUB(es_stream_type_t type)
 }
 
 static int ts_parse(demuxer_t *demuxer, ES_stream_t *es, unsigned char *packet, int probe);
+static void ts_reset_drop_pids(ts_priv_t *priv);
 
 static uint8_t get_packet_size(const unsigned char *buf, int size)
 {
@@ -1018,6 +1034,7 @@ static demuxer_t *demux_open_ts(demuxer_t * demuxer)
 
 	priv->keep_broken = ts_keep_broken;
 	priv->ts.packet_size = packet_size;
+	ts_reset_drop_pids(priv);
 
 
 	demuxer->priv = priv;
@@ -1102,6 +1119,9 @@ static demuxer_t *demux_open_ts(demuxer_t * demuxer)
 	for(i = 0; i < priv->pmt_cnt; i++)
 		priv->pmt[i].section.buffer_len = 0;
 
+	priv->index = demux_index_new();
+	demux_index_load(priv->index, demuxer);
+
 	demuxer->filepos = stream_tell(demuxer->stream);
 	return demuxer;
 }
@@ -1136,6 +1156,9 @@ static void demux_close_ts(demuxer_t * demuxer)
 				free_demux_packet(priv->fifo[i].pack);
 			priv->fifo[i].pack = NULL;
 		}
+		free(priv->seek_points);
+		demux_index_save(priv->index, demuxer);
+		demux_index_free(priv->index);
 		free(priv);
 	}
 	demuxer->priv=NULL;
@@ -1635,6 +1658,52 @@ static int pes_parse2(unsigned char *buf, uint16_t packet_len, ES_stream_t *es,
 
 
 
+/**
+ * Forget which pids are useless, after the PAT, a PMT or the selected
+ * streams changed.
+ */
+static void ts_reset_drop_pids(ts_priv_t *priv)
+{
+	memset(priv->drop_pid, 0, sizeof(priv->drop_pid));
+	//reserved and null packets
+	memset(&priv->drop_pid[2], 1, 14);
+	priv->drop_pid[8191] = 1;
+}
+
+#define TS_DROP_BATCH 256	//packets looked at per call of stream_peek_buffer()
+
+/**
+ * Skip the packets of pids we do not use, looking only at their sync byte
+ * and pid, and at as many packets at once as the stream has buffered.
+ * Stops in front of the first packet that needs parsing or when the sync is
+ * lost, ts_parse() does the rest.
+ */
+static void ts_drop_packets(demuxer_t *demuxer)
+{
+	ts_priv_t *priv = demuxer->priv;
+	stream_t *stream = demuxer->stream;
+	int size = priv->ts.packet_size;
+
+	for(;;)
+	{
+		int len = TS_DROP_BATCH * size, n = 0;
+		unsigned char *buf = stream_peek_buffer(stream, &len);
+
+		if(!buf)
+			return;
+		//the header of the last packet is enough, it may end beyond len
+		while(n + 3 <= len && buf[n] == 0x47 &&
+		      priv->drop_pid[((buf[n+1] & 0x1f) << 8) | buf[n+2]])
+			n += size;
+		if(!n)
+			return;
+		if(!stream_borrow(stream, n) && !stream_skip(stream, n))
+			return;
+		if(n < len)
+			return;
+	}
+}
+
 static int ts_sync(stream_t *stream)
 {
 	mp_msg(MSGT_DEMUX, MSGL_DBG3, "TS_SYNC \n");
@@ -2451,6 +2520,10 @@ static int parse_pmt(ts_priv_t * priv, uint16_t progid, uint16_t pid, int is_sta
 	if(! skip)
 		return 0;
 
+	//streams or pids of the program may change
+	if(!pmt->es_cnt || pmt->version_number != ((section->buffer[skip+5] >> 1) & 0x1f))
+		ts_reset_drop_pids(priv);
+
 	base = &(section->buffer[skip]);
 
 	mp_msg(MSGT_DEMUX, MSGL_V, "FILL_PMT(prog=%d), PMT_len: %d, IS_START: %d, TS_PID: %d, SIZE=%d, M=%d, ES_CNT=%d, IDX=%d, PMT_PTR=%p\n",
@@ -2712,23 +2785,36 @@ static int fill_packet(demuxer_t *demuxer, demux_stream_t *ds, demux_packet_t **
 	}
 	if(*dp)
 	{
+		ts_priv_t *priv = demuxer->priv;
+		//the packet may be gone as soon as it is queued
+		double pts = (*dp)->pts;
+
 		ret = *dp_offset;
 		resize_demux_packet(*dp, ret);	//shrinked to the right size
+		if(ds == demuxer->video && ds->sh &&
+		   demux_index_is_keyframe(priv->index, ((sh_video_t *)ds->sh)->format, (*dp)->buffer, ret))
+		{
+			//pos is just past the TS packet the PES header was in
+			if((*dp)->pos > 0 && pts > 0)
+				demux_index_add(priv->index, (*dp)->pos - priv->ts.packet_size, pts);
+			else	//a keyframe that cannot be indexed must not be skipped
+				demux_index_break(priv->index);
+		}
 		ds_add_packet(ds, *dp);
-		mp_msg(MSGT_DEMUX, MSGL_DBG2, "ADDED %d  bytes to %s fifo, PTS=%.3f\n", ret, (ds == demuxer->audio ? "audio" : (ds == demuxer->video ? "video" : "sub")), (*dp)->pts);
+		mp_msg(MSGT_DEMUX, MSGL_DBG2, "ADDED %d  bytes to %s fifo, PTS=%.3f\n", ret, (ds == demuxer->audio ? "audio" : (ds == demuxer->video ? "video" : "sub")), pts);
 		if(si)
 		{
-			float diff = (*dp)->pts - si->last_pts;
+			float diff = pts - si->last_pts;
 			float dur;
 
 			if(abs(diff) > 1) //1 second, there's a discontinuity
 			{
 				si->duration += si->last_pts - si->first_pts;
-				si->first_pts = si->last_pts = (*dp)->pts;
+				si->first_pts = si->last_pts = pts;
 			}
 			else
 			{
-				si->last_pts = (*dp)->pts;
+				si->last_pts = pts;
 			}
 			si->size += ret;
 			dur = si->duration + (si->last_pts - si->first_pts);
@@ -2778,7 +2864,7 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 	int len, cc, cc_ok, afc, retv = 0, is_video, is_audio, is_sub;
 	ts_priv_t * priv = (ts_priv_t*) demuxer->priv;
 	stream_t *stream = demuxer->stream;
-	char *p;
+	char *p, *borrowed;
 	demux_stream_t *ds = NULL;
 	demux_packet_t **dp = NULL;
 	int *dp_offset = 0, *buffer_size = 0;
@@ -2805,6 +2891,9 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 		junk = priv->ts.packet_size - TS_PACKET_SIZE;
 		buf_size = priv->ts.packet_size - junk;
 
+		if(! probe)
+			ts_drop_packets(demuxer);
+
 		if(stream_eof(stream))
 		{
 			if(! probe)
@@ -3019,9 +3108,13 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 		}
 
 
+		borrowed = NULL;
 		if(probe || !dp)	//dp is NULL for tables and sections
 		{
-			p = &packet[base];
+			// parse directly from the stream mapping when possible
+			p = borrowed = stream_borrow(stream, buf_size);
+			if(!p)
+				p = &packet[base];
 		}
 		else	//feeding
 		{
@@ -3033,7 +3126,7 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 			p = &((*dp)->buffer[*dp_offset]);
 		}
 
-		len = stream_read(stream, p, buf_size);
+		len = borrowed ? buf_size : stream_read(stream, p, buf_size);
 		if(len < buf_size)
 		{
 			mp_msg(MSGT_DEMUX, MSGL_DBG2,  "\r\nts_parse() couldn't read enough data: %d < %d\r\n", len, buf_size);
@@ -3043,7 +3136,11 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 
 		if(pid  == 0)
 		{
-			parse_pat(priv, is_start, p, buf_size);
+			int version = priv->pat.version_number, progs_cnt = priv->pat.progs_cnt;
+
+			if(parse_pat(priv, is_start, p, buf_size) == 1 &&
+			   (version != priv->pat.version_number || progs_cnt != priv->pat.progs_cnt))
+				ts_reset_drop_pids(priv);
 			continue;
 		}
 		else if((tss->type == SL_SECTION) && pmt)
@@ -3061,7 +3158,7 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 				if(pmt->es[k].mp4_es_id == mp4_es_id)
 				{
 					section = &(tss->section);
-					parse_sl_section(pmt, section, is_start, &packet[base], buf_size);
+					parse_sl_section(pmt, section, is_start, p, buf_size);
 				}
 			}
 			continue;
@@ -3073,7 +3170,7 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 			{
 				if(pid != demuxer->video->id && pid != demuxer->audio->id && pid != demuxer->sub->id)
 				{
-					parse_pmt(priv, progid, pid, is_start, &packet[base], buf_size);
+					parse_pmt(priv, progid, pid, is_start, p, buf_size);
 					continue;
 				}
 				else
@@ -3082,7 +3179,13 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 		}
 
 		if(!probe && !dp)
+		{
+			//no table, and neither a stream we use nor one still to add
+			if(!is_sub && pid != prog_pcr_pid(priv, priv->prog) &&
+			   (priv->ts.streams[pid].sh || !(is_video || is_audio)))
+				priv->drop_pid[pid] = 1;
 			continue;
+		}
 
 		if(is_start)
 		{
@@ -3245,6 +3348,266 @@ static void reset_fifos(demuxer_t *demuxer, int a, int v, int s)
 }
 
 
+#define TS_SEEK_MAX_POINTS	1024
+#define TS_SEEK_MAX_PROBES	24
+#define TS_SEEK_PRECISION	0.5		//seconds
+#define TS_SEEK_WINDOW		(1024*1024)	//max bytes scanned for one PTS
+#define TS_SEEK_CHUNK		(128*TS_FEC_PACKET_SIZE)
+#define TS_SEEK_MAX_JUMP	10.0		//seconds, larger PTS jumps are discontinuities
+#define TS_PTS_MASK		(((int64_t)1 << 33) - 1)
+
+/**
+ * The pid of the stream whose PTS drive the seeking, video if possible.
+ */
+static int ts_seek_pid(demuxer_t *demuxer, demux_stream_t **ds)
+{
+	ts_priv_t *priv = demuxer->priv;
+	demux_stream_t *d[2] = { demuxer->video, demuxer->audio };
+	int i, j;
+
+	for(j = 0; j < 2; j++)
+	{
+		if(d[j]->sh == NULL)
+			continue;
+		for(i = 0; i < NB_PID_MAX; i++)
+			if(priv->ts.streams[i].sh == d[j]->sh)
+			{
+				*ds = d[j];
+				return i;
+			}
+	}
+	return -1;
+}
+
+/**
+ * PTS in seconds, with a 33 bit wraparound between movi_start and pts undone.
+ */
+static double ts_unwrap_pts(ts_priv_t *priv, int64_t pts)
+{
+	int64_t diff = (pts - priv->seek_base) & TS_PTS_MASK;
+
+	if(diff > TS_PTS_MASK / 2)	//slightly before the start, e.g. B-frames
+		diff -= TS_PTS_MASK + 1;
+	return (priv->seek_base + diff) / 90000.0;
+}
+
+/**
+ * Find the first PES header of pid with a PTS between pos and end.
+ * Returns 1 and its packet position and PTS if there is one.
+ */
+static int ts_probe_pts(demuxer_t *demuxer, int pid, off_t pos, off_t end, off_t *found, int64_t *pts)
+{
+	ts_priv_t *priv = demuxer->priv;
+	stream_t *stream = demuxer->stream;
+	int size = priv->ts.packet_size;
+	unsigned char buf[TS_SEEK_CHUNK];
+
+	if(end > pos + TS_SEEK_WINDOW)
+		end = pos + TS_SEEK_WINDOW;
+	while(pos < end)
+	{
+		int i, len;
+
+		stream_seek(stream, pos);
+		len = stream_read(stream, buf, TS_SEEK_CHUNK);
+		if(len < 2 * size)
+			return 0;
+		//two packet starts in a row, a payload byte rarely fakes that
+		for(i = 0; i + size < len; i++)
+			if(buf[i] == 0x47 && buf[i + size] == 0x47)
+				break;
+		if(i + size >= len)
+		{
+			//no sync in the whole chunk, go on after what was scanned
+			pos += i;
+			continue;
+		}
+		for(; i + TS_PACKET_SIZE <= len && pos + i < end; i += size)
+		{
+			unsigned char *p = &buf[i], *pes;
+			int afc, off = 4;
+
+			if(p[0] != 0x47)
+				break;	//lost sync, find it again
+			//need payload_unit_start and no transport_error
+			if((p[1] & 0xc0) != 0x40 || (((p[1] & 0x1f) << 8) | p[2]) != pid)
+				continue;
+			afc = (p[3] >> 4) & 3;
+			if(!(afc & 1))
+				continue;
+			if(afc & 2)
+				off += 1 + p[4];
+			if(off + 14 > TS_PACKET_SIZE)
+				continue;
+			pes = &p[off];
+			if(pes[0] || pes[1] || pes[2] != 1 || (pes[6] & 0xc0) != 0x80 || !(pes[7] & 0x80))
+				continue;
+			*pts  = (int64_t)(pes[9] & 0x0E) << 29;
+			*pts |=  pes[10]        << 22;
+			*pts |= (pes[11] & 0xFE) << 14;
+			*pts |=  pes[12]        <<  7;
+			*pts |= (pes[13] & 0xFE) >>  1;
+			*found = pos + i;
+			return 1;
+		}
+		pos += i ? i : size;
+	}
+	return 0;
+}
+
+static void ts_add_seek_point(ts_priv_t *priv, off_t pos, double pts)
+{
+	ts_seek_point_t *sp;
+	int i;
+
+	if(priv->seek_points_cnt >= TS_SEEK_MAX_POINTS)
+		return;
+	if(priv->seek_points == NULL)
+	{
+		priv->seek_points = malloc(TS_SEEK_MAX_POINTS * sizeof(ts_seek_point_t));
+		if(priv->seek_points == NULL)
+			return;
+	}
+	sp = priv->seek_points;
+	for(i = priv->seek_points_cnt; i > 0 && sp[i-1].pos >= pos; i--)
+		;
+	if(i < priv->seek_points_cnt && sp[i].pos == pos)
+		return;
+	memmove(&sp[i+1], &sp[i], (priv->seek_points_cnt - i) * sizeof(ts_seek_point_t));
+	sp[i].pos = pos;
+	sp[i].pts = pts;
+	priv->seek_points_cnt++;
+}
+
+/**
+ * Probe a PTS at pos and remember it, returns 0 if there is none up to end.
+ */
+static int ts_probe_seek_point(demuxer_t *demuxer, int pid, off_t pos, off_t end, ts_seek_point_t *sp)
+{
+	ts_priv_t *priv = demuxer->priv;
+	int64_t pts;
+
+	if(!ts_probe_pts(demuxer, pid, pos, end, &sp->pos, &pts))
+		return 0;
+	sp->pts = ts_unwrap_pts(priv, pts);
+	ts_add_seek_point(priv, sp->pos, sp->pts);
+	mp_msg(MSGT_DEMUX, MSGL_DBG2, "TS_SEEK: pos %"PRIu64" pts %.3f\n", (uint64_t) sp->pos, sp->pts);
+	return 1;
+}
+
+/**
+ * Set up the seek points for pid with its first and last PTS in the file.
+ */
+static int ts_init_seek_points(demuxer_t *demuxer, int pid)
+{
+	ts_priv_t *priv = demuxer->priv;
+	ts_seek_point_t sp;
+	int64_t pts;
+	off_t pos;
+
+	if(priv->seek_pid != pid || !priv->seek_points_cnt)
+	{
+		priv->seek_points_cnt = 0;
+		priv->seek_end = 0;
+		priv->seek_pid = pid;
+		priv->seek_disabled = 0;
+		if(!ts_probe_pts(demuxer, pid, demuxer->movi_start, demuxer->movi_end, &pos, &pts))
+			return 0;
+		priv->seek_base = pts;
+		ts_add_seek_point(priv, pos, ts_unwrap_pts(priv, pts));
+	}
+	//the file may still be growing
+	if(priv->seek_end != demuxer->movi_end)
+	{
+		pos = demuxer->movi_end - TS_SEEK_WINDOW;
+		if(pos < priv->seek_points[0].pos)
+			pos = priv->seek_points[0].pos;
+		if(ts_probe_seek_point(demuxer, pid, pos, demuxer->movi_end, &sp))
+		{
+			//new data, maybe without the discontinuity, try again
+			priv->seek_end = demuxer->movi_end;
+			priv->seek_disabled = 0;
+		}
+	}
+	return priv->seek_points_cnt > 0;
+}
+
+/**
+ * Find the position to seek to by bisecting the file on the PTS of the
+ * reference stream. The probed points are kept, later seeks start from the
+ * closest ones. Absolute seeks are relative to the first PTS in the file,
+ * relative ones to cur_pts.
+ * Returns 0 if the file can not be searched this way, newpos is only set
+ * on success.
+ */
+static int ts_seek_pts(demuxer_t *demuxer, int pid, double cur_pts, float rel_seek_secs, int flags, off_t *newpos)
+{
+	ts_priv_t *priv = demuxer->priv;
+	ts_seek_point_t *sp, found;
+	int i, lo, probes;
+	double target;
+	off_t seekpos;
+
+	if(!ts_init_seek_points(demuxer, pid) || priv->seek_disabled)
+		return 0;
+	if(flags & SEEK_ABSOLUTE)
+		target = priv->seek_points[0].pts;
+	else
+		target = ts_unwrap_pts(priv, llrint(cur_pts * 90000.0));
+	target += rel_seek_secs;
+	//seeking back past the start, fmod() would keep the sign
+	if(target < 0)
+		target = 0;
+
+	//played there before, the index knows the keyframe
+	if(demux_index_find(priv->index, fmod(target, (TS_PTS_MASK + 1) / 90000.0), &seekpos))
+	{
+		mp_msg(MSGT_DEMUX, MSGL_V, "TS_SEEK: target %.3f, keyframe at %"PRIu64" from the index\n", target, (uint64_t) seekpos);
+		*newpos = seekpos;
+		return 1;
+	}
+
+	for(probes = 0; ; probes++)
+	{
+		off_t range, pos;
+
+		sp = priv->seek_points;
+		lo = -1;
+		for(i = 0; i < priv->seek_points_cnt; i++)
+			if(sp[i].pts <= target)
+				lo = i;
+		if(lo < 0)	//before the first PTS
+		{
+			seekpos = demuxer->movi_start;
+			break;
+		}
+		seekpos = sp[lo].pos;
+		if(lo == priv->seek_points_cnt - 1 || probes == TS_SEEK_MAX_PROBES)
+			break;
+		range = sp[lo+1].pos - sp[lo].pos;
+		if(sp[lo+1].pts - sp[lo].pts <= TS_SEEK_PRECISION || range <= 2 * TS_SEEK_CHUNK)
+			break;
+		//interpolate, but make each probe cut off at least an eighth
+		pos = sp[lo].pos + (target - sp[lo].pts) / (sp[lo+1].pts - sp[lo].pts) * range;
+		if(pos < sp[lo].pos + range / 8)
+			pos = sp[lo].pos + range / 8;
+		if(pos > sp[lo+1].pos - range / 8)
+			pos = sp[lo+1].pos - range / 8;
+		if(!ts_probe_seek_point(demuxer, pid, pos, sp[lo+1].pos, &found))
+			break;
+		//timestamps jump, bisecting can not work on this file
+		if(found.pts < sp[lo].pts - TS_SEEK_MAX_JUMP || found.pts > sp[lo+1].pts + TS_SEEK_MAX_JUMP)
+		{
+			mp_msg(MSGT_DEMUX, MSGL_V, "TS_SEEK: PTS discontinuity at %"PRIu64", not seeking by PTS\n", (uint64_t) found.pos);
+			priv->seek_disabled = 1;
+			return 0;
+		}
+	}
+	mp_msg(MSGT_DEMUX, MSGL_V, "TS_SEEK: target %.3f, pos %"PRIu64" after %d probes\n", target, (uint64_t) seekpos, probes);
+	*newpos = seekpos;
+	return 1;
+}
+
 static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_delay, int flags)
 {
 	demux_stream_t *d_audio=demuxer->audio;
@@ -3252,13 +3615,26 @@ static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_d
 	sh_audio_t *sh_audio=d_audio->sh;
 	sh_video_t *sh_video=d_video->sh;
 	ts_priv_t * priv = (ts_priv_t*) demuxer->priv;
-	int i, video_stats;
+	demux_stream_t *d_ref = NULL;
+	int i, video_stats, pid = -1;
+	double cur_pts = 0;
 	off_t newpos;
 
 	//================= seek in MPEG-TS ==========================
 
+	if(!(flags & SEEK_FACTOR) &&
+	   (demuxer->stream->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK &&
+	   demuxer->movi_end > demuxer->movi_start)
+		pid = ts_seek_pid(demuxer, &d_ref);
+	//the current position must be known before flushing
+	if(pid >= 0)
+		cur_pts = d_ref->pts;
+	if(pid >= 0 && !(flags & SEEK_ABSOLUTE) && cur_pts <= 0)
+		pid = -1;
+
 	ts_dump_streams(demuxer->priv);
 	reset_fifos(demuxer, sh_audio != NULL, sh_video != NULL, demuxer->sub->id > 0);
+	demux_index_break(priv->index);
 
 	demux_flush(demuxer);
 
@@ -3277,7 +3653,7 @@ static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_d
 	newpos = (flags & SEEK_ABSOLUTE) ? demuxer->movi_start : demuxer->filepos;
 	if(flags & SEEK_FACTOR) // float seek 0..1
 		newpos+=(demuxer->movi_end-demuxer->movi_start)*rel_seek_secs;
-	else
+	else if(pid < 0 || !ts_seek_pts(demuxer, pid, cur_pts, rel_seek_secs, flags, &newpos))
 	{
 		// time seek (secs)
 		if(! video_stats) // unspecified or VBR
@@ -3440,6 +3816,7 @@ static int demux_ts_control(demuxer_t *demuxer, int cmd, void *arg)
 				ds->id = priv->ts.streams[i].id;
 				ds->sh = sh;
 				ds_free_packs(ds);
+				ts_reset_drop_pids(priv);
 				mp_msg(MSGT_DEMUX, MSGL_V, "\r\ndemux_ts, switched to audio pid %d, id: %d, sh: %p\r\n", i, ds->id, sh);
 			}
 
@@ -3511,6 +3888,7 @@ static int demux_ts_control(demuxer_t *demuxer, int cmd, void *arg)
 			}
 
 			priv->prog = prog->progid = pmt->progid;
+			ts_reset_drop_pids(priv);
 			return DEMUXER_CTRL_OK;
 		}
 
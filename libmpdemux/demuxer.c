@@ -18,6 +18,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 #include "help_mp.h"
 #include "m_config.h"
 #include "mpcommon.h"
+#include "osdep/timer.h"
 #include "codec-cfg.h"
 
 #include "libvo/fastmemcpy.h"
@@ -40,6 +42,7 @@
 #include "demuxer.h"
 #include "stheader.h"
 #include "mf.h"
+#include "mpeg_hdr.h"
 #include "demux_audio.h"
 
 #include "libaf/af_format.h"
@@ -64,6 +67,9 @@
 // just be removed again.
 #define PARSE_ON_ADD 0
 
+// pts steps larger than this (in seconds) are taken as discontinuities
+#define PTS_JUMP 10.0
+
 static void clear_parser(sh_common_t *sh);
 
 // Demuxer list
@@ -205,6 +211,8 @@ demux_stream_t *new_demuxer_stream(struct demuxer *demuxer, int id)
         .id = id,
         .demuxer = demuxer,
         .asf_seq = -1,
+        .queue_pts_in  = MP_NOPTS_VALUE,
+        .queue_pts_out = MP_NOPTS_VALUE,
     };
     return ds;
 }
@@ -410,6 +418,8 @@ void free_demuxer(demuxer_t *demuxer)
         return;
     mp_msg(MSGT_DEMUXER, MSGL_DBG2, "DEMUXER: freeing %s demuxer at %p\n",
            demuxer->desc->shortdesc, demuxer);
+    demux_thread_stop(demuxer);
+    demux_packet_print_stats(MSGL_V);
     if (demuxer->desc->close)
         demuxer->desc->close(demuxer);
     // Very ugly hack to make it behave like old implementation
@@ -458,6 +468,17 @@ void free_demuxer(demuxer_t *demuxer)
 static void ds_add_packet_internal(demux_stream_t *ds, demux_packet_t *dp)
 {
     // append packet to DS stream:
+    demux_thread_lock(ds->demuxer);
+    if (dp->pts != MP_NOPTS_VALUE) {
+        if (ds->queue_pts_in != MP_NOPTS_VALUE &&
+            fabs(dp->pts - ds->queue_pts_in) > PTS_JUMP) {
+            // measure the queue from here once the older packets are gone
+            ds->queue_pts_skip = ds->packs;
+            ds->queue_pts_out = dp->pts;
+        } else if (ds->queue_pts_out == MP_NOPTS_VALUE)
+            ds->queue_pts_out = dp->pts;
+        ds->queue_pts_in = dp->pts;
+    }
     ++ds->packs;
     ds->bytes += dp->len;
     if (ds->last) {
@@ -468,6 +489,7 @@ static void ds_add_packet_internal(demux_stream_t *ds, demux_packet_t *dp)
         // first packet in stream
         ds->first = ds->last = dp;
     }
+    demux_thread_unlock(ds->demuxer);
     mp_dbg(MSGT_DEMUXER, MSGL_DBG2,
            "DEMUX: Append packet to %s, len=%d  pts=%5.3f  pos=%u  [packs: A=%d V=%d]\n",
            (ds == ds->demuxer->audio) ? "d_audio" : "d_video", dp->len,
@@ -634,6 +656,31 @@ void ds_read_packet(demux_stream_t *ds, stream_t *stream, int len,
     ds_add_packet(ds, dp);
 }
 
+/**
+ * Same as ds_read_packet, but if possible the packet points directly into
+ * the stream's memory mapping instead of copying the data into it.
+ * Only to be used when neither the demuxer nor the decoder modify the
+ * packet data, note that the padding after it is not zeroed either.
+ */
+void ds_read_packet_mapped(demux_stream_t *ds, stream_t *stream, int len,
+                           double pts, off_t pos, int flags)
+{
+    demux_packet_t *dp;
+    // the padding must be readable, too
+    if (len <= 0 || !stream_peek(stream, len + MP_INPUT_BUFFER_PADDING_SIZE) ||
+        !(dp = new_demux_packet(0))) {
+        ds_read_packet(ds, stream, len, pts, pos, flags);
+        return;
+    }
+    dp->buffer = stream_borrow(stream, len);
+    dp->borrowed = 1;
+    dp->len = len;
+    dp->pts = pts;
+    dp->pos = pos;
+    dp->flags = flags;
+    ds_add_packet(ds, dp);
+}
+
 // return value:
 //     0 = EOF or no stream found or invalid type
 //     1 = successfully read a packet
@@ -644,6 +691,132 @@ int demux_fill_buffer(demuxer_t *demux, demux_stream_t *ds)
     return demux->desc->fill_buffer(demux, ds);
 }
 
+/**
+ * Duration of the packets queued in ds, -1 if unknown.
+ */
+static double ds_queue_secs(demux_stream_t *ds)
+{
+    if (ds->queue_pts_in == MP_NOPTS_VALUE ||
+        ds->queue_pts_out == MP_NOPTS_VALUE)
+        return -1;
+    if (!ds->packs)
+        return 0;
+    return ds->queue_pts_in > ds->queue_pts_out ?
+           ds->queue_pts_in - ds->queue_pts_out : 0;
+}
+
+/**
+ * Whether the queue of ds, with packs more packets of together bytes more
+ * bytes, has reached 1/div of its limits: the duration set with
+ * -demuxer-max-audio-secs/-demuxer-max-video-secs (MAX_PACKS packets
+ * without), and MAX_PACK_BYTES or the -demuxer-max-kbytes budget shared
+ * by all streams of the demuxer.
+ */
+static int ds_queue_limit(demux_stream_t *ds, int div, int packs, int64_t bytes)
+{
+    demuxer_t *demux = ds->demuxer;
+    double max_secs = ds == demux->audio ? demux_max_audio_secs :
+                      ds == demux->video ? demux_max_video_secs : 0;
+    double secs = max_secs > 0 ? ds_queue_secs(ds) : -1;
+    if (demux_max_kbytes > 0) {
+        int64_t total = bytes +
+                        (demux->audio ? demux->audio->bytes : 0) +
+                        (int64_t)(demux->video ? demux->video->bytes : 0) +
+                        (demux->sub ? demux->sub->bytes : 0);
+        if (total * div >= demux_max_kbytes * 1024LL)
+            return 1;
+    } else if ((ds->bytes + bytes) * div >= MAX_PACK_BYTES)
+        return 1;
+    // the duration of packets not queued yet is not known, assume they
+    // are as long as the average queued one
+    if (secs > 0 && ds->packs > 0)
+        secs = secs * (ds->packs + packs) / ds->packs;
+    packs += ds->packs;
+    if (secs >= 0)
+        return secs * div >= max_secs || packs * div >= MAX_TIMED_PACKS;
+    return packs * div >= MAX_PACKS;
+}
+
+int ds_queue_full(demux_stream_t *ds, int div)
+{
+    return ds_queue_limit(ds, div, 0, 0);
+}
+
+/**
+ * Whether the queue of ds is full once another packet of len bytes is
+ * added. Lets a demuxer react before ds_refill() stops reading because
+ * of a full queue.
+ */
+int ds_queue_full_next(demux_stream_t *ds, unsigned len)
+{
+    return ds_queue_limit(ds, 1, 1, len);
+}
+
+/**
+ * Print why the queues of demux are full, return 0 if they are not.
+ */
+static int demux_queues_full(demuxer_t *demux)
+{
+    demux_stream_t *ds = demux->audio;
+    if (!ds || !ds_queue_full(ds, 1)) {
+        ds = demux->video;
+        if (!ds || !ds_queue_full(ds, 1))
+            return 0;
+    }
+    mp_msg(MSGT_DEMUXER, MSGL_ERR,
+           ds == demux->audio ? MSGTR_TooManyAudioInBuffer
+                              : MSGTR_TooManyVideoInBuffer,
+           ds->packs, ds->bytes);
+    if (ds_queue_secs(ds) >= 0)
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Queue length: %.3f s\n",
+               ds_queue_secs(ds));
+    mp_msg(MSGT_DEMUXER, MSGL_HINT, MSGTR_MaybeNI);
+    return 1;
+}
+
+/**
+ * Read more packets from the demuxer on behalf of ds, unless the queues
+ * of the other streams are already too long.
+ * Returns 0 on EOF or if the queues are full.
+ */
+int ds_refill(demux_stream_t *ds)
+{
+    demuxer_t *demux = ds->demuxer;
+    int apacks = demux->audio ? demux->audio->packs : 0;
+    int vpacks = demux->video ? demux->video->packs : 0;
+    int vbytes = demux->video ? demux->video->bytes : 0;
+    if (demux_queues_full(demux))
+        return 0;
+    if (!demux_fill_buffer(demux, ds)) {
+#if PARSE_ON_ADD && defined(CONFIG_FFMPEG)
+        uint8_t *parsed_start = NULL;
+        int parsed_len = 0;
+        ds_parse(ds->sh, &parsed_start, &parsed_len, MP_NOPTS_VALUE, 0);
+        if (parsed_len) {
+            demux_packet_t *dp2 = new_demux_packet(parsed_len);
+            if (!dp2) return 1;
+            dp2->pts = MP_NOPTS_VALUE;
+            memcpy(dp2->buffer, parsed_start, parsed_len);
+            ds_add_packet_internal(ds, dp2);
+            return 1;
+        }
+#endif
+        mp_dbg(MSGT_DEMUXER, MSGL_DBG2,
+               "ds_fill_buffer()->demux_fill_buffer() failed\n");
+        return 0; // EOF
+    }
+    if (demux->audio)
+        ds->fill_count += demux->audio->packs - apacks;
+    if (demux->video && demux->video->packs > vpacks &&
+        // Empty packets or "skip" packets in e.g. AVI can cause issues.
+        demux->video->bytes > vbytes + 100 &&
+        // when video needs parsing we will have lots of video packets
+        // in-between audio packets, so ignore them in that case.
+        demux->video->sh && !((sh_video_t *)demux->video->sh)->needs_parsing)
+        ds->fill_count++;
+    return 1;
+}
+
 // return value:
 //     0 = EOF
 //     1 = successful
@@ -668,10 +841,7 @@ int ds_fill_buffer(demux_stream_t *ds)
                    "ds_fill_buffer(unknown 0x%X) called\n", (unsigned int) ds);
     }
     while (1) {
-        int apacks = demux->audio ? demux->audio->packs : 0;
-        int abytes = demux->audio ? demux->audio->bytes : 0;
-        int vpacks = demux->video ? demux->video->packs : 0;
-        int vbytes = demux->video ? demux->video->bytes : 0;
+        demux_thread_lock(demux);
         if (ds->packs) {
             demux_packet_t *p = ds->first;
             // obviously not yet EOF after all
@@ -699,6 +869,10 @@ int ds_fill_buffer(demux_stream_t *ds)
                 ds->pts_bytes = 0;
             }
             ds->pts_bytes += p->len;    // !!!
+            if (ds->queue_pts_skip)
+                ds->queue_pts_skip--;
+            else if (p->pts != MP_NOPTS_VALUE)
+                ds->queue_pts_out = p->pts;
             if (p->stream_pts != MP_NOPTS_VALUE)
                 demux->stream_pts = p->stream_pts;
             ds->flags = p->flags;
@@ -709,8 +883,10 @@ int ds_fill_buffer(demux_stream_t *ds)
             if (!ds->first)
                 ds->last = NULL;
             --ds->packs;
+            demux_thread_unlock(demux);
             return 1;
         }
+        demux_thread_unlock(demux);
         // avoid buffering too far ahead in e.g. badly interleaved files
         // or when one stream is shorter, without breaking large audio
         // delay with well interleaved files.
@@ -722,45 +898,9 @@ int ds_fill_buffer(demux_stream_t *ds)
         // avoid printing the "too many ..." message over and over
         if (ds->eof)
             break;
-        if (apacks >= MAX_PACKS || abytes >= MAX_PACK_BYTES) {
-            mp_msg(MSGT_DEMUXER, MSGL_ERR, MSGTR_TooManyAudioInBuffer,
-                   apacks, abytes);
-            mp_msg(MSGT_DEMUXER, MSGL_HINT, MSGTR_MaybeNI);
-            break;
-        }
-        if (vpacks >= MAX_PACKS || vbytes >= MAX_PACK_BYTES) {
-            mp_msg(MSGT_DEMUXER, MSGL_ERR, MSGTR_TooManyVideoInBuffer,
-                   vpacks, vbytes);
-            mp_msg(MSGT_DEMUXER, MSGL_HINT, MSGTR_MaybeNI);
+        if (demux_thread_reads(demux) ? !demux_thread_wait(ds, 1)
+                                      : !ds_refill(ds))
             break;
-        }
-        if (!demux_fill_buffer(demux, ds)) {
-#if PARSE_ON_ADD && defined(CONFIG_FFMPEG)
-            uint8_t *parsed_start = NULL;
-            int parsed_len = 0;
-            ds_parse(ds->sh, &parsed_start, &parsed_len, MP_NOPTS_VALUE, 0);
-            if (parsed_len) {
-                demux_packet_t *dp2 = new_demux_packet(parsed_len);
-                if (!dp2) continue;
-                dp2->pts = MP_NOPTS_VALUE;
-                memcpy(dp2->buffer, parsed_start, parsed_len);
-                ds_add_packet_internal(ds, dp2);
-                continue;
-            }
-#endif
-            mp_dbg(MSGT_DEMUXER, MSGL_DBG2,
-                   "ds_fill_buffer()->demux_fill_buffer() failed\n");
-            break; // EOF
-        }
-        if (demux->audio)
-            ds->fill_count += demux->audio->packs - apacks;
-        if (demux->video && demux->video->packs > vpacks &&
-            // Empty packets or "skip" packets in e.g. AVI can cause issues.
-            demux->video->bytes > vbytes + 100 &&
-            // when video needs parsing we will have lots of video packets
-            // in-between audio packets, so ignore them in that case.
-            demux->video->sh && !((sh_video_t *)demux->video->sh)->needs_parsing)
-            ds->fill_count++;
     }
     ds->buffer_pos = ds->buffer_size = 0;
     ds->buffer = NULL;
@@ -793,6 +933,41 @@ int demux_read_data(demux_stream_t *ds, unsigned char *mem, int len)
     return bytes;
 }
 
+/**
+ * \brief feed buf into the shift register *head until it matches pat
+ * \return number of bytes used
+ */
+static int pattern_3_scan(const unsigned char *buf, int len, uint32_t *head,
+                          uint32_t pat)
+{
+    uint32_t h = *head;
+    int pos = 0;
+    if (pat == 0x100) {
+        // start codes that began in the previous buffer
+        while (pos < len && pos < 2 && h != pat)
+            h = (h | buf[pos++]) << 8;
+        if (h != pat && len >= 3) {
+            const unsigned char *sc = mp_find_startcode(buf, buf + len);
+            if (sc < buf + len) {
+                pos = sc - buf + 3;
+                h = pat;
+            } else {
+                pos = len;
+                h = (uint32_t)buf[len - 3] << 24 | buf[len - 2] << 16 |
+                    buf[len - 1] << 8;
+            }
+        }
+    } else {
+        while (pos < len) {
+            h = (h | buf[pos++]) << 8;
+            if (h == pat)
+                break;
+        }
+    }
+    *head = h;
+    return pos;
+}
+
 /**
  * \brief read data until the given 3-byte pattern is encountered, up to maxlen
  * \param mem memory to read data into, may be NULL to discard data
@@ -804,24 +979,19 @@ int demux_read_data(demux_stream_t *ds, unsigned char *mem, int len)
 int demux_pattern_3(demux_stream_t *ds, unsigned char *mem, int maxlen,
                     int *read, uint32_t pattern)
 {
-    register uint32_t head = 0xffffff00;
-    register uint32_t pat = pattern & 0xffffff00;
+    uint32_t head = 0xffffff00;
+    uint32_t pat = pattern & 0xffffff00;
     int total_len = 0;
     do {
-        register unsigned char *ds_buf = &ds->buffer[ds->buffer_size];
         int len = ds->buffer_size - ds->buffer_pos;
-        register long pos = -len;
-        if (unlikely(pos >= 0)) { // buffer is empty
+        if (unlikely(len <= 0)) { // buffer is empty
             ds_fill_buffer(ds);
             continue;
         }
-        do {
-            head |= ds_buf[pos];
-            head <<= 8;
-        } while (++pos && head != pat);
-        len += pos;
+        // a pattern beyond maxlen would not be read
         if (total_len + len > maxlen)
             len = maxlen - total_len;
+        len = pattern_3_scan(&ds->buffer[ds->buffer_pos], len, &head, pat);
         len = demux_read_data(ds, mem ? &mem[total_len] : NULL, len);
         total_len += len;
     } while ((head != pat || total_len < 3) && total_len < maxlen && !ds->eof);
@@ -832,7 +1002,19 @@ int demux_pattern_3(demux_stream_t *ds, unsigned char *mem, int maxlen,
 
 void ds_free_packs(demux_stream_t *ds)
 {
-    demux_packet_t *dp = ds->first;
+    demux_packet_t *dp;
+    // when called by the demuxer on the demux thread, the player may still
+    // be using the current packet, so only drop the queue
+    int queue_only = demux_thread_self(ds->demuxer);
+    demux_thread_pause(ds->demuxer);
+    demux_thread_lock(ds->demuxer);
+    dp = ds->first;
+    ds->first = ds->last = NULL;
+    ds->packs = 0; // !!!!!
+    ds->bytes = 0;
+    ds->queue_pts_in = ds->queue_pts_out = MP_NOPTS_VALUE;
+    ds->queue_pts_skip = 0;
+    demux_thread_unlock(ds->demuxer);
     while (dp) {
         demux_packet_t *dn = dp->next;
         free_demux_packet(dp);
@@ -840,20 +1022,19 @@ void ds_free_packs(demux_stream_t *ds)
     }
     if (ds->asf_packet) {
         // free unfinished .asf fragments:
-        free(ds->asf_packet->buffer);
-        free(ds->asf_packet);
+        free_demux_packet(ds->asf_packet);
         ds->asf_packet = NULL;
     }
-    ds->first = ds->last = NULL;
-    ds->packs = 0; // !!!!!
-    ds->bytes = 0;
-    if (ds->current)
-        free_demux_packet(ds->current);
-    ds->current = NULL;
-    ds->buffer = NULL;
-    ds->buffer_pos = ds->buffer_size;
-    ds->pts = 0;
-    ds->pts_bytes = 0;
+    if (!queue_only) {
+        if (ds->current)
+            free_demux_packet(ds->current);
+        ds->current = NULL;
+        ds->buffer = NULL;
+        ds->buffer_pos = ds->buffer_size;
+        ds->pts = 0;
+        ds->pts_bytes = 0;
+    }
+    demux_thread_resume(ds->demuxer);
 }
 
 int ds_get_packet(demux_stream_t *ds, unsigned char **start)
@@ -936,20 +1117,13 @@ double ds_get_next_pts(demux_stream_t *ds)
     // if we have not read from the "current" packet, consider it
     // as the next, otherwise we never get the pts for the first packet.
     while (!ds->first && (!ds->current || ds->buffer_pos)) {
-        if (demux->audio->packs >= MAX_PACKS
-            || demux->audio->bytes >= MAX_PACK_BYTES) {
-            mp_msg(MSGT_DEMUXER, MSGL_ERR, MSGTR_TooManyAudioInBuffer,
-                   demux->audio->packs, demux->audio->bytes);
-            mp_msg(MSGT_DEMUXER, MSGL_HINT, MSGTR_MaybeNI);
-            return MP_NOPTS_VALUE;
+        if (demux_thread_reads(demux)) {
+            if (!demux_thread_wait(ds, 0))
+                return MP_NOPTS_VALUE;
+            continue;
         }
-        if (demux->video->packs >= MAX_PACKS
-            || demux->video->bytes >= MAX_PACK_BYTES) {
-            mp_msg(MSGT_DEMUXER, MSGL_ERR, MSGTR_TooManyVideoInBuffer,
-                   demux->video->packs, demux->video->bytes);
-            mp_msg(MSGT_DEMUXER, MSGL_HINT, MSGTR_MaybeNI);
+        if (demux_queues_full(demux))
             return MP_NOPTS_VALUE;
-        }
         if (!demux_fill_buffer(demux, ds))
             return MP_NOPTS_VALUE;
     }
@@ -1022,9 +1196,59 @@ int get_demuxer_type_from_name(char *demuxer_name, int *force)
 
 int extension_parsing = 1; // 0=off 1=mixed (used only for unstable formats)
 
+float demux_max_audio_secs; // 0: limit the queue to MAX_PACKS packets
+float demux_max_video_secs;
+int demux_max_kbytes;       // 0: limit each queue to MAX_PACK_BYTES
+int demux_probe_kbytes = 1024;
+
 int correct_pts = 0;
 int user_correct_pts = -1;
 
+static int last_detected_type; // demuxer type of the previous file
+static int probe_checks;       // check_file calls of the current open
+static unsigned int probe_time;
+
+static int demux_check_file(const demuxer_desc_t *desc, demuxer_t *demuxer)
+{
+    unsigned int t = GetTimer();
+    int fformat = desc->check_file(demuxer);
+    t = GetTimer() - t;
+    probe_checks++;
+    probe_time += t;
+    mp_msg(MSGT_DEMUXER, MSGL_DBG2, "demuxer: %s check took %u us%s\n",
+           desc->name, t, fformat ? ", matched" : "");
+    return fformat;
+}
+
+/**
+ * Order in which the demuxers with safe checks are probed: the one the
+ * file extension suggests and the one that detected the previous file go
+ * first, the others keep their order. Nothing is moved before
+ * lavf_preferred, it has to override the native demuxers listed after it.
+ */
+static void demux_probe_order(const demuxer_desc_t **order, char *filename)
+{
+    int ext_type = DEMUXER_TYPE_UNKNOWN;
+    int pinned = 0, n = 0, score, i;
+
+    if (filename && extension_parsing)
+        ext_type = demuxer_type_by_filename(filename);
+#ifdef CONFIG_FFMPEG
+    for (i = 0; demuxer_list[i]; i++)
+        if (demuxer_list[i] == &demuxer_desc_lavf_preferred)
+            pinned = i + 1;
+#endif
+    for (i = 0; i < pinned; i++)
+        order[n++] = demuxer_list[i];
+    for (score = 3; score >= 0; score--)
+        for (i = pinned; demuxer_list[i]; i++) {
+            int type = demuxer_list[i]->type;
+            if (2 * (type == ext_type) + (type == last_detected_type) == score)
+                order[n++] = demuxer_list[i];
+        }
+    order[n] = NULL;
+}
+
 /*
   NOTE : Several demuxers may be opened at the same time so
   demuxers should NEVER rely on an external var to enable them
@@ -1038,14 +1262,16 @@ int user_correct_pts = -1;
   (ex: tv,mf).
 */
 
-static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
-                                    int force, int audio_id, int video_id,
-                                    int dvdsub_id, char *filename)
+static demuxer_t *demux_open_stream_internal(stream_t *stream, int file_format,
+                                             int force, int audio_id,
+                                             int video_id, int dvdsub_id,
+                                             char *filename)
 {
     demuxer_t *demuxer = NULL;
 
     sh_video_t *sh_video = NULL;
 
+    const demuxer_desc_t *order[sizeof(demuxer_list) / sizeof(*demuxer_list)];
     const demuxer_desc_t *demuxer_desc;
     int fformat = 0;
     int i;
@@ -1056,7 +1282,7 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
             demuxer = new_demuxer(stream, demuxer_desc->type, audio_id,
                                   video_id, dvdsub_id, filename);
             if (demuxer_desc->check_file)
-                fformat = demuxer_desc->check_file(demuxer);
+                fformat = demux_check_file(demuxer_desc, demuxer);
             if (force || !demuxer_desc->check_file)
                 fformat = demuxer_desc->type;
             if (fformat != 0) {
@@ -1075,8 +1301,9 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
                 } else {
                     // Format changed after check, recurse
                     free_demuxer(demuxer);
-                    return demux_open_stream(stream, fformat, force, audio_id,
-                                             video_id, dvdsub_id, filename);
+                    return demux_open_stream_internal(stream, fformat, force,
+                                                      audio_id, video_id,
+                                                      dvdsub_id, filename);
                 }
             }
             // Check failed for forced demuxer, quit
@@ -1084,12 +1311,13 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
             return NULL;
         }
     }
+    demux_probe_order(order, filename);
     // Test demuxers with safe file checks
-    for (i = 0; (demuxer_desc = demuxer_list[i]); i++) {
+    for (i = 0; (demuxer_desc = order[i]); i++) {
         if (demuxer_desc->safe_check) {
             demuxer = new_demuxer(stream, demuxer_desc->type, audio_id,
                                   video_id, dvdsub_id, filename);
-            if ((fformat = demuxer_desc->check_file(demuxer)) != 0) {
+            if ((fformat = demux_check_file(demuxer_desc, demuxer)) != 0) {
                 if (fformat == demuxer_desc->type) {
                     demuxer_t *demux2 = demuxer;
                     mp_msg(MSGT_DEMUXER, MSGL_INFO,
@@ -1106,9 +1334,10 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
                         return demuxer; // handled in mplayer.c
                     // Format changed after check, recurse
                     free_demuxer(demuxer);
-                    demuxer = demux_open_stream(stream, fformat, force,
-                                                audio_id, video_id,
-                                                dvdsub_id, filename);
+                    demuxer = demux_open_stream_internal(stream, fformat,
+                                                         force, audio_id,
+                                                         video_id, dvdsub_id,
+                                                         filename);
                     if (demuxer)
                         return demuxer; // done!
                     file_format = DEMUXER_TYPE_UNKNOWN;
@@ -1128,8 +1357,9 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
         file_format = demuxer_type_by_filename(filename);
         if (file_format != DEMUXER_TYPE_UNKNOWN) {
             // we like recursion :)
-            demuxer = demux_open_stream(stream, file_format, force, audio_id,
-                                        video_id, dvdsub_id, filename);
+            demuxer = demux_open_stream_internal(stream, file_format, force,
+                                                 audio_id, video_id,
+                                                 dvdsub_id, filename);
             if (demuxer)
                 return demuxer; // done!
             file_format = DEMUXER_TYPE_UNKNOWN; // continue fuzzy guessing...
@@ -1137,12 +1367,14 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
                    "demuxer: continue fuzzy content-based format guessing...\n");
         }
     }
-    // Try detection for all other demuxers
+    // Try detection for all other demuxers, in the order of the list: the
+    // fuzzy checks rely on it (MPEG-TS/PS before the audio demuxers, lavf
+    // last)
     for (i = 0; (demuxer_desc = demuxer_list[i]); i++) {
         if (!demuxer_desc->safe_check && demuxer_desc->check_file) {
             demuxer = new_demuxer(stream, demuxer_desc->type, audio_id,
                                   video_id, dvdsub_id, filename);
-            if ((fformat = demuxer_desc->check_file(demuxer)) != 0) {
+            if ((fformat = demux_check_file(demuxer_desc, demuxer)) != 0) {
                 if (fformat == demuxer_desc->type) {
                     demuxer_t *demux2 = demuxer;
                     mp_msg(MSGT_DEMUXER, MSGL_INFO,
@@ -1159,9 +1391,10 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
                         return demuxer; // handled in mplayer.c
                     // Format changed after check, recurse
                     free_demuxer(demuxer);
-                    demuxer = demux_open_stream(stream, fformat, force,
-                                                audio_id, video_id,
-                                                dvdsub_id, filename);
+                    demuxer = demux_open_stream_internal(stream, fformat,
+                                                         force, audio_id,
+                                                         video_id, dvdsub_id,
+                                                         filename);
                     if (demuxer)
                         return demuxer; // done!
                     file_format = DEMUXER_TYPE_UNKNOWN;
@@ -1177,6 +1410,7 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
  dmx_open:
 
     demuxer->file_format = file_format;
+    last_detected_type = demuxer->desc->type;
 
     if ((sh_video = demuxer->video->sh) && sh_video->bih) {
         int biComp = le2me_32(sh_video->bih->biCompression);
@@ -1204,6 +1438,37 @@ static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
     return demuxer;
 }
 
+/**
+ * Detect and open the demuxer for a stream. The start of the stream is kept
+ * in memory meanwhile, so that the check_file functions of all the demuxers
+ * tried read it from the stream only once.
+ */
+static demuxer_t *demux_open_stream(stream_t *stream, int file_format,
+                                    int force, int audio_id, int video_id,
+                                    int dvdsub_id, char *filename)
+{
+    unsigned int start = GetTimer();
+    int probing = demux_probe_kbytes > 0 &&
+                  stream_probe_start(stream, demux_probe_kbytes * 1024);
+    demuxer_t *demuxer;
+
+    probe_checks = 0;
+    probe_time = 0;
+    demuxer = demux_open_stream_internal(stream, file_format, force, audio_id,
+                                         video_id, dvdsub_id, filename);
+    mp_msg(MSGT_DEMUXER, MSGL_V,
+           "demuxer: found %s with %d format checks taking %.1f ms, %.1f ms in total\n",
+           demuxer ? demuxer->desc->name : "none", probe_checks,
+           probe_time / 1000.0, (GetTimer() - start) / 1000.0);
+    if (probing) {
+        mp_msg(MSGT_DEMUXER, MSGL_V,
+               "demuxer: read %d kB for probing, %"PRId64" kB more served from memory\n",
+               stream->probe_len >> 10, stream->probe_hits >> 10);
+        stream_probe_end(stream);
+    }
+    return demuxer;
+}
+
 char *audio_stream = NULL;
 char *sub_stream = NULL;
 int audio_stream_cache = 0;
@@ -1343,6 +1608,7 @@ static void demux_resync(demuxer_t *demuxer)
 
 void demux_flush(demuxer_t *demuxer)
 {
+    demux_thread_pause(demuxer);
 #if PARSE_ON_ADD
     ds_clear_parser(demuxer->video);
     ds_clear_parser(demuxer->audio);
@@ -1351,6 +1617,7 @@ void demux_flush(demuxer_t *demuxer)
     ds_free_packs(demuxer->video);
     ds_free_packs(demuxer->audio);
     ds_free_packs(demuxer->sub);
+    demux_thread_resume(demuxer);
 }
 
 int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
@@ -1371,6 +1638,7 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
         return 0;
     }
 
+    demux_thread_pause(demuxer);
     demux_flush(demuxer);
 
     demuxer->stream->eof = 0;
@@ -1397,6 +1665,7 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
     if (stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_TIME, &pts) !=
         STREAM_UNSUPPORTED) {
         demux_resync(demuxer);
+        demux_thread_resume(demuxer);
         return 1;
     }
 
@@ -1405,6 +1674,7 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
         demuxer->desc->seek(demuxer, rel_seek_secs, audio_delay, flags);
 
     demux_resync(demuxer);
+    demux_thread_resume(demuxer);
 
     return 1;
 }
@@ -1474,11 +1744,21 @@ char *demux_info_get(demuxer_t *demuxer, const char *opt)
 
 int demux_control(demuxer_t *demuxer, int cmd, void *arg)
 {
-
-    if (demuxer->desc->control)
-        return demuxer->desc->control(demuxer, cmd, arg);
-
-    return DEMUXER_CTRL_NOTIMPL;
+    int ret;
+    // these are queried all the time and only read a few fields,
+    // do not make them wait for a slow read
+    int pause = cmd != DEMUXER_CTRL_GET_TIME_LENGTH &&
+                cmd != DEMUXER_CTRL_GET_PERCENT_POS;
+
+    if (!demuxer->desc->control)
+        return DEMUXER_CTRL_NOTIMPL;
+
+    if (pause)
+        demux_thread_pause(demuxer);
+    ret = demuxer->desc->control(demuxer, cmd, arg);
+    if (pause)
+        demux_thread_resume(demuxer);
+    return ret;
 }
 
 
@@ -1636,12 +1916,14 @@ int demuxer_seek_chapter(demuxer_t *demuxer, int chapter, int mode,
             chapter += current;
         }
 
+        demux_thread_pause(demuxer);
         demux_flush(demuxer);
 
         ris = stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_CHAPTER,
                              &chapter);
 
         demux_resync(demuxer);
+        demux_thread_resume(demuxer);
 
         // exit status may be ok, but main() doesn't have to seek itself
         // (because e.g. dvds depend on sectors, not on pts)
@@ -1808,14 +2090,16 @@ int demuxer_set_angle(demuxer_t *demuxer, int angle)
     if ((angles < 1) || (angle > angles))
         return -1;
 
+    demux_thread_pause(demuxer);
     demux_flush(demuxer);
 
     ris = stream_control(demuxer->stream, STREAM_CTRL_SET_ANGLE, &angle);
+    if (ris != STREAM_UNSUPPORTED)
+        demux_resync(demuxer);
+    demux_thread_resume(demuxer);
     if (ris == STREAM_UNSUPPORTED)
         return -1;
 
-    demux_resync(demuxer);
-
     return angle;
 }
 
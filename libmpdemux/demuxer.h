@@ -38,6 +38,8 @@
 
 #define MAX_PACKS 4096
 #define MAX_PACK_BYTES 0x2000000
+// packet limit of a queue that is limited by its duration
+#define MAX_TIMED_PACKS (16 * MAX_PACKS)
 
 #define DEMUXER_TYPE_UNKNOWN 0
 #define DEMUXER_TYPE_MPEG_ES 1
@@ -128,6 +130,8 @@ typedef struct demux_packet {
   int refcount;   //refcounter for the master packet, if 0, buffer can be free()d
   struct demux_packet* master; //pointer to the master packet if this one is a cloned one
   struct demux_packet* next;
+  int borrowed; // buffer points into memory owned by someone else (e.g. a stream mapping), never free() it
+  int buffer_class; // size class of a pooled buffer, -1 if buffer was malloc()ed; see demux_packet.c
 } demux_packet_t;
 
 typedef struct {
@@ -150,6 +154,9 @@ typedef struct {
   demux_packet_t *first;  // read to first buffer after the current buffer from here
   demux_packet_t *last;   // append new packets from input stream to here
   demux_packet_t *current;// needed for refcounting of the buffer
+  double queue_pts_in;    // pts of the last packet queued
+  double queue_pts_out;   // pts of the last packet taken off the queue
+  int queue_pts_skip;     // packets queued before a pts jump
   int id;                 // stream ID  (for multiple audio/video streams)
   struct demuxer *demuxer; // parent demuxer structure (stream handler)
 // ---- asf -----
@@ -274,6 +281,7 @@ typedef struct demuxer {
 
   void* priv;  // fileformat-dependent data
   char** info;
+  struct demux_thread *thread; // background demuxing, see demux_thread.c
 } demuxer_t;
 
 typedef struct {
@@ -281,70 +289,23 @@ typedef struct {
   int aid, vid, sid; //audio, video and subtitle id
 } demux_program_t;
 
-static inline demux_packet_t* new_demux_packet(int len){
-  demux_packet_t* dp=(demux_packet_t*)malloc(sizeof(demux_packet_t));
-  dp->len=len;
-  dp->next=NULL;
-  dp->pts=MP_NOPTS_VALUE;
-  dp->endpts=MP_NOPTS_VALUE;
-  dp->stream_pts = MP_NOPTS_VALUE;
-  dp->pos=0;
-  dp->flags=0;
-  dp->refcount=1;
-  dp->master=NULL;
-  dp->buffer=NULL;
-  if (len > 0 && (dp->buffer = (unsigned char *)malloc(len + MP_INPUT_BUFFER_PADDING_SIZE)))
-    memset(dp->buffer + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
-  else if (len) {
-    // do not even return a valid packet if allocation failed
-    free(dp);
-    return NULL;
-  }
-  return dp;
-}
-
-static inline void resize_demux_packet(demux_packet_t* dp, int len)
-{
-  if(len > 0)
-  {
-     dp->buffer=(unsigned char *)realloc(dp->buffer,len + MP_INPUT_BUFFER_PADDING_SIZE);
-  }
-  else
-  {
-     free(dp->buffer);
-     dp->buffer=NULL;
-  }
-  dp->len=len;
-  if (dp->buffer)
-     memset(dp->buffer + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
-  else
-     dp->len = 0;
-}
-
-static inline demux_packet_t* clone_demux_packet(demux_packet_t* pack){
-  demux_packet_t* dp=(demux_packet_t*)malloc(sizeof(demux_packet_t));
-  while(pack->master) pack=pack->master; // find the master
-  memcpy(dp,pack,sizeof(demux_packet_t));
-  dp->next=NULL;
-  dp->refcount=0;
-  dp->master=pack;
-  pack->refcount++;
-  return dp;
-}
-
-static inline void free_demux_packet(demux_packet_t* dp){
-  if (dp->master==NULL){  //dp is a master packet
-    dp->refcount--;
-    if (dp->refcount==0){
-      free(dp->buffer);
-      free(dp);
-    }
-    return;
-  }
-  // dp is a clone:
-  free_demux_packet(dp->master);
-  free(dp);
-}
+typedef struct {
+  unsigned packets;          // packets allocated
+  unsigned packets_reused;   // ... from the free list
+  unsigned buffers;          // pooled payload buffers allocated
+  unsigned buffers_reused;   // ... from the free lists
+  unsigned resized_in_place; // resizes that kept the buffer
+  int live_packets, max_live_packets;
+  int64_t live_bytes, max_live_bytes; // pooled payload memory in use
+  int64_t cached_bytes;      // payload memory kept for reuse
+} demux_packet_stats_t;
+
+demux_packet_t *new_demux_packet(int len);
+void resize_demux_packet(demux_packet_t *dp, int len);
+demux_packet_t *clone_demux_packet(demux_packet_t *pack);
+void free_demux_packet(demux_packet_t *dp);
+void demux_packet_get_stats(demux_packet_stats_t *st);
+void demux_packet_print_stats(int level);
 
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t)-1)
@@ -366,8 +327,12 @@ void free_demuxer(demuxer_t *demuxer);
 
 void ds_add_packet(demux_stream_t *ds,demux_packet_t* dp);
 void ds_read_packet(demux_stream_t *ds, stream_t *stream, int len, double pts, off_t pos, int flags);
+void ds_read_packet_mapped(demux_stream_t *ds, stream_t *stream, int len, double pts, off_t pos, int flags);
 
 int demux_fill_buffer(demuxer_t *demux,demux_stream_t *ds);
+int ds_queue_full(demux_stream_t *ds, int div);
+int ds_queue_full_next(demux_stream_t *ds, unsigned len);
+int ds_refill(demux_stream_t *ds);
 int ds_fill_buffer(demux_stream_t *ds);
 
 static inline off_t ds_tell(demux_stream_t *ds){
@@ -430,11 +395,30 @@ demuxer_t*  new_demuxers_demuxer(demuxer_t* vd, demuxer_t* ad, demuxer_t* sd);
 // AVI demuxer params:
 extern int index_mode;  // -1=untouched  0=don't use index  1=use (generate) index
 extern char *index_file_save, *index_file_load;
+extern char *index_cache_dir;
 extern int force_ni;
 extern int pts_from_bps;
 
 extern int extension_parsing;
 
+extern float demux_max_audio_secs;
+extern float demux_max_video_secs;
+extern int demux_max_kbytes;
+extern int demux_probe_kbytes;
+
+extern int demuxer_thread;
+extern int demuxer_thread_buffer;
+
+int demux_thread_start(demuxer_t *demuxer);
+void demux_thread_stop(demuxer_t *demuxer);
+int demux_thread_self(demuxer_t *demuxer);
+int demux_thread_reads(demuxer_t *demuxer);
+void demux_thread_pause(demuxer_t *demuxer);
+void demux_thread_resume(demuxer_t *demuxer);
+void demux_thread_lock(demuxer_t *demuxer);
+void demux_thread_unlock(demuxer_t *demuxer);
+int demux_thread_wait(demux_stream_t *ds, int limit);
+
 int demux_info_add(demuxer_t *demuxer, const char *opt, const char *param);
 char* demux_info_get(demuxer_t *demuxer, const char *opt);
 int demux_info_print(demuxer_t *demuxer);
@@ -23,12 +23,15 @@ extern int    mf_w;
 extern int    mf_h;
 extern double mf_fps;
 extern char * mf_type;
+extern int    mf_threads;
+extern int    mf_prefetch;
 
 typedef struct
 {
  int curr_frame;
  int nr_of_files;
  char ** names;
+ struct mf_prefetch * prefetch;
 } mf_t;
 
 mf_t* open_mf(char * filename);
@@ -27,6 +27,10 @@
 #include "mpeg_hdr.h"
 
 #include "mp_msg.h"
+#include "cpudetect.h"
+#if HAVE_SSE2
+#include "libavutil/x86/asm.h"
+#endif
 
 static float frameratecode2framerate[16] = {
   0,
@@ -366,35 +370,105 @@ static int h264_parse_vui(mp_mpeg_header_t * picture, unsigned char * buf, unsig
   return n;
 }
 
+static const uint8_t *find_zero_pair_c(const uint8_t *p, const uint8_t *end)
+{
+  // of two zero bytes in a row one is at an odd offset
+  for(p++; p < end; p += 2)
+    if(!*p) {
+      if(!p[-1])
+        return p - 1;
+      if(p + 1 < end && !p[1])
+        return p;
+    }
+  return end;
+}
+
+#if HAVE_SSE2
+static const uint8_t *find_zero_pair_sse2(const uint8_t *p, const uint8_t *end)
+{
+  // 16 bytes at a time, blocks without any zero byte are skipped in the
+  // asm loop, a block and the byte after it are needed to see all pairs
+  while(end - p >= 17) {
+    const uint8_t *limit = end - 16;
+    int mask, pairs, i;
+    __asm__ volatile(
+        "pxor      %%xmm0, %%xmm0 \n\t"
+        "1:                       \n\t"
+        "movdqu      (%0), %%xmm1 \n\t"
+        "pcmpeqb   %%xmm0, %%xmm1 \n\t"
+        "pmovmskb  %%xmm1, %1     \n\t"
+        "test         %1, %1      \n\t"
+        "jnz 2f                   \n\t"
+        "add         $16, %0      \n\t"
+        "cmp          %2, %0      \n\t"
+        "jb 1b                    \n\t"
+        "2:                       \n\t"
+        : "+r"(p), "=&r"(mask)
+        : "r"(limit)
+        : XMM_CLOBBERS("%xmm0", "%xmm1",) "cc"
+    );
+    if(!mask)
+      break;
+    pairs = mask & (mask >> 1 | (!p[16]) << 15);
+    if(pairs) {
+      for(i = 0; !(pairs & 1); i++)
+        pairs >>= 1;
+      return p + i;
+    }
+    p += 16;
+  }
+  return find_zero_pair_c(p, end);
+}
+#endif
+
+/**
+ * \brief find the first two zero bytes in a row
+ * \return pointer to the first of them, end if there are none
+ */
+static const uint8_t *find_zero_pair(const uint8_t *p, const uint8_t *end)
+{
+#if HAVE_SSE2
+  if(gCpuCaps.hasSSE2)
+    return find_zero_pair_sse2(p, end);
+#endif
+  return find_zero_pair_c(p, end);
+}
+
+const unsigned char *mp_find_startcode(const unsigned char *p, const unsigned char *end)
+{
+  while((p = find_zero_pair(p, end)) < end - 2) {
+    if(p[2] == 1)
+      return p;
+    p++;
+  }
+  return end;
+}
+
 static int mp_unescape03(uint8_t *dest, const uint8_t *buf, int len)
 {
-  int i, j, skip;
+  const uint8_t *p = buf, *end = buf + len, *q;
+  int j = 0;
 
   if(! dest)
     return 0;
 
-  j = i = skip = 0;
-  while(i <= len-3)
-  {
-    if(buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 3)
-    {
-      dest[j] = dest[j+1] = 0;
-      j += 2;
-      i += 3;
-      skip++;
-    }
-    else
-    {
-      dest[j] = buf[i];
-      j++;
-      i++;
+  // copy the runs between the 00 00 03 sequences, dropping the 03
+  while((q = find_zero_pair(p, end - 1)) < end - 2) {
+    if(q[2] == 3) {
+      memcpy(dest + j, p, q + 2 - p);
+      j += q + 2 - p;
+      p = q + 3;
+    } else {
+      q++;
+      memcpy(dest + j, p, q - p);
+      j += q - p;
+      p = q;
     }
   }
-  dest[j] = buf[len-2];
-  dest[j+1] = buf[len-1];
-  len -= skip;
+  memcpy(dest + j, p, end - p);
+  j += end - p;
 
-  return len;
+  return j;
 }
 
 int h264_parse_sps(mp_mpeg_header_t * picture, const unsigned char * inbuf, int len)
@@ -52,4 +52,10 @@ int mp_vc1_decode_sequence_header(mp_mpeg_header_t * picture, const unsigned cha
 
 unsigned char mp_getbits(const unsigned char *buffer, unsigned int from, unsigned char len);
 
+/**
+ * \brief find the next 00 00 01 start code prefix in [p, end)
+ * \return pointer to its first byte, end if there is none
+ */
+const unsigned char *mp_find_startcode(const unsigned char *p, const unsigned char *end);
+
 #endif /* MPLAYER_MPEG_HDR_H */
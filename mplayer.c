@@ -3731,6 +3731,9 @@ goto_enable_cache:
         }
 #endif
 
+        if (demuxer_thread)
+            demux_thread_start(mpctx->demuxer);
+
         while (!mpctx->eof) {
             float aq_sleep_time = 0;
 
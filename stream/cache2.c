@@ -20,6 +20,8 @@
 
 // Initial draft of my new cache system...
 // Note it runs in 2 processes (using fork()), but doesn't require locking!!
+// With pthreads, the filler runs as a thread instead and reader and filler
+// wake each other up through condition variables rather than polling.
 // TODO: seeking, data consistency checking
 
 #define READ_SLEEP_TIME 10
@@ -30,6 +32,17 @@
 #define FILL_USLEEP_TIME 50000
 #define PREFILL_SLEEP_TIME 200
 #define CONTROL_SLEEP_TIME 1
+// The buffer is split into blocks of about this size, each one holding
+// a contiguous byte range of the file, so that data from several
+// places of the file can be kept and reused after seeks.
+// Blocks are aligned to multiples of their size in the file, so that
+// they can be found through a hash of the file position.
+#define CACHE_BLOCK_SIZE (64 * 1024)
+// minimum number of blocks, small caches use smaller blocks instead
+#define CACHE_MIN_BLOCKS 16
+// Maximum time to block on a condition variable before checking for
+// user interrupts or refreshing the cached time information.
+#define COND_WAIT_TIME 100
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +51,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "libavutil/avutil.h"
 #include "libavutil/common.h"
@@ -52,7 +69,9 @@ static void ThreadProc( void *s );
 static void ThreadProc( void *s );
 #elif defined(PTHREAD_CACHE)
 #include <pthread.h>
+#include <sys/time.h>
 static void *ThreadProc(void *s);
+#define COND_CACHE 1
 #else
 #include <sys/wait.h>
 #define FORKED_CACHE 1
@@ -60,6 +79,9 @@ static void *ThreadProc(void *s);
 #ifndef FORKED_CACHE
 #define FORKED_CACHE 0
 #endif
+#ifndef COND_CACHE
+#define COND_CACHE 0
+#endif
 
 #include "mp_msg.h"
 #include "help_mp.h"
@@ -68,24 +90,62 @@ static void *ThreadProc(void *s);
 #include "cache2.h"
 #include "mp_global.h"
 
+typedef struct {
+  int64_t pos;        // file position of the first byte, -1 if unused
+  volatile int len;   // number of valid bytes, never crossing a multiple of block_size
+  unsigned last_use;  // value of lru_clock when last read or filled
+} cache_block_t;
+
+int stream_cache_disk_size = 0;
+char *stream_cache_disk_dir = NULL;
+int stream_cache_stats = 0;
+
 typedef struct {
   // constats:
   unsigned char *buffer;      // base pointer of the allocated buffer memory
   int64_t buffer_size; // size of the allocated buffer memory
   int sector_size; // size of a single sector (2048/2324)
+  cache_block_t *blocks; // num_blocks in memory followed by num_disk_blocks on disk
+  int num_blocks;
+  int num_disk_blocks;
+  int block_size;  // multiple of sector_size
+  int *index;      // hash of pos / block_size -> block, -1 if empty
+  int index_mask;
+  unsigned char *disk_buffer; // file backed memory for blocks evicted from buffer
+  int64_t disk_size;
   int64_t back_size;   // we should keep back_size amount of old bytes for backward seek
   int64_t fill_limit;  // we should fill buffer only if space>=fill_limit
   int64_t seek_limit;  // keep filling cache if distance is less that seek limit
 #if FORKED_CACHE
   pid_t ppid; // parent PID to detect killed parent
+#endif
+#if COND_CACHE
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t fill_cond; // reader -> filler: position changed or command pending
+  pthread_cond_t read_cond; // filler -> reader: new data or command finished
+  int fill_wakeup;          // set with fill_cond so a wakeup is never lost
+  volatile int fill_idle;   // filler is blocked on fill_cond
 #endif
   // filler's pointers:
   int eof;
-  int64_t min_filepos; // buffer contain only a part of the file, from min-max pos
-  int64_t max_filepos;
-  int64_t offset;      // filepos <-> bufferpos  offset value (filepos of the buffer's first byte)
+  int64_t run_start;   // [run_start, run_end) is known to be cached without gaps
+  int64_t run_end;
+  volatile int64_t fill_total; // bytes read from the stream so far
+  volatile int64_t fill_time;  // microseconds spent reading them
   // reader's pointers:
   int64_t read_filepos;
+  int cur_block;       // block the reader used last
+  unsigned lru_clock;
+  // reader's statistics, see cache_get_stats()
+  int64_t read_total;
+  unsigned underruns;
+  int64_t stall_time;  // microseconds spent waiting in underruns
+  unsigned seek_hits;
+  unsigned seek_misses;
+  int64_t refill_time; // microseconds spent waiting after seek misses
+  int seeking;
+  unsigned stats_time; // GetTimerMS() of the last periodic stats line
   // commands/locking:
 //  int seek_lock;   // 1 if we will seek/reset buffer, 2 if we are ready for cmd
 //  int fifo_flag;  // 1 if we should use FIFO to notice cache about buffer reads.
@@ -100,163 +160,499 @@ typedef struct {
   volatile double stream_time_pos;
 } cache_vars_t;
 
+#if COND_CACHE
+/**
+ * Wait on cond for at most ms milliseconds, s->mutex must be locked.
+ */
+static void cache_cond_wait(cache_vars_t *s, pthread_cond_t *cond, int ms)
+{
+  struct timeval now;
+  struct timespec timeout;
+  gettimeofday(&now, NULL);
+  timeout.tv_sec  = now.tv_sec + ms / 1000;
+  timeout.tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * 1000;
+  if (timeout.tv_nsec >= 1000000000) {
+    timeout.tv_sec++;
+    timeout.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(cond, &s->mutex, &timeout);
+}
+
+/**
+ * Wake up a reader waiting for data or for a command to finish.
+ */
+static void cache_signal_reader(cache_vars_t *s)
+{
+  pthread_mutex_lock(&s->mutex);
+  pthread_cond_broadcast(&s->read_cond);
+  pthread_mutex_unlock(&s->mutex);
+}
+#endif
+
 static void cache_wakeup(stream_t *s)
 {
 #if FORKED_CACHE
   // signal process to wake up immediately
   kill(s->cache_pid, SIGUSR1);
+#elif COND_CACHE
+  cache_vars_t *c = s->cache_data;
+  pthread_mutex_lock(&c->mutex);
+  c->fill_wakeup = 1;
+  pthread_cond_signal(&c->fill_cond);
+  pthread_mutex_unlock(&c->mutex);
 #endif
 }
 
+#if COND_CACHE
+#define cache_lock(s)   pthread_mutex_lock(&(s)->mutex)
+#define cache_unlock(s) pthread_mutex_unlock(&(s)->mutex)
+#else
+// Without a lock the blocks are mapped like the old ring buffer: slot n
+// always lives in block n % num_blocks, so the reader never needs the
+// hash index. The filler takes a block out of use before it checks the
+// reader position a last time, see cache_get_block(). The barrier orders
+// the reader's position update before its next lookup.
+#define cache_lock(s)   __sync_synchronize()
+#define cache_unlock(s)
+#endif
+
+#define BLOCK_SLOT(s, pos) ((pos) / (s)->block_size)
+
+static unsigned char *cache_block_data(cache_vars_t *s, int i)
+{
+  if (i >= s->num_blocks)
+    return s->disk_buffer + (int64_t)(i - s->num_blocks) * s->block_size;
+  return s->buffer + (int64_t)i * s->block_size;
+}
+
+static int cache_index_hash(cache_vars_t *s, int64_t slot)
+{
+  return (uint64_t)slot * 0x9E3779B97F4A7C15ULL >> 32 & s->index_mask;
+}
+
+/**
+ * \return index entry of the block for slot or the empty entry to put it
+ */
+static int cache_index_find(cache_vars_t *s, int64_t slot)
+{
+  int h = cache_index_hash(s, slot);
+  while (s->index[h] >= 0 && BLOCK_SLOT(s, s->blocks[s->index[h]].pos) != slot)
+    h = (h + 1) & s->index_mask;
+  return h;
+}
+
+static void cache_index_remove(cache_vars_t *s, int i)
+{
+  int h = cache_index_find(s, BLOCK_SLOT(s, s->blocks[i].pos));
+  int j = h;
+  s->index[h] = -1;
+  // move up entries that would not be found anymore
+  while (s->index[j = (j + 1) & s->index_mask] >= 0) {
+    int k = cache_index_hash(s, BLOCK_SLOT(s, s->blocks[s->index[j]].pos));
+    if ((j > h && (k <= h || k > j)) || (j < h && k <= h && k > j)) {
+      s->index[h] = s->index[j];
+      s->index[j] = -1;
+      h = j;
+    }
+  }
+}
+
+static void cache_drop_block(cache_vars_t *s, int i)
+{
+  if (s->blocks[i].pos < 0)
+    return;
+#if COND_CACHE
+  cache_index_remove(s, i);
+#endif
+  s->blocks[i].pos = -1;
+  s->blocks[i].len = 0;
+  s->run_start = s->run_end = 0;
+}
+
 static void cache_flush(cache_vars_t *s)
 {
-  s->offset= // FIXME!?
-  s->min_filepos=s->max_filepos=s->read_filepos; // drop cache content :(
+  int i;
+  for (i = 0; i < s->num_blocks + s->num_disk_blocks; i++) {
+    s->blocks[i].pos = -1;
+    s->blocks[i].len = 0;
+  }
+  for (i = 0; i <= s->index_mask; i++)
+    s->index[i] = -1;
+  s->run_start = s->run_end = 0;
+}
+
+/**
+ * \return index of the block in the same slot as file position pos or -1
+ */
+static int cache_slot_block(cache_vars_t *s, int64_t pos)
+{
+#if COND_CACHE
+  return s->index[cache_index_find(s, BLOCK_SLOT(s, pos))];
+#else
+  int64_t slot = BLOCK_SLOT(s, pos);
+  int i = slot % s->num_blocks;
+  int64_t bpos = s->blocks[i].pos;
+  return bpos >= 0 && BLOCK_SLOT(s, bpos) == slot ? i : -1;
+#endif
+}
+
+/**
+ * \return index of the block containing file position pos or -1
+ */
+static int cache_find_block(cache_vars_t *s, int64_t pos)
+{
+  int i = s->cur_block;
+  cache_block_t *b = &s->blocks[i];
+  if (pos >= b->pos && pos < b->pos + b->len)
+    return i;
+  i = cache_slot_block(s, pos);
+  if (i < 0)
+    return -1;
+  b = &s->blocks[i];
+  return pos >= b->pos && pos < b->pos + b->len ? i : -1;
+}
+
+/**
+ * \return the number of bytes cached without gaps starting at pos
+ */
+static int64_t cache_forward_bytes(cache_vars_t *s, int64_t pos)
+{
+  int64_t start = pos;
+  int i;
+  while ((i = cache_find_block(s, pos)) >= 0)
+    pos = s->blocks[i].pos + s->blocks[i].len;
+  return pos - start;
+}
+
+#if COND_CACHE
+/**
+ * \brief find a free block or make one free
+ * \param first first block index to consider
+ * \param end one past the last block index to consider
+ * \param keep_start blocks overlapping [keep_start, keep_end) are never evicted
+ * \return block index or -1 if everything is in use
+ *
+ * The least recently used range is trimmed from its end so it stays
+ * usable without gaps, unless it runs into the kept data, then its
+ * oldest block goes.
+ */
+static int cache_lru_block(cache_vars_t *s, int first, int end,
+                           int64_t keep_start, int64_t keep_end)
+{
+  int i, next, victim = -1;
+  unsigned max_age = 0;
+#define KEEP_BLOCK(b) ((b)->pos < keep_end && (b)->pos + (b)->len > keep_start)
+  for (i = first; i < end; i++) {
+    cache_block_t *b = &s->blocks[i];
+    if (b->pos < 0)
+      return i;
+    if (KEEP_BLOCK(b))
+      continue;
+    if (victim < 0 || s->lru_clock - b->last_use > max_age) {
+      victim = i;
+      max_age = s->lru_clock - b->last_use;
+    }
+  }
+  if (victim < 0)
+    return -1;
+  i = victim;
+  do {
+    cache_block_t *b = &s->blocks[i];
+    if ((b->pos + b->len) % s->block_size)
+      break; // range ends here
+    next = cache_slot_block(s, b->pos + b->len);
+    if (next < first || next >= end || s->blocks[next].pos % s->block_size)
+      break;
+    if (KEEP_BLOCK(&s->blocks[next]))
+      return victim;
+    i = next;
+  } while (1);
+#undef KEEP_BLOCK
+  return i;
+}
+
+#endif
+
+static void cache_claim_block(cache_vars_t *s, int i, int64_t pos)
+{
+  s->blocks[i].len = 0;
+  s->blocks[i].pos = pos;
+  s->blocks[i].last_use = s->lru_clock;
+#if COND_CACHE
+  s->index[cache_index_find(s, BLOCK_SLOT(s, pos))] = i;
+#endif
+}
+
+#if COND_CACHE
+
+/**
+ * \brief make disk block disk hold the data of block i, once it was copied
+ */
+static void cache_move_block(cache_vars_t *s, int i, int disk)
+{
+  s->blocks[disk] = s->blocks[i];
+  s->index[cache_index_find(s, BLOCK_SLOT(s, s->blocks[i].pos))] = disk;
+  s->blocks[i].pos = -1;
+  s->blocks[i].len = 0;
+  if (s->cur_block == i)
+    s->cur_block = disk;
+}
+
+/**
+ * \brief find a block to store data starting at file position pos
+ * \param read current reader position, data from read - back_size up to
+ *             pos is never evicted
+ * \param disk set to the free disk block the data of the returned block
+ *             has to be copied to first, -1 if there is nothing to copy.
+ *             The caller does the copy without holding the lock, then
+ *             calls cache_move_block() and cache_claim_block().
+ * \return block index or -1 if the cache is full
+ */
+static int cache_get_block(cache_vars_t *s, int64_t read, int64_t pos, int *disk)
+{
+  int64_t keep_start = read - s->back_size;
+  int i = cache_slot_block(s, pos);
+  *disk = -1;
+  if (i >= 0) {
+    // continue a partially filled block
+    if (s->blocks[i].pos + s->blocks[i].len == pos)
+      return i;
+    cache_drop_block(s, i);
+  }
+  i = cache_lru_block(s, 0, s->num_blocks, keep_start, pos);
+  if (i < 0)
+    return -1;
+  if (s->blocks[i].pos >= 0) {
+    // move the evicted data to the disk cache if there is one
+    *disk = cache_lru_block(s, s->num_blocks, s->num_blocks + s->num_disk_blocks,
+                            keep_start, pos);
+    if (*disk >= 0) {
+      cache_drop_block(s, *disk);
+      return i;
+    }
+    cache_drop_block(s, i);
+  }
+  cache_claim_block(s, i, pos);
+  return i;
+}
+#else
+/**
+ * \brief find the block to store data starting at file position pos
+ * \param read reader position when the fill was decided
+ * \param disk always set to -1, there is no disk cache without a lock
+ * \return block index or -1 if its data may still be read
+ */
+static int cache_get_block(cache_vars_t *s, int64_t read, int64_t pos, int *disk)
+{
+  int i = BLOCK_SLOT(s, pos) % s->num_blocks;
+  cache_block_t old = s->blocks[i];
+  *disk = -1;
+  // continue a partially filled block
+  if (old.pos >= 0 && old.pos + old.len == pos)
+    return i;
+  // The reader may have seeked into the block meanwhile. Take it out of
+  // use before looking at read_filepos again: either the reader sees it
+  // gone, or we see where the reader is.
+  s->blocks[i].pos = -1;
+  __sync_synchronize();
+  read = s->read_filepos;
+  // keep what the reader is in and back_size before it
+  if (old.pos >= 0 && old.pos <= read &&
+      old.pos + old.len > read - s->back_size) {
+    s->blocks[i] = old;
+    return -1;
+  }
+  s->blocks[i].len = 0;
+  s->run_start = s->run_end = 0;
+  cache_claim_block(s, i, pos);
+  return i;
 }
+#endif
 
-static int cache_read(cache_vars_t *s, unsigned char *buf, int size)
+static int cache_read(stream_t *stream, unsigned char *buf, int size)
 {
+  cache_vars_t *s = stream->cache_data;
   int total=0;
   int sleep_count = 0;
-  int64_t last_max = s->max_filepos;
+  int64_t last_fill = s->fill_total;
+  unsigned wait_start = 0;
   while(size>0){
-    int64_t pos,newb,len;
+    cache_block_t *b;
+    int64_t offset;
+    int i, len;
 
-  //printf("CACHE2_READ: 0x%X <= 0x%X <= 0x%X  \n",s->min_filepos,s->read_filepos,s->max_filepos);
+  //printf("CACHE2_READ: 0x%"PRIX64"\n",s->read_filepos);
 
-    if(s->read_filepos>=s->max_filepos || s->read_filepos<s->min_filepos){
+    cache_lock(s);
+    i = cache_find_block(s, s->read_filepos);
+    if(i < 0){
 	// eof?
-	if(s->eof) break;
-	if (s->max_filepos == last_max) {
+	if(s->eof) {
+	    cache_unlock(s);
+	    break;
+	}
+	if (!wait_start) {
+	    wait_start = GetTimer();
+	    if (!s->seeking)
+	        s->underruns++;
+	}
+	if (s->fill_total == last_fill) {
 	    if (sleep_count++ == 10)
 	        mp_msg(MSGT_CACHE, MSGL_WARN, "Cache empty, consider increasing -cache and/or -cache-min. [performance issue]\n");
 	} else {
-	    last_max = s->max_filepos;
+	    last_fill = s->fill_total;
 	    sleep_count = 0;
 	}
 	// waiting for buffer fill...
-	if (stream_check_interrupt(READ_SLEEP_TIME)) {
+#if COND_CACHE
+	s->fill_wakeup = 1;
+	pthread_cond_signal(&s->fill_cond);
+	cache_cond_wait(s, &s->read_cond, READ_SLEEP_TIME);
+#endif
+	cache_unlock(s);
+#if COND_CACHE
+	if (stream_interrupted(stream, 0)) {
+#else
+	if (stream_interrupted(stream, READ_SLEEP_TIME)) {
+#endif
 	    s->eof = 1;
 	    break;
 	}
 	continue; // try again...
     }
     sleep_count = 0;
+    if (wait_start) {
+      if (!s->seeking)
+        s->stall_time += GetTimer() - wait_start;
+      wait_start = 0;
+    }
 
-    newb=s->max_filepos-s->read_filepos; // new bytes in the buffer
-
-//    printf("*** newb: %d bytes ***\n",newb);
-
-    pos=s->read_filepos - s->offset;
-    if(pos<0) pos+=s->buffer_size; else
-    if(pos>=s->buffer_size) pos-=s->buffer_size;
-
-    if(newb>s->buffer_size-pos) newb=s->buffer_size-pos; // handle wrap...
-    if(newb>size) newb=size;
-
-    // check:
-    if(s->read_filepos<s->min_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"Ehh. s->read_filepos<s->min_filepos !!! Report bug...\n");
-
-    // len=write(mem,newb)
-    //printf("Buffer read: %d bytes\n",newb);
-    memcpy(buf,&s->buffer[pos],newb);
-    buf+=newb;
-    len=newb;
-    // ...
+    b = &s->blocks[i];
+    offset = s->read_filepos - b->pos;
+    len = FFMIN(b->len - offset, size);
+    memcpy(buf, cache_block_data(s, i) + offset, len);
+    b->last_use = ++s->lru_clock;
+    s->cur_block = i;
+    cache_unlock(s);
 
+    buf+=len;
     s->read_filepos+=len;
     size-=len;
     total+=len;
 
   }
+  s->read_total += total;
+#if COND_CACHE
+  // the filler might be waiting for buffer space we just released
+  if (total && s->fill_idle)
+    cache_wakeup(stream);
+#endif
   return total;
 }
 
 static int cache_fill(cache_vars_t *s)
 {
-  int64_t back,back2,newb,space,len,pos;
   int64_t read=s->read_filepos;
-  int read_chunk;
-  int wraparound_copy = 0;
-
-  if(read<s->min_filepos || read>s->max_filepos){
-      // seek...
-      mp_msg(MSGT_CACHE,MSGL_DBG2,"Out of boundaries... seeking to 0x%"PRIX64"  \n",read);
-      // drop cache contents only if seeking backward or too much fwd.
-      // This is also done for on-disk files, since it loses the backseek cache.
-      // That in turn can cause major bandwidth increase and performance
-      // issues with e.g. mov or badly interleaved files
-      if(read<s->min_filepos || read>=s->max_filepos+s->seek_limit)
-      {
+  int64_t pos;
+  unsigned char *dst;
+  int i, disk, space, avail, len, read_chunk;
+  unsigned start;
+
+  cache_lock(s);
+  // find the first byte after read that is not cached yet
+  pos = read;
+  if (read >= s->run_start && read <= s->run_end)
+    pos = s->run_end;
+  pos += cache_forward_bytes(s, pos);
+  s->run_start = read;
+  s->run_end = pos;
+  // fill the gap after a partial block before continuing
+  i = cache_slot_block(s, pos);
+  if (i >= 0 && s->blocks[i].pos < pos)
+    pos = s->blocks[i].pos + s->blocks[i].len;
+  cache_unlock(s);
+
+  if (pos - read >= s->buffer_size - s->back_size)
+    return 0; // enough data ahead, no fill...
+
+  if (pos != s->stream->pos) {
+    int64_t spos = s->stream->pos;
+    // reading a small gap is cheaper than seeking, unless it is cached
+    i = cache_slot_block(s, spos);
+    if (pos > spos && pos - spos < s->seek_limit &&
+        (i < 0 || s->blocks[i].pos + s->blocks[i].len == spos)) {
+      pos = spos;
+    } else {
+      mp_msg(MSGT_CACHE,MSGL_DBG2,"Out of boundaries... seeking to 0x%"PRIX64"  \n",pos);
+      if(s->stream->eof) stream_reset(s->stream);
+      stream_seek_internal(s->stream,pos);
+      // streams that can only seek forward just skip data
+      while (s->stream->pos < pos &&
+             stream_read_internal(s->stream, s->stream->buffer,
+                                  FFMIN(pos - s->stream->pos, STREAM_BUFFER_SIZE)) > 0)
+        /* skip */;
+      mp_msg(MSGT_CACHE,MSGL_DBG2,"Seek done. new pos: 0x%"PRIX64"  \n",(int64_t)stream_tell(s->stream));
+      if (s->stream->pos != pos) {
+        // The stream cannot go there, continue with whatever data comes
+        // next as if it was at pos, which is what the old single range
+        // cache did. Nothing cached so far can be trusted anymore.
+        mp_msg(MSGT_CACHE,MSGL_V,"Cache seek to 0x%"PRIX64" failed, dropping cache content.\n",pos);
+        cache_lock(s);
         cache_flush(s);
-        if(s->stream->eof) stream_reset(s->stream);
-        stream_seek_internal(s->stream,read);
-        mp_msg(MSGT_CACHE,MSGL_DBG2,"Seek done. new pos: 0x%"PRIX64"  \n",(int64_t)stream_tell(s->stream));
+        cache_unlock(s);
+        s->stream->pos = pos;
       }
+    }
   }
 
-  // calc number of back-bytes:
-  back=read - s->min_filepos;
-  if(back<0) back=0; // strange...
-  if(back>s->back_size) back=s->back_size;
-
-  // calc number of new bytes:
-  newb=s->max_filepos - read;
-  if(newb<0) newb=0; // strange...
-
-  // calc free buffer space:
-  space=s->buffer_size - (newb+back);
-
-  // calc bufferpos:
-  pos=s->max_filepos - s->offset;
-  if(pos>=s->buffer_size) pos-=s->buffer_size; // wrap-around
-
-  if(space<s->fill_limit){
-//    printf("Buffer is full (%d bytes free, limit: %d)\n",space,s->fill_limit);
-    return 0; // no fill...
+  cache_lock(s);
+  i = cache_get_block(s, read, pos, &disk);
+  if (i < 0) {
+    cache_unlock(s);
+    return 0; // everything in use
   }
-
-//  printf("### read=0x%X  back=%d  newb=%d  space=%d  pos=%d\n",read,back,newb,space,pos);
-
-  // try to avoid wrap-around. If not possible due to sector size
-  // do an extra copy.
-  if(space>s->buffer_size-pos) {
-    if (s->buffer_size-pos >= s->sector_size) {
-      space=s->buffer_size-pos;
-    } else {
-      space = s->sector_size;
-      wraparound_copy = 1;
-    }
+#if COND_CACHE
+  if (disk >= 0) {
+    // writing to the disk file may page fault or wait for writeback, do not
+    // block the reader meanwhile; neither block is touched by it: block i
+    // is only read, the disk block is not in the index yet
+    unsigned char *src = cache_block_data(s, i);
+    int move_len = s->blocks[i].len;
+    cache_unlock(s);
+    memcpy(cache_block_data(s, disk), src, move_len);
+    cache_lock(s);
+    cache_move_block(s, i, disk);
+    cache_claim_block(s, i, pos);
   }
+#endif
+  // fill up to the end of the block's slot
+  space = s->block_size - pos % s->block_size;
+  dst = cache_block_data(s, i) + s->blocks[i].len;
+  cache_unlock(s);
 
   // limit one-time block size
   read_chunk = s->stream->read_chunk;
   if (!read_chunk) read_chunk = 4*s->sector_size;
-  space = FFMIN(space, read_chunk);
-
-#if 1
-  // back+newb+space <= buffer_size
-  back2=s->buffer_size-(space+newb); // max back size
-  if(s->min_filepos<(read-back2)) s->min_filepos=read-back2;
-#else
-  s->min_filepos=read-back; // avoid seeking-back to temp area...
-#endif
-
-  if (wraparound_copy) {
-    int to_copy;
-    len = stream_read_internal(s->stream, s->stream->buffer, space);
-    to_copy = FFMIN(len, s->buffer_size-pos);
-    memcpy(s->buffer + pos, s->stream->buffer, to_copy);
-    memcpy(s->buffer, s->stream->buffer + to_copy, len - to_copy);
+  avail = space = FFMIN(space, read_chunk);
+
+  start = GetTimer();
+  // sector based streams need to read whole sectors, do an extra copy
+  if (s->stream->sector_size && space < s->sector_size) {
+    len = stream_read_internal(s->stream, s->stream->buffer, s->sector_size);
+    len = FFMIN(len, avail);
+    memcpy(dst, s->stream->buffer, len);
   } else
-  len = stream_read_internal(s->stream, &s->buffer[pos], space);
-  s->eof= !len;
+  len = stream_read_internal(s->stream, dst, space);
 
-  s->max_filepos+=len;
-  if(pos+len>=s->buffer_size){
-      // wrap...
-      s->offset+=s->buffer_size;
-  }
+  cache_lock(s);
+  s->eof= !len;
+  s->blocks[i].len += len;
+  s->blocks[i].last_use = ++s->lru_clock;
+  s->fill_total += len;
+  s->fill_time += GetTimer() - start;
+  if (s->run_start == read && s->run_end == pos)
+    s->run_end += len;
+  cache_unlock(s);
 
   return len;
 
@@ -276,6 +672,9 @@ static int cache_execute_control(cache_vars_t *s) {
     s->stream_time_pos = MP_NOPTS_VALUE;
     s->control_res = STREAM_UNSUPPORTED;
     s->control = -1;
+#if COND_CACHE
+    cache_signal_reader(s);
+#endif
     return !quit;
   }
   if (GetTimerMS() - last > 99) {
@@ -339,6 +738,9 @@ static int cache_execute_control(cache_vars_t *s) {
              (old_pos != s->stream->pos || old_eof != s->stream->eof))
     mp_msg(MSGT_STREAM, MSGL_ERR, "STREAM_CTRL changed stream pos but returned error, this is not allowed!\n");
   s->control = -1;
+#if COND_CACHE
+  cache_signal_reader(s);
+#endif
   return 1;
 }
 
@@ -358,8 +760,47 @@ static void shared_free(void *ptr, int64_t size) {
 #endif
 }
 
+#if HAVE_SYS_MMAN_H && COND_CACHE
+/**
+ * \brief create the file backed second cache tier
+ * \return pointer to the mapping or NULL, the file itself is already deleted
+ */
+static unsigned char *cache_disk_alloc(int64_t size)
+{
+  const char *dir = stream_cache_disk_dir;
+  char *name;
+  unsigned char *ptr = NULL;
+  int fd;
+  if (!dir || !*dir) dir = getenv("TMPDIR");
+  if (!dir || !*dir) dir = "/tmp";
+  name = malloc(strlen(dir) + 24);
+  if (!name)
+    return NULL;
+  sprintf(name, "%s/mplayer-cache-XXXXXX", dir);
+  fd = mkstemp(name);
+  if (fd < 0) {
+    mp_msg(MSGT_CACHE, MSGL_WARN, "Cannot create disk cache file %s: %s\n", name, strerror(errno));
+    free(name);
+    return NULL;
+  }
+  unlink(name);
+  if (ftruncate(fd, size) == 0)
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (!ptr || ptr == MAP_FAILED) {
+    mp_msg(MSGT_CACHE, MSGL_WARN, "Cannot map %"PRId64" bytes of disk cache in %s: %s\n", size, dir, strerror(errno));
+    ptr = NULL;
+  } else
+    mp_msg(MSGT_CACHE, MSGL_V, "Using %"PRId64" bytes of disk cache in %s\n", size, dir);
+  close(fd);
+  free(name);
+  return ptr;
+}
+#endif
+
 static cache_vars_t* cache_init(int64_t size,int sector){
   int64_t num;
+  int block_sectors;
+  int index_size;
   cache_vars_t* s=shared_alloc(sizeof(cache_vars_t));
   if(s==NULL) return NULL;
 
@@ -368,28 +809,107 @@ static cache_vars_t* cache_init(int64_t size,int sector){
   if(num < 16){
      num = 16;
   }//32kb min_size
-  s->buffer_size=num*sector;
+  block_sectors = FFMAX(1, FFMIN(CACHE_BLOCK_SIZE / sector, num / CACHE_MIN_BLOCKS));
+  s->num_blocks = num / block_sectors;
+  s->block_size = block_sectors * sector;
+  s->buffer_size=(int64_t)s->num_blocks*s->block_size;
   s->sector_size=sector;
   s->buffer=shared_alloc(s->buffer_size);
 
-  if(s->buffer == NULL){
+#if HAVE_SYS_MMAN_H && COND_CACHE
+  if (stream_cache_disk_size > 0) {
+    s->num_disk_blocks = stream_cache_disk_size * 1024LL / s->block_size;
+    s->disk_size = (int64_t)s->num_disk_blocks * s->block_size;
+    if (s->disk_size)
+      s->disk_buffer = cache_disk_alloc(s->disk_size);
+    if (!s->disk_buffer)
+      s->num_disk_blocks = s->disk_size = 0;
+  }
+#else
+  if (stream_cache_disk_size > 0)
+    mp_msg(MSGT_CACHE, MSGL_WARN, "Disk cache is not supported by this cache implementation, ignoring -cache-disk.\n");
+#endif
+
+  for (index_size = 1; index_size < 2 * (s->num_blocks + s->num_disk_blocks); index_size <<= 1);
+  s->index_mask = index_size - 1;
+  s->index=shared_alloc(index_size * sizeof(int));
+  s->blocks=shared_alloc((s->num_blocks + s->num_disk_blocks) * sizeof(cache_block_t));
+
+  if(s->buffer == NULL || s->blocks == NULL || s->index == NULL){
+    if (s->buffer)
+      shared_free(s->buffer, s->buffer_size);
+    if (s->blocks)
+      shared_free(s->blocks, (s->num_blocks + s->num_disk_blocks) * sizeof(cache_block_t));
+    if (s->index)
+      shared_free(s->index, index_size * sizeof(int));
+#if HAVE_SYS_MMAN_H
+    if (s->disk_buffer)
+      munmap(s->disk_buffer, s->disk_size);
+#endif
     shared_free(s, sizeof(cache_vars_t));
     return NULL;
   }
+  cache_flush(s);
 
   s->fill_limit=8*sector;
   s->back_size=s->buffer_size/2;
+  s->control = -1;
 #if FORKED_CACHE
   s->ppid = getpid();
+#endif
+#if COND_CACHE
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->fill_cond, NULL);
+  pthread_cond_init(&s->read_cond, NULL);
 #endif
   return s;
 }
 
+static void cache_stats(cache_vars_t *s, cache_stats_t *st)
+{
+  cache_lock(s);
+  st->filled = cache_forward_bytes(s, s->read_filepos);
+  cache_unlock(s);
+  st->fill_percent = st->filled / (s->buffer_size / 100);
+  st->fill_bytes = s->fill_total;
+  st->read_bytes = s->read_total;
+  st->underruns = s->underruns;
+  st->stall_time = s->stall_time / 1e6;
+  st->seek_hits = s->seek_hits;
+  st->seek_misses = s->seek_misses;
+  st->fill_rate = s->fill_time ? s->fill_total * 1e6 / s->fill_time : 0;
+  st->refill_latency = s->seek_misses ? s->refill_time / 1e6 / s->seek_misses : 0;
+}
+
+static void cache_print_stats(cache_vars_t *s, int level)
+{
+  cache_stats_t st;
+  cache_stats(s, &st);
+  mp_msg(MSGT_CACHE, level, "Cache: %d%% filled, %"PRId64" kB from stream at %.0f kB/s, "
+         "%"PRId64" kB to reader, %u underruns (%.2f s), %u of %u seeks cached, "
+         "%.0f ms refill latency\n", st.fill_percent, st.fill_bytes / 1024,
+         st.fill_rate / 1024, st.read_bytes / 1024, st.underruns, st.stall_time,
+         st.seek_hits, st.seek_hits + st.seek_misses, st.refill_latency * 1000);
+}
+
+int cache_get_stats(stream_t *s, cache_stats_t *st)
+{
+  if (!s || !s->cache_data)
+    return -1;
+  cache_stats(s->cache_data, st);
+  return 0;
+}
+
 void cache_uninit(stream_t *s) {
   cache_vars_t* c = s->cache_data;
+  if (c)
+    cache_print_stats(c, MSGL_V);
   if(s->cache_pid) {
 #if !FORKED_CACHE
     cache_do_control(s, -2, NULL);
+#if COND_CACHE
+    pthread_join(c->thread, NULL);
+#endif
 #else
     kill(s->cache_pid,SIGKILL);
     waitpid(s->cache_pid,NULL,0);
@@ -397,8 +917,22 @@ void cache_uninit(stream_t *s) {
     s->cache_pid = 0;
   }
   if(!c) return;
+#if COND_CACHE
+  pthread_mutex_destroy(&c->mutex);
+  pthread_cond_destroy(&c->fill_cond);
+  pthread_cond_destroy(&c->read_cond);
+#endif
   shared_free(c->buffer, c->buffer_size);
   c->buffer = NULL;
+  shared_free(c->blocks, (c->num_blocks + c->num_disk_blocks) * sizeof(cache_block_t));
+  c->blocks = NULL;
+  shared_free(c->index, (c->index_mask + 1) * sizeof(int));
+  c->index = NULL;
+#if HAVE_SYS_MMAN_H
+  if (c->disk_buffer)
+    munmap(c->disk_buffer, c->disk_size);
+  c->disk_buffer = NULL;
+#endif
   c->stream = NULL;
   shared_free(s->cache_data, sizeof(cache_vars_t));
   s->cache_data = NULL;
@@ -418,12 +952,31 @@ static void dummy_sighandler(int x) {
  * Main loop of the cache process or thread.
  */
 static void cache_mainloop(cache_vars_t *s) {
+#if !COND_CACHE
     int sleep_count = 0;
+#endif
 #if FORKED_CACHE
     struct sigaction sa = { .sa_handler = SIG_IGN };
     sigaction(SIGUSR1, &sa, NULL);
 #endif
     do {
+#if COND_CACHE
+        if (!cache_fill(s)) {
+            // Nothing to do, sleep until the reader moves or sends a
+            // command. The timeout keeps the cached time info fresh.
+            pthread_mutex_lock(&s->mutex);
+            if (s->eof)
+                pthread_cond_broadcast(&s->read_cond);
+            if (!s->fill_wakeup && s->control == -1) {
+                s->fill_idle = 1;
+                cache_cond_wait(s, &s->fill_cond, COND_WAIT_TIME);
+                s->fill_idle = 0;
+            }
+            s->fill_wakeup = 0;
+            pthread_mutex_unlock(&s->mutex);
+        } else
+            cache_signal_reader(s);
+#else
         if (!cache_fill(s)) {
 #if FORKED_CACHE
             // Let signal wake us up, we cannot leave this
@@ -443,6 +996,7 @@ static void cache_mainloop(cache_vars_t *s) {
 #endif
         } else
             sleep_count = 0;
+#endif
     } while (cache_execute_control(s));
 }
 
@@ -475,8 +1029,8 @@ int stream_enable_cache(stream_t *stream,int64_t size,int64_t min,int64_t seek_l
   if (s->seek_limit > s->buffer_size - s->fill_limit ){
      s->seek_limit = s->buffer_size - s->fill_limit;
   }
-  if (min > s->buffer_size - s->fill_limit) {
-     min = s->buffer_size - s->fill_limit;
+  if (min > s->buffer_size - s->back_size) {
+     min = s->buffer_size - s->back_size;
   }
   // to make sure we wait for the cache process/thread to be active
   // before continuing
@@ -497,11 +1051,8 @@ int stream_enable_cache(stream_t *stream,int64_t size,int64_t min,int64_t seek_l
 #elif defined(__OS2__)
     stream->cache_pid = _beginthread( ThreadProc, NULL, 256 * 1024, s );
 #else
-    {
-    pthread_t tid;
-    pthread_create(&tid, NULL, ThreadProc, s);
-    stream->cache_pid = 1;
-    }
+    if (!pthread_create(&s->thread, NULL, ThreadProc, s))
+      stream->cache_pid = 1;
 #endif
 #endif
     if (!stream->cache_pid) {
@@ -510,15 +1061,28 @@ int stream_enable_cache(stream_t *stream,int64_t size,int64_t min,int64_t seek_l
         goto err_out;
     }
     // wait until cache is filled at least prefill_init %
-    mp_msg(MSGT_CACHE,MSGL_V,"CACHE_PRE_INIT: %"PRId64" [%"PRId64"] %"PRId64"  pre:%"PRId64"  eof:%d  \n",
-	s->min_filepos,s->read_filepos,s->max_filepos,min,s->eof);
-    while(s->read_filepos<s->min_filepos || s->max_filepos-s->read_filepos<min){
+    mp_msg(MSGT_CACHE,MSGL_V,"CACHE_PRE_INIT: [%"PRId64"] %d blocks of %d bytes  pre:%"PRId64"  eof:%d  \n",
+	s->read_filepos,s->num_blocks,s->block_size,min,s->eof);
+    while(1){
+	int64_t filled;
+	cache_lock(s);
+	filled = cache_forward_bytes(s, s->read_filepos);
+	cache_unlock(s);
+	if (filled >= min) break;
 	mp_msg(MSGT_CACHE,MSGL_STATUS,MSGTR_CacheFill,
-	    100.0*(float)(s->max_filepos-s->read_filepos)/(float)(s->buffer_size),
-	    s->max_filepos-s->read_filepos
+	    100.0*(float)filled/(float)(s->buffer_size),
+	    filled
 	);
 	if(s->eof) break; // file is smaller than prefill size
+#if COND_CACHE
+	pthread_mutex_lock(&s->mutex);
+	if (!s->eof && cache_forward_bytes(s, s->read_filepos)<min)
+	  cache_cond_wait(s, &s->read_cond, PREFILL_SLEEP_TIME);
+	pthread_mutex_unlock(&s->mutex);
+	if(stream_check_interrupt(0)) {
+#else
 	if(stream_check_interrupt(PREFILL_SLEEP_TIME)) {
+#endif
 	  res = 0;
 	  goto err_out;
         }
@@ -554,10 +1118,16 @@ static void *ThreadProc( void *s ){
 #endif
 
 int cache_stream_fill_buffer(stream_t *s){
+  cache_vars_t *cv = s->cache_data;
   int len;
   int sector_size;
   if(!s->cache_pid) return stream_fill_buffer(s);
 
+  if (stream_cache_stats && GetTimerMS() - cv->stats_time >= stream_cache_stats * 1000) {
+    cv->stats_time = GetTimerMS();
+    cache_print_stats(cv, MSGL_INFO);
+  }
+
   if(s->pos!=((cache_vars_t*)s->cache_data)->read_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"!!! read_filepos differs!!! report this bug...\n");
   sector_size = ((cache_vars_t*)s->cache_data)->sector_size;
   if (sector_size > STREAM_MAX_SECTOR_SIZE) {
@@ -565,7 +1135,7 @@ int cache_stream_fill_buffer(stream_t *s){
     sector_size = STREAM_MAX_SECTOR_SIZE;
   }
 
-  len=cache_read(s->cache_data,s->buffer, sector_size);
+  len=cache_read(s,s->buffer, sector_size);
   //printf("cache_stream_fill_buffer->read -> %d\n",len);
 
   if(len<=0){ s->eof=1; s->buf_pos=s->buf_len=0; return 0; }
@@ -574,7 +1144,7 @@ int cache_stream_fill_buffer(stream_t *s){
   s->buf_len=len;
   s->pos+=len;
 //  printf("[%d]",len);fflush(stdout);
-  if (s->capture_file)
+  if (s->capture)
     stream_capture_do(s);
   return len;
 
@@ -582,28 +1152,47 @@ int cache_stream_fill_buffer(stream_t *s){
 
 int cache_fill_status(stream_t *s) {
   cache_vars_t *cv;
+  int64_t filled;
   if (!s || !s->cache_data)
     return -1;
   cv = s->cache_data;
-  return (cv->max_filepos-cv->read_filepos)/(cv->buffer_size / 100);
+  cache_lock(cv);
+  filled = cache_forward_bytes(cv, cv->read_filepos);
+  cache_unlock(cv);
+  return filled/(cv->buffer_size / 100);
 }
 
 int cache_stream_seek_long(stream_t *stream,int64_t pos){
   cache_vars_t* s;
   int64_t newpos;
+  int cached;
+  unsigned start;
   if(!stream->cache_pid) return stream_seek_long(stream,pos);
 
   s=stream->cache_data;
 //  s->seek_lock=1;
 
-  mp_msg(MSGT_CACHE,MSGL_DBG2,"CACHE2_SEEK: 0x%"PRIX64" <= 0x%"PRIX64" (0x%"PRIX64") <= 0x%"PRIX64"  \n",s->min_filepos,pos,s->read_filepos,s->max_filepos);
+  cache_lock(s);
+  cached = cache_find_block(s, pos) >= 0;
+  cache_unlock(s);
+  if (cached)
+    s->seek_hits++;
+  else
+    s->seek_misses++;
+  mp_msg(MSGT_CACHE,MSGL_DBG2,"CACHE2_SEEK: 0x%"PRIX64" (0x%"PRIX64") %s\n",pos,s->read_filepos,
+         cached ? "cached" : "not cached");
 
   newpos=pos/s->sector_size; newpos*=s->sector_size; // align
   stream->pos=s->read_filepos=newpos;
   s->eof=0; // !!!!!!!
   cache_wakeup(stream);
 
+  start = GetTimer();
+  s->seeking = 1;
   cache_stream_fill_buffer(stream);
+  s->seeking = 0;
+  if (!cached)
+    s->refill_time += GetTimer() - start;
 
   pos-=newpos;
   if(pos>=0 && pos<=stream->buf_len){
@@ -659,9 +1248,19 @@ int cache_do_control(stream_t *stream, int cmd, void *arg) {
   }
   cache_wakeup(stream);
   while (s->control != -1) {
+#if COND_CACHE
+    if (sleep_count++ == 1000 / READ_SLEEP_TIME)
+      mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not responding! [performance issue]\n");
+    pthread_mutex_lock(&s->mutex);
+    if (s->control != -1)
+      cache_cond_wait(s, &s->read_cond, READ_SLEEP_TIME);
+    pthread_mutex_unlock(&s->mutex);
+    if (s->control != -1 && stream_interrupted(stream, 0)) {
+#else
     if (sleep_count++ == 1000)
       mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not responding! [performance issue]\n");
-    if (stream_check_interrupt(CONTROL_SLEEP_TIME)) {
+    if (stream_interrupted(stream, CONTROL_SLEEP_TIME)) {
+#endif
       s->eof = 1;
       return STREAM_UNSUPPORTED;
     }
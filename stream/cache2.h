@@ -21,8 +21,26 @@
 
 #include "stream.h"
 
+extern int stream_cache_disk_size;
+extern char *stream_cache_disk_dir;
+extern int stream_cache_stats;
+
+typedef struct {
+  int64_t filled;        // cached bytes ahead of the reader
+  int fill_percent;      // filled in percent of the cache size
+  int64_t fill_bytes;    // bytes read from the stream
+  int64_t read_bytes;    // bytes passed on to the reader
+  unsigned underruns;    // reads that had to wait for data, seeks excluded
+  double stall_time;     // seconds spent waiting in those reads
+  unsigned seek_hits;    // seeks to cached data
+  unsigned seek_misses;
+  double fill_rate;      // bytes per second while reading from the stream
+  double refill_latency; // mean seconds from a seek miss to its data
+} cache_stats_t;
+
 void cache_uninit(stream_t *s);
 int cache_do_control(stream_t *stream, int cmd, void *arg);
 int cache_fill_status(stream_t *s);
+int cache_get_stats(stream_t *s, cache_stats_t *st);
 
 #endif /* MPLAYER_CACHE2_H */
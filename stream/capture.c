@@ -0,0 +1,202 @@
+/*
+ * background writer for -capture
+ *
+ * Captured stream data is queued in a ring buffer and written out by a
+ * separate thread in large blocks, so that a slow disk cannot stall
+ * playback. When the ring is full the data is dropped and counted.
+ *
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "mp_msg.h"
+#include "help_mp.h"
+#include "libavutil/mem.h"
+#include "stream.h"
+
+/// size of the capture queue in kB
+int stream_capture_buffer = 4096;
+
+#define CAPTURE_BLOCK (64 * 1024)
+
+struct stream_capture {
+  FILE *file;
+  int64_t dropped;  // bytes lost because the queue was full
+  int error;        // errno of a failed write, 0 if none
+#if HAVE_PTHREADS
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned char *buf;
+  int size;         // multiple of CAPTURE_BLOCK
+  int64_t in;       // bytes queued so far
+  int64_t out;      // bytes written so far
+  int dropping;     // dropping data, queue not drained since
+  int quit;
+#endif
+};
+
+#if HAVE_PTHREADS
+/**
+ * Write the queue to the file in whole blocks, and the remainder on exit.
+ */
+static void *capture_thread(void *arg)
+{
+  stream_capture_t *c = arg;
+
+  pthread_mutex_lock(&c->mutex);
+  for (;;) {
+    int64_t avail = c->in - c->out;
+    int pos = c->out % c->size;
+    int len;
+    if (avail < CAPTURE_BLOCK && !c->quit) {
+      pthread_cond_wait(&c->cond, &c->mutex);
+      continue;
+    }
+    if (!avail)
+      break;
+    len = avail < c->size - pos ? avail : c->size - pos;
+    if (!c->quit && len > CAPTURE_BLOCK)
+      len -= len % CAPTURE_BLOCK;
+    pthread_mutex_unlock(&c->mutex);
+    len = fwrite(c->buf + pos, 1, len, c->file);
+    pthread_mutex_lock(&c->mutex);
+    c->out += len;
+    if (ferror(c->file)) {
+      c->error = errno ? errno : EIO;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return NULL;
+}
+#endif
+
+/**
+ * Start capturing the data read from s to the end of the given file.
+ * Returns 0 on success, -1 if the file could not be opened.
+ */
+int stream_capture_open(stream_t *s, const char *filename)
+{
+  stream_capture_t *c = calloc(1, sizeof(*c));
+  if (!c)
+    return -1;
+  c->file = fopen(filename, "ab");
+  if (!c->file) {
+    free(c);
+    return -1;
+  }
+#if HAVE_PTHREADS
+  c->size = ((int64_t)stream_capture_buffer * 1024 + CAPTURE_BLOCK - 1) /
+            CAPTURE_BLOCK * CAPTURE_BLOCK;
+  c->buf = av_malloc(c->size);
+  if (c->buf) {
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    if (!pthread_create(&c->thread, NULL, capture_thread, c)) {
+      // all writes are whole blocks, no need for stdio buffering
+      setvbuf(c->file, NULL, _IONBF, 0);
+    } else {
+      pthread_cond_destroy(&c->cond);
+      pthread_mutex_destroy(&c->mutex);
+      av_freep(&c->buf);
+    }
+  }
+  if (!c->buf)
+    mp_msg(MSGT_GLOBAL, MSGL_V, "Capture: writing without a background thread\n");
+#endif
+  s->capture = c;
+  return 0;
+}
+
+/**
+ * Stop capturing, after writing all data still queued.
+ */
+void stream_capture_close(stream_t *s)
+{
+  stream_capture_t *c = s->capture;
+  if (!c)
+    return;
+#if HAVE_PTHREADS
+  if (c->buf) {
+    pthread_mutex_lock(&c->mutex);
+    c->quit = 1;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->thread, NULL);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->mutex);
+    av_freep(&c->buf);
+  }
+#endif
+  if (c->dropped)
+    mp_msg(MSGT_GLOBAL, MSGL_WARN,
+           "Capture: %"PRId64" bytes were dropped because writing was too slow.\n",
+           c->dropped);
+  fclose(c->file);
+  free(c);
+  s->capture = NULL;
+}
+
+void stream_capture_do(stream_t *s)
+{
+  stream_capture_t *c = s->capture;
+  int len = s->buf_len;
+  int error = 0;
+#if HAVE_PTHREADS
+  if (c->buf) {
+    pthread_mutex_lock(&c->mutex);
+    error = c->error;
+    if (!error && c->size - (c->in - c->out) < len) {
+      c->dropped += len;
+      if (!c->dropping)
+        mp_msg(MSGT_GLOBAL, MSGL_WARN,
+               "Capture queue full, %"PRId64" bytes dropped so far.\n",
+               c->dropped);
+      c->dropping = 1;
+    } else if (!error) {
+      int pos = c->in % c->size;
+      int n = len < c->size - pos ? len : c->size - pos;
+      memcpy(c->buf + pos, s->buffer, n);
+      memcpy(c->buf, s->buffer + n, len - n);
+      c->in += len;
+      // only warn again once the writer has caught up a bit
+      if (c->in - c->out < c->size / 2)
+        c->dropping = 0;
+      if (c->in - c->out >= CAPTURE_BLOCK)
+        pthread_cond_signal(&c->cond);
+    }
+    pthread_mutex_unlock(&c->mutex);
+  } else
+#endif
+  if (fwrite(s->buffer, len, 1, c->file) < 1)
+    error = errno;
+  if (error) {
+    mp_msg(MSGT_GLOBAL, MSGL_ERR, MSGTR_StreamErrorWritingCapture,
+           strerror(error));
+    stream_capture_close(s);
+  }
+}
@@ -27,6 +27,9 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
 
 #if !HAVE_WINSOCK2_H
 #else
@@ -272,6 +275,7 @@ static int nop_streaming_start( stream_t *stream ) {
 		stream->fd = fd;
 	} else {
 		http_hdr = (HTTP_header_t*)stream->streaming_ctrl->data;
+		stream->streaming_ctrl->body_left = http_keep_alive_left( http_hdr );
 		if( http_hdr->body_size>0 ) {
 			if( streaming_bufferize( stream->streaming_ctrl, http_hdr->body, http_hdr->body_size )<0 ) {
 				http_free( http_hdr );
@@ -724,13 +728,8 @@ static int http_streaming_start(stream_t *stream, int* file_format) {
 	{
 		redirect = 0;
 		if (fd >= 0) closesocket(fd);
-		fd = http_send_request( url, 0 );
-		if( fd<0 ) {
-			goto err_out;
-		}
-
 		http_free(http_hdr);
-		http_hdr = http_read_response( fd );
+		http_hdr = http_request( url, 0, &fd );
 		if( http_hdr==NULL ) {
 			goto err_out;
 		}
@@ -863,6 +862,280 @@ out:
 	return res;
 }
 
+/*
+ * Parallel range fetching: the file is split into RANGE_CHUNK sized pieces
+ * and the next -http-parallel pieces after the read position are requested
+ * over separate connections at the same time. Reads return them in order.
+ */
+
+#define RANGE_CHUNK   (512*1024)
+#define RANGE_RETRIES 3
+
+typedef struct {
+	int fd;
+	int64_t start, end;   // byte range [start, end) of the file, start < 0 if unused
+	int64_t got;          // bytes of the range received so far
+	HTTP_header_t *hdr;   // response header while it is still being received
+	int keep_alive;       // connection can be reused once the range is complete
+	int retries;
+	char *buf;
+} range_slot_t;
+
+typedef struct {
+	range_slot_t *slot;   // piece n is always fetched by slot[n % num]
+	int num;
+	int64_t pos, size;
+	stream_t *stream;
+} range_fetch_t;
+
+static void range_close(range_slot_t *slot) {
+	if (slot->fd >= 0)
+		closesocket(slot->fd);
+	slot->fd = -1;
+	slot->keep_alive = 0;
+	http_free(slot->hdr);
+	slot->hdr = NULL;
+}
+
+// (re)request the part of the range that has not been received yet
+static int range_connect(range_fetch_t *r, range_slot_t *slot) {
+	range_close(slot);
+	slot->fd = http_send_range_request(r->stream->streaming_ctrl->url,
+	                                   slot->start + slot->got, slot->end - 1, 1);
+	if (slot->fd < 0)
+		return -1;
+	slot->hdr = http_new_header();
+	return slot->hdr ? 0 : -1;
+}
+
+static int range_retry(range_fetch_t *r, range_slot_t *slot) {
+	range_close(slot);
+	if (slot->retries++ >= RANGE_RETRIES) {
+		mp_msg(MSGT_NETWORK, MSGL_ERR, "Fetching range %"PRId64"-%"PRId64" failed\n",
+		       slot->start, slot->end - 1);
+		return -1;
+	}
+	mp_msg(MSGT_NETWORK, MSGL_V, "Retrying range %"PRId64"-%"PRId64"\n",
+	       slot->start + slot->got, slot->end - 1);
+	return range_connect(r, slot);
+}
+
+// returns -2 if the server does not support what we need
+static int range_receive(range_fetch_t *r, range_slot_t *slot) {
+	int len;
+
+	if (slot->hdr) {
+		char tmp[BUFFER_SIZE];
+		const char *content_range;
+		int64_t first;
+		len = recv(slot->fd, tmp, sizeof(tmp), 0);
+		if (len <= 0)
+			return range_retry(r, slot);
+		http_response_append(slot->hdr, tmp, len);
+		if (!http_is_header_entire(slot->hdr))
+			return 0;
+		if (http_response_parse(slot->hdr) < 0)
+			return range_retry(r, slot);
+		content_range = http_get_field(slot->hdr, "Content-Range");
+		if (slot->hdr->status_code != 206 || !content_range ||
+		    sscanf(content_range, "bytes %"SCNd64, &first) != 1 ||
+		    first != slot->start + slot->got) {
+			mp_msg(MSGT_NETWORK, MSGL_WARN,
+			       "Server does not support range requests properly (%d), disabling -http-parallel\n",
+			       slot->hdr->status_code);
+			return -2;
+		}
+		len = slot->hdr->body_size;
+		if (len > slot->end - slot->start - slot->got)
+			len = slot->end - slot->start - slot->got;
+		memcpy(slot->buf + slot->got, slot->hdr->body, len);
+		slot->keep_alive = http_keep_alive_left(slot->hdr) ==
+		                   slot->end - slot->start - slot->got - len;
+		http_free(slot->hdr);
+		slot->hdr = NULL;
+	} else {
+		len = recv(slot->fd, slot->buf + slot->got, slot->end - slot->start - slot->got, 0);
+		if (len <= 0)
+			return range_retry(r, slot);
+	}
+	slot->got += len;
+	if (slot->start + slot->got >= slot->end) {
+		if (slot->keep_alive) {
+			http_pool_put(r->stream->streaming_ctrl->url, slot->fd);
+			slot->fd = -1;
+		}
+		range_close(slot);
+	}
+	return 0;
+}
+
+/// wait until data arrives on any of the connections and receive it
+static int range_pump(range_fetch_t *r) {
+	fd_set set;
+	struct timeval tv;
+	int i, ret, maxfd = -1;
+
+	FD_ZERO(&set);
+	for (i = 0; i < r->num; i++) {
+		if (r->slot[i].fd < 0)
+			continue;
+		FD_SET(r->slot[i].fd, &set);
+		if (r->slot[i].fd > maxfd)
+			maxfd = r->slot[i].fd;
+	}
+	if (maxfd < 0)
+		return -1;
+	tv.tv_sec = 0;
+	tv.tv_usec = 500000;
+	ret = select(maxfd + 1, &set, NULL, NULL, &tv);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	for (i = 0; i < r->num; i++)
+		if (r->slot[i].fd >= 0 && FD_ISSET(r->slot[i].fd, &set) &&
+		    (ret = range_receive(r, &r->slot[i])) < 0)
+			return ret;
+	return 0;
+}
+
+/// make sure the pieces following the read position are being fetched
+static int range_update(range_fetch_t *r) {
+	int64_t n, first = r->pos / RANGE_CHUNK;
+
+	for (n = first; n < first + r->num && n * RANGE_CHUNK < r->size; n++) {
+		range_slot_t *slot = &r->slot[n % r->num];
+		if (slot->start == n * RANGE_CHUNK)
+			continue;
+		slot->start = n * RANGE_CHUNK;
+		slot->end = slot->start + RANGE_CHUNK;
+		if (slot->end > r->size)
+			slot->end = r->size;
+		slot->got = 0;
+		slot->retries = 0;
+		if (range_connect(r, slot) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void range_free(stream_t *stream) {
+	range_fetch_t *r = stream->streaming_ctrl->data;
+	int i;
+
+	for (i = 0; i < r->num; i++) {
+		range_close(&r->slot[i]);
+		free(r->slot[i].buf);
+	}
+	free(r->slot);
+	free(r);
+	stream->streaming_ctrl->data = NULL;
+}
+
+/// go back to a single sequential connection
+static int range_fallback(range_fetch_t *r) {
+	stream_t *stream = r->stream;
+	int64_t pos = r->pos;
+
+	range_free(stream);
+	stream->seek = http_seek;
+	stream->streaming_ctrl->streaming_read = nop_streaming_read;
+	return http_seek(stream, pos) > 0 ? 0 : -1;
+}
+
+static int range_streaming_read(int fd, char *buffer, int size, streaming_ctrl_t *sc) {
+	range_fetch_t *r = sc->data;
+	range_slot_t *slot;
+	int64_t off;
+	int ret;
+
+	if (r->pos >= r->size) {
+		sc->status = streaming_stopped_e;
+		return 0;
+	}
+	if (range_update(r) < 0)
+		return -1;
+	slot = &r->slot[(r->pos / RANGE_CHUNK) % r->num];
+	off = r->pos - slot->start;
+	while (slot->got <= off) {
+		ret = range_pump(r);
+		if (ret == -2) {
+			stream_t *stream = r->stream;
+			if (range_fallback(r) < 0)
+				return -1;
+			return nop_streaming_read(stream->fd, buffer, size, sc);
+		}
+		if (ret < 0)
+			return -1;
+	}
+	if (size > slot->got - off)
+		size = slot->got - off;
+	memcpy(buffer, slot->buf + off, size);
+	r->pos += size;
+	return size;
+}
+
+static int range_seek(stream_t *stream, int64_t pos) {
+	range_fetch_t *r = stream->streaming_ctrl->data;
+	if (pos > r->size)
+		return 0;
+	r->pos = stream->pos = pos;
+	stream->streaming_ctrl->status = streaming_playing_e;
+	return 1;
+}
+
+static void range_start(stream_t *stream) {
+	range_fetch_t *r = calloc(1, sizeof(*r));
+	int i;
+
+	if (!r)
+		return;
+	r->num = network_http_parallel;
+	r->size = stream->end_pos;
+	r->stream = stream;
+	r->slot = calloc(r->num, sizeof(*r->slot));
+	for (i = 0; r->slot && i < r->num; i++) {
+		r->slot[i].fd = -1;
+		r->slot[i].start = -1;
+	}
+	for (i = 0; r->slot && i < r->num; i++)
+		if (!(r->slot[i].buf = malloc(RANGE_CHUNK)))
+			break;
+	stream->streaming_ctrl->data = r;
+	if (!r->slot || i < r->num) {
+		mp_msg(MSGT_NETWORK, MSGL_FATAL, MSGTR_MemAllocFailed);
+		if (r->slot)
+			range_free(stream);
+		else {
+			free(r);
+			stream->streaming_ctrl->data = NULL;
+		}
+		return;
+	}
+	mp_msg(MSGT_NETWORK, MSGL_V, "Fetching %d ranges of %d kB in parallel\n",
+	       r->num, RANGE_CHUNK / 1024);
+	// the pieces are fetched over their own connections
+	if (stream->fd >= 0)
+		closesocket(stream->fd);
+	stream->fd = -1;
+	free(stream->streaming_ctrl->buffer);
+	stream->streaming_ctrl->buffer = NULL;
+	stream->streaming_ctrl->buffer_size = stream->streaming_ctrl->buffer_pos = 0;
+	stream->streaming_ctrl->streaming_read = range_streaming_read;
+	stream->seek = range_seek;
+}
+
+static void http_close(stream_t *stream) {
+	streaming_ctrl_t *sc = stream->streaming_ctrl;
+	if (!sc)
+		return;
+	if (sc->streaming_read == range_streaming_read)
+		range_free(stream);
+	else if (sc->body_left == 0 && stream->fd >= 0) {
+		// the whole response has been read, keep the connection
+		http_pool_put(sc->url, stream->fd);
+		stream->fd = -1;
+	}
+}
+
 static int fixup_open(stream_t *stream,int seekable) {
 	HTTP_header_t *http_hdr = stream->streaming_ctrl->data;
 	int is_icy = http_hdr && http_get_field(http_hdr, "Icy-MetaInt");
@@ -885,6 +1158,10 @@ static int fixup_open(stream_t *stream,int seekable) {
 		stream->streaming_ctrl = NULL;
 		return STREAM_UNSUPPORTED;
 	}
+	if (network_http_parallel > 1 && !is_icy && !is_ultravox && seekable &&
+	    stream->end_pos > 0)
+		range_start(stream);
+	stream->close = http_close;
 
 	fixup_network_stream_cache(stream);
 	return STREAM_OK;
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "config.h"
 
@@ -47,6 +48,9 @@
 #include "http.h"
 #include "cookies.h"
 #include "url.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 /* Variables for the command line option -user, -passwd, -bandwidth,
    -user-agent and -nocookies */
@@ -58,6 +62,8 @@ int   network_cookies_enabled = 0;
 char *network_useragent=NULL;
 char *network_referrer=NULL;
 char **network_http_header_fields=NULL;
+int   network_http_parallel=0;
+int   network_http_keep_alive=1;
 
 /* IPv6 options */
 int   network_ipv4_only_proxy = 0;
@@ -120,6 +126,7 @@ streaming_ctrl_new(void) {
 		mp_msg(MSGT_NETWORK,MSGL_FATAL,MSGTR_MemAllocFailed);
 		return NULL;
 	}
+	streaming_ctrl->body_left = -1;
 	return streaming_ctrl;
 }
 
@@ -196,8 +203,162 @@ URL_t *url_new_with_proxy(const char *urlstr)
 	return url_with_proxy;
 }
 
+/*
+ * Idle keep-alive HTTP connections, keyed by the host and port they are
+ * connected to (the proxy if one is used).
+ */
+
+#define HTTP_POOL_SIZE      8
+#define HTTP_POOL_IDLE_TIME 10 // seconds after which idle connections are dropped
+
+static struct {
+	char *host;
+	int port;
+	int fd;
+	time_t since;
+} http_pool[HTTP_POOL_SIZE];
+
+#if HAVE_PTHREADS
+static pthread_mutex_t http_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define http_pool_lock()   pthread_mutex_lock(&http_pool_mutex)
+#define http_pool_unlock() pthread_mutex_unlock(&http_pool_mutex)
+#else
+#define http_pool_lock()
+#define http_pool_unlock()
+#endif
+
+static int http_conn_port(const URL_t *url) {
+	if (url->port)
+		return url->port;
+	return strcasecmp(url->protocol, "http_proxy") ? 80 : 8080;
+}
+
+static void http_pool_drop(int i) {
+	closesocket(http_pool[i].fd);
+	free(http_pool[i].host);
+	http_pool[i].host = NULL;
+}
+
+/// an idle connection that became readable was closed by the server
+static int http_conn_alive(int fd) {
+	fd_set set;
+	struct timeval tv = { 0, 0 };
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+	return select(fd + 1, &set, NULL, NULL, &tv) == 0;
+}
+
+static int http_pool_take(const URL_t *url) {
+	int i, fd = -1;
+	time_t now = time(NULL);
+	http_pool_lock();
+	for (i = 0; i < HTTP_POOL_SIZE; i++) {
+		if (!http_pool[i].host)
+			continue;
+		if (now - http_pool[i].since > HTTP_POOL_IDLE_TIME ||
+		    !http_conn_alive(http_pool[i].fd)) {
+			http_pool_drop(i);
+			continue;
+		}
+		if (fd < 0 && http_pool[i].port == http_conn_port(url) &&
+		    !strcasecmp(http_pool[i].host, url->hostname)) {
+			fd = http_pool[i].fd;
+			free(http_pool[i].host);
+			http_pool[i].host = NULL;
+		}
+	}
+	http_pool_unlock();
+	if (fd >= 0)
+		mp_msg(MSGT_NETWORK,MSGL_V,"Reusing connection to %s:%d\n", url->hostname, http_conn_port(url));
+	return fd;
+}
+
+/**
+ * Hand a connection whose response has been read completely back for
+ * reuse by the next request to the same server, url is the one the
+ * request was made for.
+ */
+void
+http_pool_put( const URL_t *url, int fd ) {
+	int i, oldest = 0;
+	if (fd < 0)
+		return;
+	if (!network_http_keep_alive) {
+		closesocket(fd);
+		return;
+	}
+	http_pool_lock();
+	for (i = 0; i < HTTP_POOL_SIZE; i++) {
+		if (!http_pool[i].host)
+			break;
+		if (http_pool[i].since < http_pool[oldest].since)
+			oldest = i;
+	}
+	if (i == HTTP_POOL_SIZE) {
+		i = oldest;
+		http_pool_drop(i);
+	}
+	http_pool[i].host = strdup(url->hostname);
+	http_pool[i].port = http_conn_port(url);
+	http_pool[i].fd = fd;
+	http_pool[i].since = time(NULL);
+	if (!http_pool[i].host)
+		closesocket(fd);
+	http_pool_unlock();
+}
+
+/**
+ * \return number of body bytes still to be read before the connection
+ *         can be reused, or -1 if the server will not keep it open
+ */
+int64_t
+http_keep_alive_left( HTTP_header_t *http_hdr ) {
+	const char *connection = http_get_field(http_hdr, "Connection");
+	const char *length = http_get_field(http_hdr, "Content-Length");
+	int64_t left;
+	if (!network_http_keep_alive || !length || !connection ||
+	    strcasecmp(connection, "keep-alive") ||
+	    http_get_field(http_hdr, "Transfer-Encoding"))
+		return -1;
+	left = atoll(length) - http_hdr->body_size;
+	return left < 0 ? -1 : left;
+}
+
+/**
+ * Send a request from pos to the end of the file asking for a keep-alive
+ * connection and read the response header.
+ * A failure on a reused connection that the server has just closed is
+ * retried once.
+ */
+HTTP_header_t *
+http_request( URL_t *url, int64_t pos, int *fd ) {
+	int tries;
+	for (tries = 0; tries < 2; tries++) {
+		HTTP_header_t *http_hdr;
+		*fd = http_send_range_request( url, pos, -1, 1 );
+		if( *fd<0 )
+			return NULL;
+		http_hdr = http_read_response( *fd );
+		if( http_hdr )
+			return http_hdr;
+		closesocket( *fd );
+	}
+	*fd = -1;
+	return NULL;
+}
+
 int
 http_send_request( URL_t *url, int64_t pos ) {
+	return http_send_range_request( url, pos, -1, 0 );
+}
+
+/**
+ * Like http_send_request, but only request the bytes up to and including
+ * end if it is not negative. With keep_alive the connection may be taken
+ * from the idle pool and the server is asked to keep it open.
+ */
+int
+http_send_range_request( URL_t *url, int64_t pos, int64_t end, int keep_alive ) {
 	HTTP_header_t *http_hdr;
 	URL_t *server_url;
 	char str[256];
@@ -250,7 +411,10 @@ http_send_request( URL_t *url, int64_t pos ) {
 	if( strcasecmp(url->protocol, "noicyx") )
 	    http_set_field(http_hdr, "Icy-MetaData: 1");
 
-	if(pos>0) {
+	if(end>=0) {
+	    snprintf(str, sizeof(str), "Range: bytes=%"PRId64"-%"PRId64, (int64_t)pos, (int64_t)end);
+	    http_set_field(http_hdr, str);
+	} else if(pos>0) {
 	// Extend http_send_request with possibility to do partial content retrieval
 	    snprintf(str, sizeof(str), "Range: bytes=%"PRId64"-", (int64_t)pos);
 	    http_set_field(http_hdr, str);
@@ -264,7 +428,8 @@ http_send_request( URL_t *url, int64_t pos ) {
 			http_set_field(http_hdr, network_http_header_fields[i++]);
 	}
 
-	http_set_field( http_hdr, "Connection: close");
+	keep_alive = keep_alive && network_http_keep_alive;
+	http_set_field( http_hdr, keep_alive ? "Connection: keep-alive" : "Connection: close");
 	if (proxy)
 		http_add_basic_proxy_authentication(http_hdr, url->username, url->password);
 	http_add_basic_authentication(http_hdr, server_url->username, server_url->password);
@@ -273,18 +438,28 @@ http_send_request( URL_t *url, int64_t pos ) {
 	}
 
 	if( proxy ) {
-		if( url->port==0 ) url->port = 8080;			// Default port for the proxy server
-		fd = connect2Server( url->hostname, url->port,1 );
 		url_free( server_url );
 		server_url = NULL;
+	}
+	mp_msg(MSGT_NETWORK,MSGL_DBG2,"Request: [%s]\n", http_hdr->buffer );
+
+	if( keep_alive && (fd = http_pool_take( url ))>=0 ) {
+		ret = send( fd, http_hdr->buffer, http_hdr->buffer_size, DEFAULT_SEND_FLAGS );
+		if( ret==(int)http_hdr->buffer_size ) {
+			http_free( http_hdr );
+			return fd;
+		}
+		closesocket( fd );
+	}
+	if( proxy ) {
+		if( url->port==0 ) url->port = 8080;			// Default port for the proxy server
 	} else {
-		if( server_url->port==0 ) server_url->port = 80;	// Default port for the web server
-		fd = connect2Server( server_url->hostname, server_url->port,1 );
+		if( url->port==0 ) url->port = 80;	// Default port for the web server
 	}
+	fd = connect2Server( url->hostname, url->port,1 );
 	if( fd<0 ) {
 		goto err_out;
 	}
-	mp_msg(MSGT_NETWORK,MSGL_DBG2,"Request: [%s]\n", http_hdr->buffer );
 
 	ret = send( fd, http_hdr->buffer, http_hdr->buffer_size, DEFAULT_SEND_FLAGS );
 	if( ret!=(int)http_hdr->buffer_size ) {
@@ -388,11 +563,16 @@ http_seek( stream_t *stream, int64_t pos ) {
 	int fd;
 	if( stream==NULL ) return 0;
 
-	if( stream->fd>0 ) closesocket(stream->fd); // need to reconnect to seek in http-stream
-	fd = http_send_request( stream->streaming_ctrl->url, pos );
-	if( fd<0 ) return 0;
-
-	http_hdr = http_read_response( fd );
+	// need to reconnect to seek in http-stream
+	if( stream->fd>0 ) {
+		if( stream->streaming_ctrl->body_left==0 )
+			http_pool_put( stream->streaming_ctrl->url, stream->fd );
+		else
+			closesocket(stream->fd);
+	}
+	stream->fd = -1;
+	stream->streaming_ctrl->body_left = -1;
+	http_hdr = http_request( stream->streaming_ctrl->url, pos, &fd );
 
 	if( http_hdr==NULL ) return 0;
 
@@ -410,6 +590,7 @@ http_seek( stream_t *stream, int64_t pos ) {
 					return -1;
 				}
 			}
+			stream->streaming_ctrl->body_left = http_keep_alive_left( http_hdr );
 			break;
 		default:
 			mp_msg(MSGT_NETWORK,MSGL_ERR,MSGTR_MPDEMUX_NW_ErrServerReturned, http_hdr->status_code, http_hdr->reason_phrase );
@@ -464,13 +645,22 @@ nop_streaming_read( int fd, char *buffer, int size, streaming_ctrl_t *stream_ctr
 	}
 
 	if( len<size ) {
-		int ret;
-		ret = recv( fd, buffer+len, size-len, 0 );
+		int ret, want = size-len;
+		// a kept-alive connection stays open after the response body
+		if( stream_ctrl->body_left>=0 && want>stream_ctrl->body_left )
+			want = stream_ctrl->body_left;
+		if( want==0 ) {
+			stream_ctrl->status = streaming_stopped_e;
+			return len;
+		}
+		ret = recv( fd, buffer+len, want, 0 );
 		if( ret<0 ) {
 			mp_msg(MSGT_NETWORK,MSGL_ERR,"nop_streaming_read error : %s\n",strerror(errno));
 			ret = 0;
 		} else if (ret == 0)
 			stream_ctrl->status = streaming_stopped_e;
+		else if( stream_ctrl->body_left>0 )
+			stream_ctrl->body_left -= ret;
 		len += ret;
 //printf("read %d bytes from network\n", len );
 	}
@@ -69,6 +69,8 @@ extern char *network_username;
 extern char **network_http_header_fields;
 
 extern int   network_bandwidth;
+extern int   network_http_parallel;
+extern int   network_http_keep_alive;
 extern int   network_cookies_enabled;
 extern int   network_ipv4_only_proxy;
 
@@ -80,6 +82,10 @@ int nop_streaming_seek( int fd, int64_t pos, streaming_ctrl_t *stream_ctrl );
 void streaming_ctrl_free( streaming_ctrl_t *streaming_ctrl );
 
 int http_send_request(URL_t *url, int64_t pos);
+int http_send_range_request(URL_t *url, int64_t pos, int64_t end, int keep_alive);
+HTTP_header_t *http_request(URL_t *url, int64_t pos, int *fd);
+int64_t http_keep_alive_left(HTTP_header_t *http_hdr);
+void http_pool_put(const URL_t *url, int fd);
 HTTP_header_t *http_read_response(int fd);
 
 int http_authenticate(HTTP_header_t *http_hdr, URL_t *url, int *auth_retry);
@@ -36,6 +36,9 @@
 #if HAVE_WINSOCK2_H
 #include <winsock2.h>
 #endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "mp_msg.h"
 #include "help_mp.h"
@@ -53,6 +56,9 @@
 #include "cache2.h"
 
 static int (*stream_check_interrupt_cb)(int time) = NULL;
+#if HAVE_PTHREADS
+static pthread_t stream_interrupt_thread;
+#endif
 
 extern const stream_info_t stream_info_bd;
 extern const stream_info_t stream_info_vcd;
@@ -181,7 +187,7 @@ static stream_t* open_stream_plugin(const stream_info_t* sinfo, const char* file
     }
   }
   s = new_stream(-2,-2);
-  s->capture_file = NULL;
+  s->capture = NULL;
   s->url=strdup(filename);
   s->flags |= mode;
   *ret = sinfo->open(s,mode,arg,file_format);
@@ -272,16 +278,6 @@ stream_t* open_output_stream(const char* filename, char** options) {
 
 //=================== STREAMER =========================
 
-void stream_capture_do(stream_t *s)
-{
-  if (fwrite(s->buffer, s->buf_len, 1, s->capture_file) < 1) {
-    mp_msg(MSGT_GLOBAL, MSGL_ERR, MSGTR_StreamErrorWritingCapture,
-           strerror(errno));
-    fclose(s->capture_file);
-    s->capture_file = NULL;
-  }
-}
-
 static int stream_reconnect(stream_t *s)
 {
 #define MAX_RECONNECT_RETRIES 5
@@ -333,6 +329,9 @@ int stream_read_internal(stream_t *s, void *buf, int len)
     // do not retry if this looks like proper eof
     if (s->eof || (s->end_pos && s->pos == s->end_pos))
       goto eof_out;
+    // or if we are asked to give up
+    if (s->interrupted)
+      goto eof_out;
     // dvdnav has some horrible hacks to "suspend" reads,
     // we need to skip this code or seeks will hang.
     if (s->type == STREAMTYPE_DVDNAV)
@@ -357,14 +356,112 @@ eof_out:
   return len;
 }
 
+//=================== PROBE BUFFER ======================
+
+#define PROBE_ALLOC_MIN (64 * 1024)
+
+static void stream_probe_free(stream_t *s)
+{
+  free(s->probe_buf);
+  s->probe_buf = NULL;
+  s->probe_len = s->probe_alloc = s->probe_size = 0;
+}
+
+/**
+ * Move the underlying stream to s->pos, seeks inside the probe buffer do
+ * not touch it.
+ */
+static int stream_probe_sync(stream_t *s)
+{
+  char tmp[STREAM_BUFFER_SIZE];
+  int64_t pos = s->pos;
+  if (s->probe_real_pos == pos)
+    return 1;
+  s->pos = s->probe_real_pos;
+  if (stream_seek_internal(s, pos) < 0) {
+    // streams without forward seeking have to read up to pos
+    while (s->pos < pos)
+      if (stream_read_internal(s, tmp, FFMIN(pos - s->pos, (int64_t)sizeof(tmp))) <= 0)
+        break;
+  }
+  s->probe_real_pos = s->pos;
+  if (s->pos != pos) {
+    mp_msg(MSGT_STREAM, MSGL_V, "stream_probe: can't seek to 0x%"PRIX64"\n", pos);
+    s->pos = pos;
+    return 0;
+  }
+  return 1;
+}
+
+static int stream_probe_grow(stream_t *s, int size)
+{
+  unsigned char *buf;
+  int alloc;
+  if (size <= s->probe_alloc)
+    return 1;
+  alloc = FFMIN(FFMAX3(2 * s->probe_alloc, size, PROBE_ALLOC_MIN), s->probe_size);
+  buf = realloc(s->probe_buf, alloc);
+  if (!buf)
+    return 0;
+  s->probe_buf = buf;
+  s->probe_alloc = alloc;
+  return 1;
+}
+
+/**
+ * stream_read_internal() for streams being probed: data from the start of
+ * the probe buffer on is read only once.
+ */
+static int stream_probe_read(stream_t *s, unsigned char *buf, int len)
+{
+  int64_t off = s->pos - s->probe_start;
+
+  if (off >= 0 && off < s->probe_len) {
+    len = FFMIN(len, s->probe_len - off);
+    memcpy(buf, s->probe_buf + off, len);
+    s->pos += len;
+    s->eof = 0;
+    s->probe_hits += len;
+    return len;
+  }
+  if (off == s->probe_len && off < s->probe_size) {
+    len = FFMIN(len, s->probe_size - off);
+    if (stream_probe_grow(s, off + len)) {
+      if (!stream_probe_sync(s)) {
+        s->eof = 1;
+        return 0;
+      }
+      len = stream_read_internal(s, s->probe_buf + off, len);
+      s->probe_real_pos = s->pos;
+      if (len > 0) {
+        memcpy(buf, s->probe_buf + off, len);
+        s->probe_len += len;
+      }
+      return len;
+    }
+    s->probe_size = s->probe_len;
+  }
+  // outside of the probe buffer
+  if (!stream_probe_sync(s)) {
+    s->eof = 1;
+    return 0;
+  }
+  if (!s->probe_size)
+    stream_probe_free(s);
+  len = stream_read_internal(s, buf, len);
+  s->probe_real_pos = s->pos;
+  return len;
+}
+
 int stream_fill_buffer(stream_t *s){
-  int len = stream_read_internal(s, s->buffer, STREAM_BUFFER_SIZE);
+  int len = s->probe_buf ? stream_probe_read(s, s->buffer, STREAM_BUFFER_SIZE)
+                         : stream_read_internal(s, s->buffer, STREAM_BUFFER_SIZE);
   if (len <= 0)
     return 0;
   s->buf_pos=0;
   s->buf_len=len;
 //  printf("[%d]",len);fflush(stdout);
-  if (s->capture_file)
+  if (s->capture)
     stream_capture_do(s);
   return len;
 }
@@ -443,6 +540,20 @@ int stream_seek_long(stream_t *s, int64_t pos){
     return 1;
   }
 
+  if (s->probe_buf) {
+    int64_t off = pos - s->probe_start;
+    if (off >= 0 && off <= s->probe_len) {
+      // the next stream_fill_buffer() reads from the probe buffer
+      s->pos = pos;
+      s->eof = 0;
+      return 1;
+    }
+    // a real seek, it starts from where the underlying stream is
+    s->pos = s->probe_real_pos;
+    if (!s->probe_size)
+      stream_probe_free(s);
+  }
+
   if(s->sector_size)
       newpos = (pos/s->sector_size)*s->sector_size;
   else
@@ -476,6 +587,92 @@ while(stream_fill_buffer(s) > 0 && pos >= 0) {
   return 0;
 }
 
+unsigned char *stream_peek(stream_t *s, int len)
+{
+  int64_t pos = stream_tell(s);
+  // with cache or capture the data has to go through the stream buffer
+  if (!s->map || s->cache_pid || s->capture)
+    return NULL;
+  if (len < 0 || pos < 0 || pos + len > s->map_size)
+    return NULL;
+  return s->map + pos;
+}
+
+unsigned char *stream_borrow(stream_t *s, int len)
+{
+  unsigned char *mem = stream_peek(s, len);
+  int64_t pos;
+  if (!mem)
+    return NULL;
+  pos = stream_tell(s) + len;
+  if (pos <= s->pos) {
+    s->buf_pos = pos - (s->pos - s->buf_len);
+  } else {
+    // mapped streams read from s->pos, so no real seek is needed
+    s->buf_pos = s->buf_len = 0;
+    s->pos = pos;
+  }
+  return mem;
+}
+
+unsigned char *stream_peek_buffer(stream_t *s, int *len)
+{
+  int64_t pos = stream_tell(s);
+  int avail;
+  if (s->map && !s->cache_pid && !s->capture) {
+    if (pos < 0 || pos >= s->map_size) {
+      *len = 0;
+      return NULL;
+    }
+    if (*len > s->map_size - pos)
+      *len = s->map_size - pos;
+    return s->map + pos;
+  }
+  if (s->buf_pos >= s->buf_len && !cache_stream_fill_buffer(s)) {
+    *len = 0;
+    return NULL;
+  }
+  avail = s->buf_len - s->buf_pos;
+  if (*len > avail)
+    *len = avail;
+  return s->buffer + s->buf_pos;
+}
+
+int stream_probe_start(stream_t *s, int size)
+{
+  // these keep the data in memory already or need it to go through the
+  // stream layer in order
+  if (s->cache_pid || s->map || s->capture || s->sector_size ||
+      s->type == STREAMTYPE_MEMORY || s->mode != STREAM_READ || size <= 0)
+    return 0;
+  if (!s->probe_buf) {
+    // what is in s->buffer already is the start of the probe buffer
+    s->probe_alloc = FFMAX(FFMIN(size, PROBE_ALLOC_MIN), s->buf_len);
+    s->probe_buf = malloc(s->probe_alloc);
+    if (!s->probe_buf) {
+      s->probe_alloc = 0;
+      return 0;
+    }
+    memcpy(s->probe_buf, s->buffer, s->buf_len);
+    s->probe_len = s->buf_len;
+    s->probe_start = s->pos - s->buf_len;
+    s->probe_real_pos = s->pos;
+    s->probe_hits = 0;
+  }
+  s->probe_size = FFMAX(size, s->probe_len);
+  return 1;
+}
+
+void stream_probe_end(stream_t *s)
+{
+  int64_t off = s->pos - s->probe_start;
+  if (!s->probe_buf)
+    return;
+  s->probe_size = 0;
+  // drop it right away if it is not going to be read again
+  if ((off < 0 || off > s->probe_len) && s->pos == s->probe_real_pos)
+    stream_probe_free(s);
+}
 
 void stream_reset(stream_t *s){
   if(s->eof){
@@ -489,6 +686,17 @@ void stream_reset(stream_t *s){
 
 int stream_control(stream_t *s, int cmd, void *arg){
   if(!s->control) return STREAM_UNSUPPORTED;
+  if (s->probe_buf) {
+    switch (cmd) {
+    case STREAM_CTRL_RESET:
+    case STREAM_CTRL_SEEK_TO_CHAPTER:
+    case STREAM_CTRL_SEEK_TO_TIME:
+    case STREAM_CTRL_SET_ANGLE:
+      // these move the underlying stream
+      stream_probe_sync(s);
+      stream_probe_free(s);
+    }
+  }
 #ifdef CONFIG_STREAM_CACHE
   if (s->cache_pid)
     return cache_do_control(s, cmd, arg);
@@ -540,10 +748,7 @@ void free_stream(stream_t *s){
 #ifdef CONFIG_STREAM_CACHE
     cache_uninit(s);
 #endif
-  if (s->capture_file) {
-    fclose(s->capture_file);
-    s->capture_file = NULL;
-  }
+  stream_capture_close(s);
 
   if(s->close) s->close(s);
   if(s->fd>0){
@@ -561,6 +766,7 @@ void free_stream(stream_t *s){
   // Disabled atm, i don't like that. s->priv can be anything after all
   // streams should destroy their priv on close
   //free(s->priv);
+  free(s->probe_buf);
   free(s->url);
   free(s);
 }
@@ -573,16 +779,34 @@ stream_t* new_ds_stream(demux_stream_t *ds) {
 
 void stream_set_interrupt_callback(int (*cb)(int)) {
     stream_check_interrupt_cb = cb;
+#if HAVE_PTHREADS
+    stream_interrupt_thread = pthread_self();
+#endif
+}
+
+void stream_interrupt(stream_t *s, int interrupt) {
+    s->interrupted = interrupt;
 }
 
 int stream_check_interrupt(int time) {
-    if(!stream_check_interrupt_cb) {
+    if(!stream_check_interrupt_cb
+#if HAVE_PTHREADS
+       // the callback may only be used by the thread that installed it
+       || !pthread_equal(pthread_self(), stream_interrupt_thread)
+#endif
+       ) {
         usec_sleep(time * 1000);
         return 0;
     }
     return stream_check_interrupt_cb(time);
 }
 
+int stream_interrupted(stream_t *s, int time) {
+    if(s->interrupted)
+        return 1;
+    return stream_check_interrupt(time) || s->interrupted;
+}
+
 /**
  * Helper function to read 16 bits little-endian and advance pointer
  */
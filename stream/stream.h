@@ -126,6 +126,7 @@ typedef struct streaming_control {
 	int (*streaming_read)( int fd, char *buffer, int buffer_size, struct streaming_control *stream_ctrl );
 	int (*streaming_seek)( int fd, int64_t pos, struct streaming_control *stream_ctrl );
 	void *data;
+	int64_t body_left; // unread response body of a keep-alive connection, -1 if it will be closed
 } streaming_ctrl_t;
 
 struct stream;
@@ -167,16 +168,30 @@ typedef struct stream {
   unsigned int buf_pos,buf_len;
   int64_t pos,start_pos,end_pos;
   int eof;
+  volatile int interrupted; // see stream_interrupt()
   int mode; //STREAM_READ or STREAM_WRITE
   unsigned int cache_pid;
   void* cache_data;
+  // read-only mapping of the whole stream data or NULL, see stream_peek().
+  // fill_buffer of a mapped stream must read from s->pos.
+  unsigned char *map;
+  int64_t map_size;
+  // start of the stream kept in memory for format probing, see
+  // stream_probe_start(). Reads from the underlying stream happen at
+  // probe_real_pos, s->pos is where the data in s->buffer ends.
+  unsigned char *probe_buf;
+  int64_t probe_start;
+  int probe_len, probe_alloc;
+  int probe_size; // maximum probe_len, 0 once probing has ended
+  int64_t probe_real_pos;
+  int64_t probe_hits; // bytes served from probe_buf
   void* priv; // used for DVD, TV, RTSP etc
   char* url;  // strdup() of filename/url
 #ifdef CONFIG_NETWORKING
   streaming_ctrl_t *streaming_ctrl;
 #endif
   unsigned char buffer[STREAM_BUFFER_SIZE>STREAM_MAX_SECTOR_SIZE?STREAM_BUFFER_SIZE:STREAM_MAX_SECTOR_SIZE];
-  FILE *capture_file;
+  struct stream_capture *capture;
 } stream_t;
 
 #ifdef CONFIG_NETWORKING
@@ -185,6 +200,9 @@ typedef struct stream {
 
 int stream_fill_buffer(stream_t *s);
 int stream_seek_long(stream_t *s, int64_t pos);
+typedef struct stream_capture stream_capture_t;
+int stream_capture_open(stream_t *s, const char *filename);
+void stream_capture_close(stream_t *s);
 void stream_capture_do(stream_t *s);
 
 #ifdef CONFIG_STREAM_CACHE
@@ -354,6 +372,37 @@ static inline int stream_skip(stream_t *s, int64_t len)
   return 1;
 }
 
+/**
+ * \brief get a pointer to the next len bytes without copying them
+ * \return pointer into the memory mapping of the stream, valid until the
+ *         stream is closed and not to be modified, or NULL if the stream
+ *         can not provide the data that way (use stream_read() then).
+ *         The stream position is not changed.
+ */
+unsigned char *stream_peek(stream_t *s, int len);
+/// Like stream_peek(), but also skips over the returned bytes.
+unsigned char *stream_borrow(stream_t *s, int len);
+/**
+ * \brief get a pointer to the data at the current position without copying
+ * \param len in: maximum wanted, out: number of bytes available, which is
+ *            less if only that much is mapped or in the stream buffer
+ * \return pointer into the mapping or the stream buffer, NULL at EOF.
+ *         Only valid until the next stream operation.
+ *         The buffer is filled if it is empty, the stream position is not
+ *         changed.
+ */
+unsigned char *stream_peek_buffer(stream_t *s, int *len);
+/**
+ * \brief keep the data read from the current position on in memory
+ * \param size how much to keep at most
+ * \return 0 if the stream is not probed that way (e.g. cached or mapped)
+ *
+ * Meant for probing the stream format: seeks back into the kept data do not
+ * touch the underlying stream. After stream_probe_end() the data is still
+ * used until the stream is read or seeked past it.
+ */
+int stream_probe_start(stream_t *s, int size);
+void stream_probe_end(stream_t *s);
 void stream_reset(stream_t *s);
 int stream_control(stream_t *s, int cmd, void *arg);
 stream_t* new_stream(int fd,int type);
@@ -365,14 +414,23 @@ stream_t* open_output_stream(const char* filename,char** options);
 /// Set the callback to be used by libstream to check for user
 /// interruption during long blocking operations (cache filling, etc).
 void stream_set_interrupt_callback(int (*cb)(int));
+/// Make reads of s give up instead of waiting or retrying, so that another
+/// thread blocked reading s can be stopped.
+void stream_interrupt(stream_t *s, int interrupt);
 /// Call the interrupt checking callback if there is one and
 /// wait for time milliseconds
 int stream_check_interrupt(int time);
+/// Like stream_check_interrupt(), but also report stream_interrupt() of s
+int stream_interrupted(stream_t *s, int time);
 /// Internal read function bypassing the stream buffer
 int stream_read_internal(stream_t *s, void *buf, int len);
 /// Internal seek function bypassing the stream buffer
 int stream_seek_internal(stream_t *s, int64_t newpos);
 
+extern int stream_file_mmap;
+extern int stream_file_readahead;
+extern int stream_capture_buffer;
+
 extern int bluray_angle;
 extern int bluray_chapter;
 extern int dvd_speed;
@@ -19,10 +19,21 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#if HAVE_AIO
+#include <aio.h>
+#include <signal.h>
+#endif
 #if HAVE_SETMODE
 #include <io.h>
 #endif
@@ -37,6 +48,9 @@
 #include "m_option.h"
 #include "m_struct.h"
 
+int stream_file_mmap = 0;
+int stream_file_readahead = 0;
+
 static struct stream_priv_s {
   char* filename;
   char *filename2;
@@ -65,6 +79,201 @@ static int fill_buffer(stream_t *s, char* buffer, int max_len){
   return (r <= 0) ? -1 : r;
 }
 
+#if HAVE_SYS_MMAN_H
+static int fill_buffer_mmap(stream_t *s, char* buffer, int max_len){
+  int64_t left = s->map_size - s->pos;
+  if (left <= 0) {
+    // the file might have grown since it was mapped
+    if (lseek(s->fd, s->pos, SEEK_SET) < 0) return -1;
+    return fill_buffer(s, buffer, max_len);
+  }
+  if (max_len > left) max_len = left;
+  memcpy(buffer, s->map + s->pos, max_len);
+  return max_len;
+}
+
+static void close_mmap(stream_t *s) {
+  munmap(s->map, s->map_size);
+  s->map = NULL;
+}
+
+static void map_file(stream_t *s, int fd, int64_t len) {
+  void *map;
+  if (len <= 0 || (uint64_t)len > SIZE_MAX) return;
+  map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    mp_msg(MSGT_OPEN,MSGL_V,"[file] mmap failed: %s\n", strerror(errno));
+    return;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(map, len, MADV_SEQUENTIAL);
+#endif
+  s->map = map;
+  s->map_size = len;
+  s->fill_buffer = fill_buffer_mmap;
+  s->close = close_mmap;
+  mp_msg(MSGT_OPEN,MSGL_V,"[file] File is memory mapped\n");
+}
+#endif
+
+#if HAVE_AIO
+#define READAHEAD_BLOCK (64*1024)
+
+typedef struct {
+  struct aiocb cb;
+  int64_t block; // file position / READAHEAD_BLOCK, -1 if the slot is unused
+  int done;      // request finished, result is in len
+  int len;
+  unsigned char *buf;
+} ra_req_t;
+
+/// read-ahead state, block n is always kept in req[n % num]
+struct readahead {
+  ra_req_t *req;
+  int num;
+  int64_t cur_block;
+  unsigned reads, blocked;
+  int failed;    // no usable AIO, plain reads are used instead
+};
+
+static void ra_wait(ra_req_t *r) {
+  const struct aiocb *list[1] = { &r->cb };
+  while (aio_error(&r->cb) == EINPROGRESS)
+    aio_suspend(list, 1, NULL);
+}
+
+static void ra_retire(ra_req_t *r) {
+  if (r->block < 0) return;
+  if (!r->done) {
+    // aio_cancel() is not reliable with all implementations, and a
+    // single block does not take long to finish anyway
+    ra_wait(r);
+    aio_return(&r->cb);
+  }
+  r->block = -1;
+}
+
+static int ra_submit(stream_t *s, ra_req_t *r, int64_t block) {
+  memset(&r->cb, 0, sizeof(r->cb));
+  r->cb.aio_fildes = s->fd;
+  r->cb.aio_offset = block * READAHEAD_BLOCK;
+  r->cb.aio_buf = r->buf;
+  r->cb.aio_nbytes = READAHEAD_BLOCK;
+  r->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+  if (aio_read(&r->cb) < 0) {
+    mp_msg(MSGT_STREAM,MSGL_V,"[file] aio_read failed: %s\n", strerror(errno));
+    return 0;
+  }
+  r->block = block;
+  r->done = 0;
+  return 1;
+}
+
+static void readahead_free(stream_t *s) {
+  struct readahead *ra = s->priv;
+  int i;
+  if (!ra) return;
+  for (i = 0; ra->req && i < ra->num; i++) {
+    ra_retire(&ra->req[i]);
+    free(ra->req[i].buf);
+  }
+  mp_msg(MSGT_STREAM,MSGL_V,"[file] read-ahead: %u of %u reads had to wait\n",
+         ra->blocked, ra->reads);
+  free(ra->req);
+  free(ra);
+  s->priv = NULL;
+}
+
+static int fill_buffer_readahead(stream_t *s, char* buffer, int max_len){
+  struct readahead *ra = s->priv;
+  int64_t block = s->pos / READAHEAD_BLOCK;
+  int off = s->pos % READAHEAD_BLOCK;
+  ra_req_t *r = &ra->req[block % ra->num];
+  int len;
+
+  if (ra->failed) {
+    // copies of the stream (the cache makes one) share the file offset
+    if (lseek(s->fd, s->pos, SEEK_SET) < 0) return -1;
+    return fill_buffer(s, buffer, max_len);
+  }
+  if (block != ra->cur_block) {
+    // move the window, this also drops everything left over from before a seek
+    int64_t b;
+    for (b = block; b < block + ra->num; b++) {
+      ra_req_t *w = &ra->req[b % ra->num];
+      if (w->block == b) continue;
+      ra_retire(w);
+      if (b > block && b * READAHEAD_BLOCK >= s->end_pos) continue;
+      if (!ra_submit(s, w, b)) {
+        // No usable AIO, fall back to plain reads. Other copies of the
+        // stream share ra, so it stays until close_readahead().
+        int i;
+        for (i = 0; i < ra->num; i++)
+          ra_retire(&ra->req[i]);
+        ra->failed = 1;
+        if (lseek(s->fd, s->pos, SEEK_SET) < 0) return -1;
+        return fill_buffer(s, buffer, max_len);
+      }
+    }
+    ra->cur_block = block;
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(s->fd, (block + ra->num) * READAHEAD_BLOCK,
+                  (off_t)ra->num * READAHEAD_BLOCK, POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  ra->reads++;
+  if (!r->done) {
+    if (aio_error(&r->cb) == EINPROGRESS) {
+      ra->blocked++;
+      ra_wait(r);
+    }
+    r->len = aio_return(&r->cb);
+    r->done = 1;
+  }
+
+  len = r->len - off;
+  if (len <= 0) {
+    // read it again next time in case the file grows
+    ra_retire(r);
+    ra->cur_block = -1;
+    if (r->len >= 0 && max_len) s->eof = 1;
+    return -1;
+  }
+  if (len > max_len) len = max_len;
+  memcpy(buffer, r->buf + off, len);
+  return len;
+}
+
+static void close_readahead(stream_t *s) {
+  readahead_free(s);
+}
+
+static void start_readahead(stream_t *s, int num) {
+  struct readahead *ra = calloc(1, sizeof(*ra));
+  int i;
+  if (!ra) return;
+  if (num > 64) num = 64;
+  ra->req = calloc(num, sizeof(*ra->req));
+  ra->num = num;
+  ra->cur_block = -1;
+  s->priv = ra;
+  for (i = 0; ra->req && i < num; i++)
+    ra->req[i].block = -1;
+  for (i = 0; ra->req && i < num; i++)
+    if (!(ra->req[i].buf = malloc(READAHEAD_BLOCK)))
+      break;
+  if (!ra->req || i < num) {
+    readahead_free(s);
+    return;
+  }
+  s->fill_buffer = fill_buffer_readahead;
+  s->close = close_readahead;
+  mp_msg(MSGT_OPEN,MSGL_V,"[file] Reading ahead %d kB\n",
+         num * READAHEAD_BLOCK / 1024);
+}
+#endif
+
 static int write_buffer(stream_t *s, char* buffer, int len) {
   int r;
   int wr = 0;
@@ -230,6 +439,19 @@ static int open_f(stream_t *stream,int mode, void* opts, int* file_format) {
   stream->write_buffer = write_buffer;
   stream->control = control;
   stream->read_chunk = 64*1024;
+#if HAVE_SYS_MMAN_H
+  if (stream_file_mmap && mode == STREAM_READ && stream->type == STREAMTYPE_FILE)
+    map_file(stream, f, len);
+#endif
+  if (stream_file_readahead > 0 && mode == STREAM_READ &&
+      stream->type == STREAMTYPE_FILE && !stream->map) {
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#if HAVE_AIO
+    start_readahead(stream, stream_file_readahead);
+#endif
+  }
 
   m_struct_free(&stream_opts,opts);
   return STREAM_OK;
@@ -30,6 +30,7 @@
 #include "stream.h"
 #include "url.h"
 #include "udp.h"
+#include "udp_recv.h"
 #include "rtp.h"
 
 static int
@@ -65,6 +66,9 @@ rtp_streaming_start (stream_t *stream)
   streaming_ctrl->buffering = 0;
   streaming_ctrl->status = streaming_playing_e;
 
+  if (udp_recv_start (stream, 1) < 0)
+    mp_msg (MSGT_NETWORK, MSGL_V, "Reading datagrams without a receive thread\n");
+
   return 0;
 }
 
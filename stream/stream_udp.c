@@ -30,6 +30,7 @@
 #include "stream.h"
 #include "url.h"
 #include "udp.h"
+#include "udp_recv.h"
 
 static int
 udp_streaming_start (stream_t *stream)
@@ -57,6 +58,9 @@ udp_streaming_start (stream_t *stream)
   streaming_ctrl->buffering = 0;
   streaming_ctrl->status = streaming_playing_e;
 
+  if (udp_recv_start (stream, 0) < 0)
+    mp_msg (MSGT_NETWORK, MSGL_V, "Reading datagrams without a receive thread\n");
+
   return 0;
 }
 
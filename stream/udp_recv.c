@@ -0,0 +1,419 @@
+/*
+ * batched UDP/RTP datagram receiver with a jitter buffer
+ *
+ * A thread pulls the datagrams off the socket, several per system call
+ * with recvmmsg() where available, and files them by RTP sequence number
+ * into a ring of packet slots. The stream read function hands them out in
+ * sequence order, waiting up to -rtp-jitter milliseconds for a missing
+ * packet before it is counted as lost. Plain UDP datagrams are numbered
+ * in arrival order, so the ring only decouples reading from the socket.
+ *
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#if !HAVE_WINSOCK2_H
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#endif
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "mp_msg.h"
+#include "osdep/timer.h"
+#include "network.h"
+#include "stream.h"
+#include "udp_recv.h"
+
+int rtp_jitter = 50;
+
+#if HAVE_PTHREADS
+
+#define UDP_BATCH       32   // datagrams fetched per receive call
+#define JB_SLOTS      1024   // packets the jitter buffer holds, power of 2
+#define JB_RESYNC     3000   // sequence jumps beyond this restart the buffer
+#define STATS_INTERVAL 10000 // ms between counter reports while losing packets
+
+typedef struct {
+  unsigned char data[STREAM_BUFFER_SIZE];
+  int len;
+  uint16_t seq;
+  int full;      // holds a packet that has not been read yet
+  int delivered; // the packet with this seq has been read
+} jb_slot_t;
+
+typedef struct {
+  int fd;
+  int rtp;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;  // receiver -> reader: new packets or error
+  int quit;
+  int error;
+  jb_slot_t *slot;
+  int started;
+  uint16_t next;        // sequence number the reader wants next
+  uint16_t highest;     // highest sequence number received so far
+  uint16_t in_seq;      // numbering of plain UDP datagrams
+  int pos;              // read offset into the packet at next
+  unsigned gap_start;   // when the reader started waiting for next
+  int in_gap;
+  udp_recv_stats_t stats;
+  // only used by the receiver thread
+  unsigned char batch[UDP_BATCH][STREAM_BUFFER_SIZE];
+  int batch_len[UDP_BATCH];
+} udp_recv_t;
+
+static void cond_wait_ms(udp_recv_t *r, int ms)
+{
+  struct timeval now;
+  struct timespec timeout;
+  gettimeofday(&now, NULL);
+  timeout.tv_sec  = now.tv_sec + ms / 1000;
+  timeout.tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * 1000;
+  if (timeout.tv_nsec >= 1000000000) {
+    timeout.tv_sec++;
+    timeout.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&r->cond, &r->mutex, &timeout);
+}
+
+static void print_stats(udp_recv_t *r, int level)
+{
+  udp_recv_stats_t *st = &r->stats;
+  mp_msg(MSGT_NETWORK, level, "[udp] %u packets in %u reads, %u lost, "
+         "%u reordered, %u duplicate, %u late, %u overflow, %u resync, "
+         "depth %d (max %d)\n", st->packets, st->reads, st->lost,
+         st->reordered, st->duplicate, st->late, st->overflow, st->resync,
+         st->depth, st->max_depth);
+}
+
+/**
+ * Give up on the packet at r->next, either because it never arrived or
+ * because the buffer is full and it was never read. r->mutex must be locked.
+ */
+static void jb_skip(udp_recv_t *r)
+{
+  jb_slot_t *slot = &r->slot[r->next & (JB_SLOTS - 1)];
+  if (slot->full && slot->seq == r->next) {
+    slot->full = 0;
+    r->stats.depth--;
+    r->stats.overflow++;
+  } else {
+    mp_msg(MSGT_NETWORK, MSGL_DBG2, "[udp] lost packet %u\n", r->next);
+    r->stats.lost++;
+  }
+  slot->seq = r->next;
+  slot->delivered = 0;
+  r->next++;
+  r->pos = 0;
+  r->in_gap = 0;
+}
+
+static void jb_resync(udp_recv_t *r, uint16_t seq)
+{
+  int i;
+  mp_msg(MSGT_NETWORK, MSGL_V, "[udp] sequence jump %u -> %u, restarting\n",
+         r->next, seq);
+  for (i = 0; i < JB_SLOTS; i++) {
+    r->slot[i].full = 0;
+    r->slot[i].delivered = 0;
+  }
+  r->stats.depth = 0;
+  r->stats.resync++;
+  r->next = r->highest = seq;
+  r->pos = 0;
+  r->in_gap = 0;
+}
+
+static void jb_insert(udp_recv_t *r, uint16_t seq, const unsigned char *data, int len)
+{
+  jb_slot_t *slot;
+  int d;
+
+  if (!r->started) {
+    r->next = r->highest = seq;
+    r->started = 1;
+  }
+  d = (int16_t)(seq - r->next);
+  if (d > JB_RESYNC || d < -JB_RESYNC) {
+    jb_resync(r, seq);
+    d = 0;
+  }
+  slot = &r->slot[seq & (JB_SLOTS - 1)];
+  if (d < 0) {
+    if (slot->seq == seq && slot->delivered)
+      r->stats.duplicate++;
+    else
+      r->stats.late++;
+    return;
+  }
+  // make room by dropping the oldest packets
+  for (; d >= JB_SLOTS; d--)
+    jb_skip(r);
+  if (slot->full && slot->seq == seq) {
+    r->stats.duplicate++;
+    return;
+  }
+  if ((int16_t)(seq - r->highest) < 0)
+    r->stats.reordered++;
+  else
+    r->highest = seq;
+  memcpy(slot->data, data, len);
+  slot->len = len;
+  slot->seq = seq;
+  slot->full = 1;
+  slot->delivered = 0;
+  if (++r->stats.depth > r->stats.max_depth)
+    r->stats.max_depth = r->stats.depth;
+}
+
+/**
+ * Locate the payload of an RTP packet.
+ * Returns the payload size or -1 if the packet is invalid.
+ */
+static int rtp_payload(const unsigned char *p, int len, uint16_t *seq, int *offset)
+{
+  int hdr;
+  if (len < 12)
+    return -1;
+  hdr = 12 + 4 * (p[0] & 0x0f);
+  if (p[0] & 0x10) { // header extension
+    if (len < hdr + 4)
+      return -1;
+    hdr += 4 + 4 * (p[hdr + 2] << 8 | p[hdr + 3]);
+  }
+  if (p[0] & 0x20) // padding
+    len -= p[len - 1];
+  if (len < hdr)
+    return -1;
+  *seq = p[2] << 8 | p[3];
+  *offset = hdr;
+  return len - hdr;
+}
+
+static void add_packet(udp_recv_t *r, const unsigned char *p, int len)
+{
+  uint16_t seq;
+  int offset = 0;
+  r->stats.packets++;
+  if (r->rtp) {
+    len = rtp_payload(p, len, &seq, &offset);
+    if (len < 0) {
+      mp_msg(MSGT_NETWORK, MSGL_DBG2, "[udp] invalid RTP packet\n");
+      return;
+    }
+  } else
+    seq = r->in_seq++;
+  jb_insert(r, seq, p + offset, len);
+}
+
+/**
+ * Fetch the datagrams waiting on the socket into r->batch.
+ * Returns their number, 0 if there were none or -1 on error.
+ */
+static int receive_batch(udp_recv_t *r)
+{
+  int n;
+#if HAVE_RECVMMSG
+  struct mmsghdr msg[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  int i;
+  memset(msg, 0, sizeof(msg));
+  for (i = 0; i < UDP_BATCH; i++) {
+    iov[i].iov_base = r->batch[i];
+    iov[i].iov_len  = STREAM_BUFFER_SIZE;
+    msg[i].msg_hdr.msg_iov    = &iov[i];
+    msg[i].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg(r->fd, msg, UDP_BATCH, MSG_DONTWAIT, NULL);
+  for (i = 0; i < n; i++)
+    r->batch_len[i] = msg[i].msg_len;
+#else
+  int len;
+  for (n = 0; n < UDP_BATCH; n++) {
+#ifdef MSG_DONTWAIT
+    len = recv(r->fd, r->batch[n], STREAM_BUFFER_SIZE, MSG_DONTWAIT);
+#else
+    len = n ? -1 : recv(r->fd, r->batch[n], STREAM_BUFFER_SIZE, 0);
+#endif
+    if (len < 0)
+      break;
+    r->batch_len[n] = len;
+  }
+  if (n > 0)
+    return n;
+  n = -1;
+#endif
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  return n;
+}
+
+static void *receiver_thread(void *arg)
+{
+  udp_recv_t *r = arg;
+  unsigned last_report = GetTimerMS();
+  unsigned reported = 0;
+  int i, n;
+
+  while (!r->quit) {
+    fd_set set;
+    struct timeval tv;
+    FD_ZERO(&set);
+    FD_SET(r->fd, &set);
+    tv.tv_sec  = 0;
+    tv.tv_usec = 100000;
+    n = select(r->fd + 1, &set, NULL, NULL, &tv);
+    if (n > 0)
+      n = receive_batch(r);
+    else if (n < 0 && errno == EINTR)
+      n = 0;
+    pthread_mutex_lock(&r->mutex);
+    if (n < 0) {
+      mp_msg(MSGT_NETWORK, MSGL_ERR, "[udp] receive error: %s\n", strerror(errno));
+      r->error = 1;
+    } else if (n > 0) {
+      r->stats.reads++;
+      for (i = 0; i < n; i++)
+        add_packet(r, r->batch[i], r->batch_len[i]);
+    }
+    if (r->stats.lost + r->stats.overflow != reported &&
+        GetTimerMS() - last_report >= STATS_INTERVAL) {
+      reported = r->stats.lost + r->stats.overflow;
+      last_report = GetTimerMS();
+      print_stats(r, MSGL_V);
+    }
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    if (n < 0)
+      break;
+  }
+  return NULL;
+}
+
+static int udp_recv_read(int fd, char *buffer, int size, streaming_ctrl_t *sc)
+{
+  udp_recv_t *r = sc->data;
+  jb_slot_t *slot;
+  int len = 0;
+
+  pthread_mutex_lock(&r->mutex);
+  while (!len) {
+    slot = &r->slot[r->next & (JB_SLOTS - 1)];
+    if (slot->full && slot->seq == r->next) {
+      len = slot->len - r->pos;
+      if (len > size)
+        len = size;
+      memcpy(buffer, slot->data + r->pos, len);
+      r->pos += len;
+      r->in_gap = 0;
+      if (r->pos >= slot->len) {
+        slot->full = 0;
+        slot->delivered = 1;
+        r->stats.depth--;
+        r->next++;
+        r->pos = 0;
+      }
+    } else if (r->error) {
+      len = -1;
+    } else if (r->stats.depth > 0) {
+      // a later packet is already here, give the missing one a moment
+      int waited;
+      if (!r->in_gap) {
+        r->in_gap = 1;
+        r->gap_start = GetTimerMS();
+      }
+      waited = GetTimerMS() - r->gap_start;
+      if (waited >= rtp_jitter)
+        jb_skip(r);
+      else
+        cond_wait_ms(r, rtp_jitter - waited);
+    } else
+      cond_wait_ms(r, 100);
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return len;
+}
+
+static void udp_recv_close(stream_t *stream)
+{
+  udp_recv_t *r = stream->streaming_ctrl->data;
+  if (!r)
+    return;
+  pthread_mutex_lock(&r->mutex);
+  r->quit = 1;
+  pthread_mutex_unlock(&r->mutex);
+  pthread_join(r->thread, NULL);
+  print_stats(r, r->stats.lost || r->stats.overflow ? MSGL_INFO : MSGL_V);
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->mutex);
+  free(r->slot);
+  free(r);
+  stream->streaming_ctrl->data = NULL;
+}
+
+int udp_recv_start(stream_t *stream, int rtp)
+{
+  udp_recv_t *r = calloc(1, sizeof(*r));
+  if (!r)
+    return -1;
+  r->slot = calloc(JB_SLOTS, sizeof(*r->slot));
+  if (!r->slot) {
+    free(r);
+    return -1;
+  }
+  r->fd  = stream->fd;
+  r->rtp = rtp;
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  if (pthread_create(&r->thread, NULL, receiver_thread, r)) {
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+    free(r->slot);
+    free(r);
+    return -1;
+  }
+  stream->streaming_ctrl->data = r;
+  stream->streaming_ctrl->streaming_read = udp_recv_read;
+  stream->close = udp_recv_close;
+  mp_msg(MSGT_NETWORK, MSGL_V, "[udp] receiving on a separate thread%s\n",
+         HAVE_RECVMMSG ? " with recvmmsg()" : "");
+  return 0;
+}
+
+#else /* HAVE_PTHREADS */
+
+int udp_recv_start(stream_t *stream, int rtp)
+{
+  return -1;
+}
+
+#endif /* HAVE_PTHREADS */
@@ -0,0 +1,46 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MPLAYER_UDP_RECV_H
+#define MPLAYER_UDP_RECV_H
+
+#include "stream.h"
+
+extern int rtp_jitter;
+
+typedef struct {
+  unsigned packets;   // datagrams received
+  unsigned reads;     // receive calls that returned data
+  unsigned lost;      // RTP packets given up on
+  unsigned reordered; // RTP packets that arrived after a later one
+  unsigned duplicate; // RTP packets received twice
+  unsigned late;      // RTP packets that arrived after being given up on
+  unsigned overflow;  // packets dropped because the buffer was full
+  unsigned resync;    // sequence number jumps that restarted the buffer
+  int depth;          // packets currently buffered
+  int max_depth;
+} udp_recv_stats_t;
+
+/**
+ * Receive the datagrams of stream->fd on a separate thread and read them
+ * back through a jitter buffer, strip and reorder RTP headers if rtp is set.
+ * Returns -1 (leaving the stream untouched) if that is not possible.
+ */
+int udp_recv_start(stream_t *stream, int rtp);
+
+#endif /* MPLAYER_UDP_RECV_H */